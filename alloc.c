@@ -0,0 +1,185 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	alloc.c
+ *
+ */
+
+#include <stdlib.h>
+
+#include "alloc.h"
+
+/*
+ * Segment tree over [0, size), size a power of two, node 1 is the root and
+ * node n has children 2n and 2n+1. Blocks past nblocks count as in use.
+ * A pending range assignment is kept in tag and pushed down when a node is
+ * visited, so marking a run touches O(log n) nodes.
+ */
+struct ext_tree {
+	int size;
+	int *pref;						/* free run at the start of the range */
+	int *suf;						/* free run at the end of the range */
+	int *best;						/* longest free run in the range */
+	signed char *tag;				/* pending assignment: -1 none, 0 free, 1 used */
+};
+
+static struct ext_tree tree;
+
+static int max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+static void apply(int node, int len, int used)
+{
+	tree.pref[node] = tree.suf[node] = tree.best[node] = used ? 0 : len;
+	tree.tag[node] = used;
+}
+
+static void push(int node, int len)
+{
+	if (tree.tag[node] < 0)
+		return;
+	apply(2 * node, len / 2, tree.tag[node]);
+	apply(2 * node + 1, len / 2, tree.tag[node]);
+	tree.tag[node] = -1;
+}
+
+static void pull(int node, int len)
+{
+	int l = 2 * node, r = 2 * node + 1, half = len / 2;
+
+	tree.pref[node] = tree.pref[l] == half ? half + tree.pref[r] : tree.pref[l];
+	tree.suf[node] = tree.suf[r] == half ? half + tree.suf[l] : tree.suf[r];
+	tree.best[node] = max(max(tree.best[l], tree.best[r]), tree.suf[l] + tree.pref[r]);
+}
+
+static void build(int node, int lo, int hi, const unsigned char *bitmap, int nblocks)
+{
+	tree.tag[node] = -1;
+	if (hi - lo == 1)
+	{
+		int used = lo >= nblocks || (bitmap[lo / 8] & (1 << (lo & 7)));
+		tree.pref[node] = tree.suf[node] = tree.best[node] = !used;
+		return;
+	}
+	int mid = (lo + hi) / 2;
+	build(2 * node, lo, mid, bitmap, nblocks);
+	build(2 * node + 1, mid, hi, bitmap, nblocks);
+	pull(node, hi - lo);
+}
+
+static void assign(int node, int lo, int hi, int start, int end, int used)
+{
+	if (end <= lo || hi <= start)
+		return;
+	if (start <= lo && hi <= end)
+	{
+		apply(node, hi - lo, used);
+		return;
+	}
+	int mid = (lo + hi) / 2;
+	push(node, hi - lo);
+	assign(2 * node, lo, mid, start, end, used);
+	assign(2 * node + 1, mid, hi, start, end, used);
+	pull(node, hi - lo);
+}
+
+// Lowest start >= goal of count free blocks in [lo, hi), -1 if none
+static int find(int node, int lo, int hi, int count, int goal)
+{
+	if (hi <= goal || tree.best[node] < count)
+		return -1;
+	if (hi - lo == 1)
+		return lo;
+	int mid = (lo + hi) / 2;
+	push(node, hi - lo);
+
+	// Step 1: a run inside the left half
+	if (goal < mid)
+	{
+		int start = find(2 * node, lo, mid, count, goal);
+		if (start >= 0)
+			return start;
+	}
+
+	// Step 2: a run crossing the middle, starting in the left half's free tail
+	int start = max(mid - tree.suf[2 * node], goal);
+	if (start < mid && mid - start + tree.pref[2 * node + 1] >= count)
+		return start;
+
+	// Step 3: a run inside the right half
+	return find(2 * node + 1, mid, hi, count, goal);
+}
+
+int ext_init(const unsigned char *bitmap, int nblocks)
+{
+	ext_destroy();
+	tree.size = 1;
+	while (tree.size < nblocks)
+		tree.size *= 2;
+	tree.pref = (int *)malloc(2 * tree.size * sizeof(int));
+	tree.suf = (int *)malloc(2 * tree.size * sizeof(int));
+	tree.best = (int *)malloc(2 * tree.size * sizeof(int));
+	tree.tag = (signed char *)malloc(2 * tree.size);
+	if (!tree.pref || !tree.suf || !tree.best || !tree.tag)
+	{
+		ext_destroy();
+		return -1;
+	}
+	build(1, 0, tree.size, bitmap, nblocks);
+	return 0;
+}
+
+void ext_destroy()
+{
+	free(tree.pref);
+	free(tree.suf);
+	free(tree.best);
+	free(tree.tag);
+	tree.pref = tree.suf = tree.best = NULL;
+	tree.tag = NULL;
+	tree.size = 0;
+}
+
+int ext_alloc(int count, int goal)
+{
+	if (count <= 0 || tree.size == 0)
+		return -1;
+	int start = find(1, 0, tree.size, count, goal > 0 ? goal : 0);
+	if (start < 0 && goal > 0)
+		start = find(1, 0, tree.size, count, 0);
+	if (start >= 0)
+		assign(1, 0, tree.size, start, start + count, 1);
+	return start;
+}
+
+void ext_mark(int start, int count, int used)
+{
+	if (tree.size > 0)
+		assign(1, 0, tree.size, start, start + count, used);
+}
+
+// Sum of free blocks, by walking down to the ranges that are all free or all used
+static int count_free(int node, int lo, int hi)
+{
+	if (tree.best[node] == 0)
+		return 0;
+	if (tree.best[node] == hi - lo)
+		return hi - lo;
+	int mid = (lo + hi) / 2;
+	push(node, hi - lo);
+	return count_free(2 * node, lo, mid) + count_free(2 * node + 1, mid, hi);
+}
+
+int ext_free_blocks()
+{
+	return tree.size ? count_free(1, 0, tree.size) : 0;
+}
+
+int ext_largest()
+{
+	return tree.size ? tree.best[1] : 0;
+}
@@ -0,0 +1,33 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	alloc.h
+ *
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+/*
+ * Free extent index over the data block bitmap. Every node of a segment tree
+ * knows the longest free run in its range and the free runs touching either
+ * end, so finding count contiguous free blocks and marking a range are both
+ * O(log n). It lives in memory only and is rebuilt from the bitmap at mount.
+ */
+
+/* Build the index from a bitmap of nblocks blocks (set bits are in use) */
+int ext_init(const unsigned char *bitmap, int nblocks);
+void ext_destroy();
+
+/* First run of count free blocks at or after goal, else the first one
+ * anywhere. The run is marked in use, returns its first block or -1 */
+int ext_alloc(int count, int goal);
+
+/* Mark count blocks from start as used (1) or free (0) */
+void ext_mark(int start, int count, int used);
+
+/* Free blocks and the longest free run */
+int ext_free_blocks();
+int ext_largest();
+
+#endif
@@ -0,0 +1,167 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Buffered versus O_DIRECT device mode. Mount rufs twice on the same image,
+ * once plainly and once with -o odirect, and run this against each:
+ *
+ *	./direct_bench MOUNTDIR DISKFILE[:DISKFILE...] [RUFS_PID]
+ *
+ * It writes and reads back a set of files through the mount, then reports the
+ * throughput, how much of the backing files sits in the host page cache, how
+ * much of the mounted files sits in the FUSE page cache, and the resident set
+ * of the rufs process when its pid is given.
+ */
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/yw1017/mountdir"
+#define DISKFILE "./DISKFILE"
+
+#define N_FILES 256
+#define BLOCKSIZE 4096
+#define FILE_BLOCKS 16
+#define READ_ROUNDS 4
+#define FSPATHLEN 256
+#define FILEPERM 0666
+
+char buf[FILE_BLOCKS * BLOCKSIZE];
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Pages of a file resident in the page cache, -1 if it cannot be mapped */
+static long resident_pages(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	long count = 0;
+
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+		if (fd >= 0)
+			close(fd);
+		return fd < 0 ? -1 : 0;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	long page = sysconf(_SC_PAGESIZE);
+	size_t pages = (st.st_size + page - 1) / page;
+	unsigned char *vec = malloc(pages);
+	if (vec && mincore(map, st.st_size, vec) == 0) {
+		for (size_t i = 0; i < pages; i++)
+			count += vec[i] & 1;
+	} else {
+		count = -1;
+	}
+	free(vec);
+	munmap(map, st.st_size);
+	return count;
+}
+
+/* VmRSS of a process in kB, -1 if unknown */
+static long process_rss(const char *pid)
+{
+	char path[FSPATHLEN], line[256];
+	long kb = -1;
+
+	snprintf(path, sizeof(path), "/proc/%s/status", pid);
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+int main(int argc, char **argv) {
+
+	const char *dir = argc > 1 ? argv[1] : TESTDIR;
+	const char *disk = argc > 2 ? argv[2] : DISKFILE;
+	char path[FSPATHLEN];
+	size_t file_size = sizeof(buf);
+	int i, r, fd;
+
+	/* TEST 1: write every file whole and flush it */
+	double start = now();
+	for (i = 0; i < N_FILES; i++) {
+		memset(buf, 'a' + i % 26, file_size);
+		sprintf(path, "%s/bench%d", dir, i);
+		if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, FILEPERM)) < 0) {
+			perror("open");
+			exit(1);
+		}
+		if (write(fd, buf, file_size) != file_size) {
+			printf("TEST 1: File write failure \n");
+			exit(1);
+		}
+		fsync(fd);
+		close(fd);
+	}
+	double write_time = now() - start;
+
+	/* TEST 2: read every file back several times */
+	start = now();
+	for (r = 0; r < READ_ROUNDS; r++) {
+		for (i = 0; i < N_FILES; i++) {
+			sprintf(path, "%s/bench%d", dir, i);
+			if ((fd = open(path, O_RDONLY)) < 0) {
+				perror("open");
+				exit(1);
+			}
+			if (read(fd, buf, file_size) != file_size || buf[0] != 'a' + i % 26) {
+				printf("TEST 2: File read failure \n");
+				exit(1);
+			}
+			close(fd);
+		}
+	}
+	double read_time = now() - start;
+
+	/* TEST 3: memory held by the two page caches */
+	long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+	long disk_pages = 0, mount_pages = 0;
+	char disks[FSPATHLEN * 4];
+	char *save = NULL;
+
+	snprintf(disks, sizeof(disks), "%s", disk);
+	for (char *p = strtok_r(disks, ":", &save); p; p = strtok_r(NULL, ":", &save)) {
+		long n = resident_pages(p);
+		disk_pages = n < 0 || disk_pages < 0 ? -1 : disk_pages + n;
+	}
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s/bench%d", dir, i);
+		long n = resident_pages(path);
+		mount_pages = n < 0 || mount_pages < 0 ? -1 : mount_pages + n;
+	}
+
+	double mb = (double)N_FILES * file_size / (1024 * 1024);
+	printf("write: %.1f MB in %.3f s, %.1f MB/s\n", mb, write_time, mb / write_time);
+	printf("read:  %.1f MB in %.3f s, %.1f MB/s\n", mb * READ_ROUNDS, read_time, mb * READ_ROUNDS / read_time);
+	printf("host page cache (DISKFILE): %ld kB\n", disk_pages < 0 ? -1 : disk_pages * page_kb);
+	printf("FUSE page cache (mount):    %ld kB\n", mount_pages < 0 ? -1 : mount_pages * page_kb);
+	if (argc > 3)
+		printf("rufs resident set:          %ld kB\n", process_rss(argv[3]));
+
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s/bench%d", dir, i);
+		unlink(path);
+	}
+	return 0;
+}
@@ -0,0 +1,629 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Concurrent load against a mounted file system:
+ *
+ *	./load_bench [-t THREADS] [-d SECONDS | -n OPS] [-m MIX] [-s SIZES]
+ *	             [-f FANOUT] [-p FILES] [-b IOSIZE] [-x MAXSIZE] [-S SEED] MOUNTDIR
+ *
+ * Each thread builds its own tree under MOUNTDIR/load.PID/tN: FANOUT
+ * directories and FILES files spread over them, then runs operations picked
+ * at random by weight until the time or operation count is up.
+ *
+ *	-m  operation weights, default
+ *	    create=5,stat=30,readdir=10,mkdir=1,seqread=20,randread=20,append=8,overwrite=6
+ *	-s  file size weights for create and the initial files, default 4k=40,16k=30,64k=30
+ *	-x  appends stop short of this size, default 64k (16 direct blocks)
+ *
+ * Every operation opens and closes what it works on, so its latency includes
+ * the path lookup. The results are one JSON object on stdout: per operation
+ * the count, failures, throughput and latency percentiles in microseconds.
+ * rufs does not remove files, so point it at a fresh image each run.
+ */
+
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_SIZES 16
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum { OP_CREATE, OP_STAT, OP_READDIR, OP_MKDIR, OP_SEQREAD, OP_RANDREAD, OP_APPEND, OP_OVERWRITE, NOPS };
+
+static const char *op_names[NOPS] = {
+	"create", "stat", "readdir", "mkdir", "seqread", "randread", "append", "overwrite"
+};
+
+struct opstat {
+	uint64_t count;					/* operations that succeeded */
+	uint64_t errors;
+	uint64_t skipped;				/* nothing to work on, e.g. every file is full */
+	uint64_t bytes;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t hist[HIST_BUCKETS];	/* latencies, 16 steps per power of two */
+};
+
+struct file {
+	int dir;
+	int name;
+	off_t size;
+};
+
+struct worker {
+	int id;
+	pthread_t tid;
+	uint64_t rng;
+	char (*dirs)[FSPATHLEN];
+	int ndirs, dcap;
+	struct file *files;
+	int nfiles, fcap;
+	int next_name;
+	char *buf;
+	int failed;						/* setup did not finish */
+	struct opstat stats[NOPS];
+};
+
+static const char *mount_dir;
+static int nthreads = 4;
+static double seconds = 10;
+static long ops_per_thread;
+static int fanout = 4;
+static int preload = 16;
+static size_t iosize = 4096;
+static off_t max_size = 64 * 1024;
+static uint64_t seed = 1;
+static int mix[NOPS] = { 5, 30, 10, 1, 20, 20, 8, 6 };
+static off_t sizes[MAX_SIZES] = { 4096, 16384, 65536 };
+static int size_weights[MAX_SIZES] = { 40, 30, 30 };
+static int nsizes = 3;
+
+static char run_dir[FSPATHLEN];
+static pthread_barrier_t start_line;
+static volatile int stop;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, one stream per thread */
+static uint64_t rnd(struct worker *w)
+{
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Index drawn from a weight table */
+static int pick(struct worker *w, const int *weights, int n)
+{
+	int total = 0, i;
+
+	for (i = 0; i < n; i++)
+		total += weights[i];
+	int r = rnd(w) % total;
+	for (i = 0; r >= weights[i]; i++)
+		r -= weights[i];
+	return i;
+}
+
+/*
+ * latency histogram
+ */
+static int hist_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+	int msb = 63 - __builtin_clzll(v);
+	return (msb - 3) * HIST_SUB + ((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+/* Middle of the values bucket i holds */
+static uint64_t hist_value(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+	int shift = i / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+static uint64_t hist_percentile(const struct opstat *s, double p)
+{
+	uint64_t want = (uint64_t)(p * s->count + 0.999999), seen = 0;
+
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += s->hist[i];
+		if (seen >= want)
+			return hist_value(i) < s->max_ns ? hist_value(i) : s->max_ns;
+	}
+	return s->max_ns;
+}
+
+static void record(struct opstat *s, uint64_t ns, long bytes)
+{
+	s->count++;
+	s->bytes += bytes;
+	s->sum_ns += ns;
+	if (ns > s->max_ns)
+		s->max_ns = ns;
+	s->hist[hist_index(ns)]++;
+}
+
+/*
+ * the tree a worker keeps track of
+ */
+static int add_dir(struct worker *w, const char *path)
+{
+	if (w->ndirs == w->dcap) {
+		int cap = w->dcap ? w->dcap * 2 : 64;
+		void *dirs = realloc(w->dirs, cap * sizeof(*w->dirs));
+		if (!dirs)
+			return -1;
+		w->dirs = dirs;
+		w->dcap = cap;
+	}
+	snprintf(w->dirs[w->ndirs++], FSPATHLEN, "%s", path);
+	return 0;
+}
+
+static int add_file(struct worker *w, int dir, int name, off_t size)
+{
+	if (w->nfiles == w->fcap) {
+		int cap = w->fcap ? w->fcap * 2 : 64;
+		void *files = realloc(w->files, cap * sizeof(*w->files));
+		if (!files)
+			return -1;
+		w->files = files;
+		w->fcap = cap;
+	}
+	w->files[w->nfiles].dir = dir;
+	w->files[w->nfiles].name = name;
+	w->files[w->nfiles].size = size;
+	w->nfiles++;
+	return 0;
+}
+
+static void file_path(struct worker *w, const struct file *f, char *path)
+{
+	snprintf(path, FSPATHLEN, "%s/f%d", w->dirs[f->dir], f->name);
+}
+
+/* Write size bytes in iosize pieces starting at off, bytes written or -1 */
+static long write_out(struct worker *w, int fd, off_t off, off_t size)
+{
+	off_t done = 0;
+
+	while (done < size) {
+		size_t n = size - done < (off_t)iosize ? (size_t)(size - done) : iosize;
+		if (pwrite(fd, w->buf, n, off + done) != (ssize_t)n)
+			return -1;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * operations, each returns the bytes it moved, -1 on failure or -2 when it
+ * had nothing to work on
+ */
+static long op_create(struct worker *w)
+{
+	char path[FSPATHLEN];
+	int dir = rnd(w) % w->ndirs, name = w->next_name++;
+	off_t size = sizes[pick(w, size_weights, nsizes)];
+
+	snprintf(path, sizeof(path), "%s/f%d", w->dirs[dir], name);
+	int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, FILEPERM);
+	if (fd < 0)
+		return -1;
+	long done = write_out(w, fd, 0, size);
+	if (close(fd) < 0)
+		done = -1;
+	if (done >= 0 && add_file(w, dir, name, size) < 0)
+		return -1;
+	return done;
+}
+
+static long op_stat(struct worker *w)
+{
+	char path[FSPATHLEN];
+	struct stat st;
+
+	if (!w->nfiles)
+		return -2;
+	struct file *f = &w->files[rnd(w) % w->nfiles];
+	file_path(w, f, path);
+	if (stat(path, &st) < 0)
+		return -1;
+	return st.st_size == f->size ? 0 : -1;
+}
+
+static long op_readdir(struct worker *w)
+{
+	DIR *d = opendir(w->dirs[rnd(w) % w->ndirs]);
+
+	if (!d)
+		return -1;
+	errno = 0;
+	while (readdir(d))
+		;
+	int failed = errno != 0;
+	closedir(d);
+	return failed ? -1 : 0;
+}
+
+static long op_mkdir(struct worker *w)
+{
+	char path[FSPATHLEN];
+	int parent = rnd(w) % w->ndirs;
+
+	// a tree too deep for the path buffer grows from the thread's top instead
+	if (snprintf(path, sizeof(path), "%s/d%d", w->dirs[parent], w->next_name) >= FSPATHLEN - 16)
+		snprintf(path, sizeof(path), "%s/d%d", w->dirs[0], w->next_name);
+	w->next_name++;
+	if (mkdir(path, DIRPERM) < 0)
+		return -1;
+	return add_dir(w, path) < 0 ? -1 : 0;
+}
+
+static long op_seqread(struct worker *w)
+{
+	char path[FSPATHLEN];
+	long done = 0;
+	ssize_t n;
+
+	if (!w->nfiles)
+		return -2;
+	struct file *f = &w->files[rnd(w) % w->nfiles];
+	file_path(w, f, path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	while ((n = read(fd, w->buf, iosize)) > 0)
+		done += n;
+	close(fd);
+	return n < 0 || done != f->size ? -1 : done;
+}
+
+static long op_randread(struct worker *w)
+{
+	char path[FSPATHLEN];
+
+	if (!w->nfiles)
+		return -2;
+	struct file *f = &w->files[rnd(w) % w->nfiles];
+	if (f->size == 0)
+		return -2;
+	file_path(w, f, path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	off_t off = (rnd(w) % ((f->size + iosize - 1) / iosize)) * iosize;
+	size_t want = f->size - off < (off_t)iosize ? (size_t)(f->size - off) : iosize;
+	ssize_t n = pread(fd, w->buf, iosize, off);
+	close(fd);
+	return n == (ssize_t)want ? n : -1;
+}
+
+static long op_append(struct worker *w)
+{
+	char path[FSPATHLEN];
+
+	if (!w->nfiles)
+		return -2;
+	// the first file from a random start that still has room
+	int start = rnd(w) % w->nfiles, i;
+	for (i = 0; i < w->nfiles; i++) {
+		if (w->files[(start + i) % w->nfiles].size + (off_t)iosize <= max_size)
+			break;
+	}
+	if (i == w->nfiles)
+		return -2;
+	struct file *f = &w->files[(start + i) % w->nfiles];
+	file_path(w, f, path);
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	long done = write_out(w, fd, f->size, iosize);
+	if (close(fd) < 0)
+		done = -1;
+	if (done > 0)
+		f->size += done;
+	return done;
+}
+
+static long op_overwrite(struct worker *w)
+{
+	char path[FSPATHLEN];
+
+	if (!w->nfiles)
+		return -2;
+	struct file *f = &w->files[rnd(w) % w->nfiles];
+	if (f->size == 0)
+		return -2;
+	file_path(w, f, path);
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	off_t off = (rnd(w) % ((f->size + iosize - 1) / iosize)) * iosize;
+	long done = write_out(w, fd, off, f->size - off < (off_t)iosize ? f->size - off : (off_t)iosize);
+	if (close(fd) < 0)
+		done = -1;
+	return done;
+}
+
+static long (*const ops[NOPS])(struct worker *) = {
+	op_create, op_stat, op_readdir, op_mkdir, op_seqread, op_randread, op_append, op_overwrite
+};
+
+/* The thread's top directory, its fan-out and initial files, untimed */
+static int setup(struct worker *w)
+{
+	char path[FSPATHLEN];
+	int i;
+
+	if (snprintf(path, sizeof(path), "%s/t%d", run_dir, w->id) >= (int)sizeof(path)) {
+		fprintf(stderr, "%s: path too long\n", run_dir);
+		return -1;
+	}
+	if (mkdir(path, DIRPERM) < 0 || add_dir(w, path) < 0) {
+		perror(path);
+		return -1;
+	}
+	for (i = 0; i < fanout; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", w->dirs[0], i);
+		if (mkdir(path, DIRPERM) < 0 || add_dir(w, path) < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+	for (i = 0; i < preload; i++) {
+		// spread over the fan-out directories, the top one only holds them
+		int dir = fanout ? 1 + i % fanout : 0, name = w->next_name++;
+		off_t size = sizes[pick(w, size_weights, nsizes)];
+		snprintf(path, sizeof(path), "%s/f%d", w->dirs[dir], name);
+		int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, FILEPERM);
+		if (fd < 0 || write_out(w, fd, 0, size) < 0 || close(fd) < 0 || add_file(w, dir, name, size) < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	w->failed = setup(w) < 0;
+
+	pthread_barrier_wait(&start_line);
+	if (w->failed)
+		return NULL;
+	for (long n = 0; !stop && (!ops_per_thread || n < ops_per_thread); n++) {
+		int op = pick(w, mix, NOPS);
+		uint64_t start = now_ns();
+		long ret = ops[op](w);
+		uint64_t ns = now_ns() - start;
+		if (ret >= 0)
+			record(&w->stats[op], ns, ret);
+		else if (ret == -1)
+			w->stats[op].errors++;
+		else
+			w->stats[op].skipped++;
+	}
+	return NULL;
+}
+
+/*
+ * option parsing
+ */
+static long long parse_size(const char *str, char **end)
+{
+	long long size = strtoll(str, end, 10);
+
+	switch (**end) {
+	case 'm': case 'M': size *= 1024;	/* fall through */
+	case 'k': case 'K': size *= 1024; (*end)++;
+	}
+	return size;
+}
+
+/* "name=weight,..." over the operation names, anything not named gets 0 */
+static int parse_mix(char *str)
+{
+	char *save = NULL;
+	int total = 0;
+
+	memset(mix, 0, sizeof(mix));
+	for (char *p = strtok_r(str, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(p, '=');
+		int op;
+		if (!eq)
+			return -1;
+		*eq = '\0';
+		for (op = 0; op < NOPS && strcmp(op_names[op], p) != 0; op++)
+			;
+		if (op == NOPS || (mix[op] = atoi(eq + 1)) < 0)
+			return -1;
+		total += mix[op];
+	}
+	return total > 0 ? 0 : -1;
+}
+
+/* "size=weight,..." with K or M suffixes on the sizes */
+static int parse_sizes(char *str)
+{
+	char *save = NULL, *end;
+	int total = 0;
+
+	nsizes = 0;
+	for (char *p = strtok_r(str, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if (nsizes == MAX_SIZES)
+			return -1;
+		sizes[nsizes] = parse_size(p, &end);
+		if (*end != '=' || sizes[nsizes] < 0 || (size_weights[nsizes] = atoi(end + 1)) < 0)
+			return -1;
+		total += size_weights[nsizes++];
+	}
+	return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t THREADS] [-d SECONDS | -n OPS] [-m MIX] [-s SIZES] [-f FANOUT] "
+			"[-p FILES] [-b IOSIZE] [-x MAXSIZE] [-S SEED] MOUNTDIR\n", prog);
+	exit(2);
+}
+
+/*
+ * report
+ */
+static void print_stats(const struct opstat *s, double elapsed)
+{
+	printf("{\"count\": %llu, \"errors\": %llu, \"skipped\": %llu, "
+		   "\"ops_per_s\": %.1f, \"mb_per_s\": %.3f, \"lat_us\": {",
+		   (unsigned long long)s->count, (unsigned long long)s->errors, (unsigned long long)s->skipped,
+		   s->count / elapsed, s->bytes / elapsed / (1024 * 1024));
+	if (s->count)
+		printf("\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f",
+			   s->sum_ns / 1e3 / s->count, hist_percentile(s, 0.5) / 1e3, hist_percentile(s, 0.9) / 1e3,
+			   hist_percentile(s, 0.99) / 1e3, hist_percentile(s, 0.999) / 1e3, s->max_ns / 1e3);
+	printf("}}");
+}
+
+int main(int argc, char **argv) {
+
+	char *end;
+	int c, i, op;
+
+	while ((c = getopt(argc, argv, "t:d:n:m:s:f:p:b:x:S:")) != -1) {
+		switch (c) {
+		case 't': nthreads = atoi(optarg); break;
+		case 'd': seconds = atof(optarg); break;
+		case 'n': ops_per_thread = atol(optarg); break;
+		case 'm': if (parse_mix(optarg) < 0) usage(argv[0]); break;
+		case 's': if (parse_sizes(optarg) < 0) usage(argv[0]); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'p': preload = atoi(optarg); break;
+		case 'b': iosize = parse_size(optarg, &end); break;
+		case 'x': max_size = parse_size(optarg, &end); break;
+		case 'S': seed = strtoull(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nthreads <= 0 || seconds <= 0 || ops_per_thread < 0 ||
+		fanout < 0 || preload < 0 || iosize <= 0 || max_size <= 0)
+		usage(argv[0]);
+	mount_dir = argv[optind];
+
+	snprintf(run_dir, sizeof(run_dir), "%s/load.%d", mount_dir, (int)getpid());
+	if (mkdir(run_dir, DIRPERM) < 0) {
+		perror(run_dir);
+		exit(1);
+	}
+
+	struct worker *workers = calloc(nthreads, sizeof(struct worker));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+	pthread_barrier_init(&start_line, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		w->rng = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+		w->buf = malloc(iosize);
+		if (!w->buf) {
+			perror("malloc");
+			exit(1);
+		}
+		memset(w->buf, 'a' + i % 26, iosize);
+		if (pthread_create(&w->tid, NULL, run, w) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	// the clock starts once every thread has its tree
+	pthread_barrier_wait(&start_line);
+	uint64_t start = now_ns();
+	if (!ops_per_thread) {
+		struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		stop = 1;
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].tid, NULL);
+	double elapsed = (now_ns() - start) / 1e9;
+	for (i = 0; i < nthreads; i++) {
+		if (workers[i].failed) {
+			fprintf(stderr, "thread %d could not set up its tree\n", i);
+			exit(1);
+		}
+	}
+
+	// fold the threads together
+	static struct opstat totals[NOPS], all;
+	for (i = 0; i < nthreads; i++) {
+		for (op = 0; op < NOPS; op++) {
+			struct opstat *s = &workers[i].stats[op], *t = &totals[op];
+			t->count += s->count;
+			t->errors += s->errors;
+			t->skipped += s->skipped;
+			t->bytes += s->bytes;
+			t->sum_ns += s->sum_ns;
+			if (s->max_ns > t->max_ns)
+				t->max_ns = s->max_ns;
+			for (c = 0; c < HIST_BUCKETS; c++)
+				t->hist[c] += s->hist[c];
+		}
+	}
+	for (op = 0; op < NOPS; op++) {
+		all.count += totals[op].count;
+		all.errors += totals[op].errors;
+		all.skipped += totals[op].skipped;
+		all.bytes += totals[op].bytes;
+		all.sum_ns += totals[op].sum_ns;
+		if (totals[op].max_ns > all.max_ns)
+			all.max_ns = totals[op].max_ns;
+		for (c = 0; c < HIST_BUCKETS; c++)
+			all.hist[c] += totals[op].hist[c];
+	}
+
+	printf("{\n  \"mount\": \"%s\", \"threads\": %d, \"seconds\": %.3f, \"fanout\": %d, \"files\": %d, "
+		   "\"iosize\": %zu, \"seed\": %llu,\n  \"ops\": {\n",
+		   mount_dir, nthreads, elapsed, fanout, preload, iosize, (unsigned long long)seed);
+	int nmixed = 0, shown = 0;
+	for (op = 0; op < NOPS; op++)
+		nmixed += mix[op] > 0;
+	for (op = 0; op < NOPS; op++) {
+		if (mix[op] == 0)
+			continue;
+		printf("    \"%s\": ", op_names[op]);
+		print_stats(&totals[op], elapsed);
+		printf(++shown == nmixed ? "\n" : ",\n");
+	}
+	printf("  },\n  \"total\": ");
+	print_stats(&all, elapsed);
+	printf("\n}\n");
+	return 0;
+}
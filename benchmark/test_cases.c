@@ -6,6 +6,8 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <stdint.h>
 #include <dirent.h>
 
 /* You need to change this macro to your TFS mount point*/
@@ -19,8 +21,130 @@
 #define FILEPERM 0666
 #define DIRPERM 0755
 
+/* where rufs_mkimage and rufs_fsck are built, relative to this directory */
+#define TOOLDIR ".."
+
+/* Leading fields of the superblock in rufs.h, which cannot be included next
+ * to <dirent.h>; enough to find the reference count blocks of an image */
+struct sb_head {
+	uint32_t magic_num;
+	uint16_t max_inum;
+	uint16_t max_dnum;
+	uint32_t i_bitmap_blk;
+	uint32_t d_bitmap_blk;
+	uint32_t i_start_blk;
+	uint32_t d_start_blk;
+	uint32_t r_start_blk;
+};
+
 char buf[BLOCKSIZE];
 
+/* Fill one block with text that compresses well and differs by block and seed */
+static void fill_block(char *b, int blk, int seed)
+{
+	int len = 0;
+
+	while (len < BLOCKSIZE)
+		len += snprintf(b + len, BLOCKSIZE - len, "block %d of pattern %d. ", blk, seed);
+}
+
+/* Write nblocks pattern blocks starting at block first */
+static int write_blocks(const char *path, int first, int nblocks, int seed)
+{
+	int fd, i;
+
+	if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0) {
+		perror(path);
+		return -1;
+	}
+	for (i = first; i < first + nblocks; i++) {
+		fill_block(buf, i, seed);
+		if (pwrite(fd, buf, BLOCKSIZE, (off_t)i * BLOCKSIZE) != BLOCKSIZE) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/* Check that blocks first.. of a file hold the pattern written with seed */
+static int check_blocks(const char *path, int first, int nblocks, int seed)
+{
+	char want[BLOCKSIZE];
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+	for (i = first; i < first + nblocks; i++) {
+		fill_block(want, i, seed);
+		if (pread(fd, buf, BLOCKSIZE, (off_t)i * BLOCKSIZE) != BLOCKSIZE ||
+			memcmp(buf, want, BLOCKSIZE) != 0) {
+			printf("%s: block %d does not hold pattern %d \n", path, i, seed);
+			close(fd);
+			return -1;
+		}
+	}
+	return close(fd);
+}
+
+/* Run a shell command, returns its exit status or -1 */
+static int run(const char *fmt, const char *arg1, const char *arg2)
+{
+	char cmd[3 * FSPATHLEN];
+	int status;
+
+	snprintf(cmd, sizeof(cmd), fmt, arg1, arg2);
+	status = system(cmd);
+	return status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Read the control file's status into out, returns its length or -1 */
+static int ctl_status(char *out, int size)
+{
+	int fd, len;
+
+	if ((fd = open(TESTDIR "/.rufs", O_RDONLY)) < 0) {
+		perror("open .rufs");
+		return -1;
+	}
+	len = read(fd, out, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	out[len] = '\0';
+	return len;
+}
+
+/* Run a control file command, returns 0 or -1 */
+static int ctl_command(const char *cmd)
+{
+	int fd, ret;
+
+	if ((fd = open(TESTDIR "/.rufs", O_WRONLY)) < 0) {
+		perror("open .rufs");
+		return -1;
+	}
+	ret = write(fd, cmd, strlen(cmd)) == (ssize_t)strlen(cmd) ? 0 : -1;
+	if (ret < 0)
+		perror(cmd);
+	close(fd);
+	return ret;
+}
+
+/* A counter from the status, found after label, or -1 */
+static long long ctl_count(const char *label)
+{
+	char status[4096];
+	const char *p;
+
+	if (ctl_status(status, sizeof(status)) < 0 || (p = strstr(status, label)) == NULL)
+		return -1;
+	return atoll(p + strlen(label));
+}
+
 int main(int argc, char **argv) {
 
 	int i, fd = 0, ret = 0;
@@ -126,6 +250,110 @@ int main(int argc, char **argv) {
 	printf("TEST 7: Sub-directory create success \n");
 
 
+	/* TEST 8: compressed write/read round trip, whole clusters and a partial one */
+	long long compressed = ctl_count("compression: ");
+	if (write_blocks(TESTDIR "/cfile", 0, 6, 8) < 0 || check_blocks(TESTDIR "/cfile", 0, 6, 8) < 0) {
+		printf("TEST 8: Compressed round trip failure \n");
+		exit(1);
+	}
+	// rewrite the middle of the first cluster, the rest of it must come back unchanged
+	if (write_blocks(TESTDIR "/cfile", 1, 2, 80) < 0 || check_blocks(TESTDIR "/cfile", 0, 1, 8) < 0 ||
+		check_blocks(TESTDIR "/cfile", 1, 2, 80) < 0 || check_blocks(TESTDIR "/cfile", 3, 3, 8) < 0) {
+		printf("TEST 8: Compressed partial rewrite failure \n");
+		exit(1);
+	}
+	if (ctl_count("compression: ") > compressed)
+		printf("TEST 8: Compressed round trip Success \n");
+	else
+		printf("TEST 8: Round trip Success, but nothing was compressed (mount with -o compress) \n");
+
+
+	/* TEST 9: two files with the same blocks, then one of them overwritten */
+	long long hits = ctl_count("dedup: ");
+	if (write_blocks(TESTDIR "/dfile1", 0, 4, 9) < 0 || write_blocks(TESTDIR "/dfile2", 0, 4, 9) < 0 ||
+		check_blocks(TESTDIR "/dfile2", 0, 4, 9) < 0) {
+		printf("TEST 9: Dedup write failure \n");
+		exit(1);
+	}
+	int shared = ctl_count("dedup: ") > hits;
+	// a shared block rewritten in one file must stay as it was in the other
+	if (write_blocks(TESTDIR "/dfile2", 1, 2, 90) < 0 || check_blocks(TESTDIR "/dfile1", 0, 4, 9) < 0 ||
+		check_blocks(TESTDIR "/dfile2", 0, 1, 9) < 0 || check_blocks(TESTDIR "/dfile2", 1, 2, 90) < 0 ||
+		check_blocks(TESTDIR "/dfile2", 3, 1, 9) < 0) {
+		printf("TEST 9: Dedup overwrite failure \n");
+		exit(1);
+	}
+	if (shared)
+		printf("TEST 9: Dedup share and overwrite Success \n");
+	else
+		printf("TEST 9: Overwrite Success, but no block was shared (mount with -o dedup) \n");
+
+
+	/* TEST 10: a file in a snapshot keeps its contents after the live one changes */
+	char snap_path[FSPATHLEN];
+	long long snap_id;
+	if (write_blocks(TESTDIR "/sfile", 0, 4, 10) < 0 || ctl_command("snapshot") < 0 ||
+		(snap_id = ctl_count("last taken ")) <= 0) {
+		printf("TEST 10: Snapshot create failure \n");
+		exit(1);
+	}
+	snprintf(snap_path, sizeof(snap_path), "%s/.snapshots/%lld/sfile", TESTDIR, snap_id);
+	if (write_blocks(TESTDIR "/sfile", 0, 6, 100) < 0 || check_blocks(TESTDIR "/sfile", 0, 6, 100) < 0 ||
+		check_blocks(snap_path, 0, 4, 10) < 0) {
+		printf("TEST 10: Snapshot contents failure \n");
+		exit(1);
+	}
+	if (stat(snap_path, &st) < 0 || st.st_size != 4 * BLOCKSIZE) {
+		printf("TEST 10: Snapshot size failure \n");
+		exit(1);
+	}
+	snprintf(snap_path, sizeof(snap_path), "delete %lld", snap_id);
+	if (ctl_command(snap_path) < 0) {
+		printf("TEST 10: Snapshot delete failure \n");
+		exit(1);
+	}
+	printf("TEST 10: Snapshot unchanged after modify Success \n");
+
+
+	/* TEST 11: offline fsck repairs a damaged image and finds it clean after */
+	char host_dir[] = "/tmp/rufs_fsckXXXXXX", host_file[FSPATHLEN], image[FSPATHLEN];
+	struct sb_head sbh;
+	if (mkdtemp(host_dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	snprintf(image, sizeof(image), "%s.img", host_dir);
+	snprintf(host_file, sizeof(host_file), "%s/file", host_dir);
+	if (write_blocks(host_file, 0, 4, 11) < 0 ||
+		run(TOOLDIR "/rufs_mkimage %s %s > /dev/null 2>&1", host_dir, image) != 0 ||
+		run(TOOLDIR "/rufs_fsck -n %s > /dev/null 2>&1", image, NULL) != 0) {
+		printf("TEST 11: fsck of a fresh image failure \n");
+		exit(1);
+	}
+	// zero the first reference count block, which counts the metadata blocks too
+	memset(buf, 0, BLOCKSIZE);
+	int image_fd = open(image, O_RDWR);
+	if (image_fd < 0 || pread(image_fd, &sbh, sizeof(sbh), 0) != sizeof(sbh) ||
+		pwrite(image_fd, buf, BLOCKSIZE, (off_t)sbh.r_start_blk * BLOCKSIZE) != BLOCKSIZE || close(image_fd) < 0) {
+		perror(image);
+		exit(1);
+	}
+	if ((ret = run(TOOLDIR "/rufs_fsck -n %s > /dev/null 2>&1", image, NULL)) != 4) {
+		printf("TEST 11: fsck -n missed the damage (exit %d) \n", ret);
+		exit(1);
+	}
+	if ((ret = run(TOOLDIR "/rufs_fsck %s > /dev/null 2>&1", image, NULL)) != 1) {
+		printf("TEST 11: fsck repair failure (exit %d) \n", ret);
+		exit(1);
+	}
+	if ((ret = run(TOOLDIR "/rufs_fsck -n %s > /dev/null 2>&1", image, NULL)) != 0) {
+		printf("TEST 11: fsck left problems behind (exit %d) \n", ret);
+		exit(1);
+	}
+	run("rm -rf %s %s", host_dir, image);
+	printf("TEST 11: fsck of a damaged image Success \n");
+
+
 	/* Close operation */	
 	if (close(fd) < 0) {
 		perror("close largefile");
@@ -7,76 +7,1781 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "block.h"
+#include "trace.h"
+
+/*
+ * The block space can be striped over several backing files: stripe unit u
+ * (in blocks) sends blocks [s*u, (s+1)*u) to file s % ndevs, at row s / ndevs
+ * of that file. A single file is the plain layout.
+ */
+#define MAX_DEVS	16
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+int devs[MAX_DEVS] = {-1};
+int ndevs = 0;
+int stripe_unit = 16;
+
+/*
+ * In direct mode the backing files are opened with O_DIRECT so blocks are not
+ * cached a second time in the host page cache. Every transfer must then start
+ * at a BLOCK_SIZE aligned address: unaligned buffers go through a per-thread
+ * bounce block, and vectored requests with one are split into single blocks.
+ */
+int direct_io = 0;
+
+static __thread char *bounce;
+
+#define IS_ALIGNED(p)	(((uintptr_t)(p) & (BLOCK_SIZE - 1)) == 0)
+
+//Open the backing files with O_DIRECT, must be set before dev_init/dev_open
+void dev_direct(int on) {
+    direct_io = on;
+}
+
+static char *bounce_block() {
+    if (!bounce && posix_memalign((void **)&bounce, BLOCK_SIZE, BLOCK_SIZE) != 0)
+		bounce = NULL;
+    return bounce;
+}
+
+//Blocks covered by a vectored request, a partial last block counts
+static int iov_blocks(const struct iovec *iov, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+		total += iov[i].iov_len;
+    return (total + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static int iov_aligned(const struct iovec *iov, int count) {
+    for (int i = 0; i < count; i++) {
+		if (!IS_ALIGNED(iov[i].iov_base) || iov[i].iov_len % BLOCK_SIZE != 0)
+			return 0;
+    }
+    return 1;
+}
+
+//Set the stripe unit in blocks
+void dev_stripe_unit(int blocks) {
+    if (blocks > 0)
+		stripe_unit = blocks;
+}
+
+//Number of backing files and the stripe unit in use
+void dev_geometry(int *count, int *unit) {
+    *count = ndevs;
+    *unit = stripe_unit;
+}
+
+//Map a block to the file holding it and the byte offset there
+static int dev_map(int block_num, off_t *pos) {
+    if (ndevs == 1) {
+		*pos = (off_t)block_num * BLOCK_SIZE;
+		return devs[0];
+    }
+    int stripe = block_num / stripe_unit;
+    *pos = ((off_t)(stripe / ndevs) * stripe_unit + block_num % stripe_unit) * BLOCK_SIZE;
+    return devs[stripe % ndevs];
+}
 
-int diskfile = -1;
+/*
+ * Tiering: a small fast file can front the block space. It keeps the
+ * metadata region (blocks below meta_blocks) for good, plus slots that each
+ * hold one hot data block, so block numbers never change and tier_map()
+ * simply sends a block to its slot when it has one. Reads are counted per
+ * block and a background thread moves the hottest blocks into slots and the
+ * coldest back out. The fast file is authoritative for what it holds; dirty
+ * blocks are copied back at dev_close(), so after a clean unmount the
+ * capacity files are a complete image again.
+ *
+ * After a crash they are not, so a marker next to the first backing file
+ * (DISKFILE.tier) names the fast file in use. dev_open() without a fast file
+ * of its own adopts the one named there: tools then see the current image,
+ * their writes go where the next mount looks for them and dev_close() copies
+ * them back. RAM mode reads the capacity files directly, so it copies the
+ * fast file back first and retires it; the next mount with it starts over.
+ *
+ * Fast file layout in blocks: header, slot map, metadata region, slots.
+ */
+#define TIER_MAGIC		0x54494552
+#define TIER_SLOTS		1024		/* default number of slots */
+#define TIER_PERIOD		2			/* seconds between migration passes */
+#define TIER_BATCH		64			/* most blocks moved per pass */
+#define TIER_MIN_HEAT	4			/* decayed reads before a block earns a slot */
+#define TIER_HINT_HEAT	8			/* weight of a hint from the file system */
+#define MAP_PER_BLOCK	(BLOCK_SIZE / sizeof(int32_t))
+
+struct tier_header {
+    uint32_t magic;
+    uint32_t meta_blocks;
+    uint32_t nslots;
+    uint32_t clean;					/* set at a clean close, the slots match the capacity tier */
+};
+
+static struct {
+    const char *path;
+    int fd;
+    int meta_blocks;
+    int nblocks;
+    int nslots;
+    int map_blocks;
+    int32_t *slot_blk;				/* block held by each slot, -1 if free, stored as is */
+    int *slot_of;					/* slot of each block, -1 on the capacity tier */
+    unsigned char *dirty;			/* per slot, then per metadata block */
+    uint16_t *heat;					/* reads per block, halved every pass */
+    pthread_rwlock_t lock;			/* held for writing only while the map changes */
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop;
+    pthread_t thread;
+    int running;
+    int adopted;					/* named by the marker rather than by dev_tier() */
+    struct tier_stats stats;
+} tier = {.fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER,
+	  .stop_lock = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER};
+
+static char tier_path[PATH_MAX];	/* first backing file + ".tier" */
+static char tier_fast[PATH_MAX];	/* fast file named there */
+
+//Front the block space with a fast file, must be called before dev_init/dev_open.
+//Blocks below meta_blocks always live there, nblocks bounds the block numbers
+void dev_tier(const char *fast_path, int meta_blocks, int nblocks, int slots) {
+    tier.path = fast_path;
+    tier.meta_blocks = meta_blocks;
+    tier.nblocks = nblocks;
+    tier.nslots = slots > 0 ? slots : TIER_SLOTS;
+}
+
+static off_t tier_slot_pos(int slot) {
+    return (off_t)(1 + tier.map_blocks + tier.meta_blocks + slot) * BLOCK_SIZE;
+}
+
+//Like dev_map(), but blocks held by the fast tier map into the fast file
+static int tier_map(int block_num, off_t *pos) {
+    if (tier.fd >= 0) {
+		if (block_num < tier.meta_blocks) {
+			*pos = (off_t)(1 + tier.map_blocks + block_num) * BLOCK_SIZE;
+			return tier.fd;
+		}
+		if (block_num < tier.nblocks && tier.slot_of[block_num] >= 0) {
+			*pos = tier_slot_pos(tier.slot_of[block_num]);
+			return tier.fd;
+		}
+    }
+    return dev_map(block_num, pos);
+}
+
+static void tier_rdlock() {
+    if (tier.fd >= 0)
+		pthread_rwlock_rdlock(&tier.lock);
+}
+
+static void tier_unlock() {
+    if (tier.fd >= 0)
+		pthread_rwlock_unlock(&tier.lock);
+}
+
+//Count weight reads of a data block
+static void tier_touch(int block_num, int weight) {
+    if (tier.fd < 0 || block_num < tier.meta_blocks || block_num >= tier.nblocks)
+		return;
+    if (tier.heat[block_num] < UINT16_MAX - weight)
+		__atomic_fetch_add(&tier.heat[block_num], weight, __ATOMIC_RELAXED);
+}
+
+//A block on the fast tier was written, it has to be copied back at close
+static void tier_dirty(int block_num) {
+    if (tier.fd < 0)
+		return;
+    if (block_num < tier.meta_blocks)
+		tier.dirty[tier.nslots + block_num] = 1;
+    else if (block_num < tier.nblocks && tier.slot_of[block_num] >= 0)
+		tier.dirty[tier.slot_of[block_num]] = 1;
+}
+
+//Whether any of count blocks from block_num is on the fast tier
+static int tier_spans(int block_num, int count) {
+    if (tier.fd < 0)
+		return 0;
+    for (int b = block_num; b < block_num + count; b++) {
+		off_t pos;
+		if (tier_map(b, &pos) == tier.fd)
+			return 1;
+    }
+    return 0;
+}
+
+//Hint that a block is read often (directory blocks), so it moves up sooner
+void dev_tier_hint(int block_num) {
+    tier_touch(block_num, TIER_HINT_HEAT);
+}
+
+int dev_tier_stats(struct tier_stats *stats) {
+    if (tier.fd < 0)
+		return -1;
+    *stats = tier.stats;
+    stats->slots = tier.nslots;
+    stats->used = 0;
+    for (int s = 0; s < tier.nslots; s++)
+		stats->used += tier.slot_blk[s] >= 0;
+    return 0;
+}
+
+//Copy one block between files through an aligned buffer, past the end reads as zeros
+static int tier_copy(int from_fd, off_t from, int to_fd, off_t to) {
+    char *buf = bounce_block();
+    if (!buf)
+		return -1;
+    ssize_t n = pread(from_fd, buf, BLOCK_SIZE, from);
+    if (n < 0)
+		return -1;
+    memset(buf + n, 0, BLOCK_SIZE - n);
+    return pwrite(to_fd, buf, BLOCK_SIZE, to) == BLOCK_SIZE ? 0 : -1;
+}
+
+static int tier_write_map(int slot) {
+    int b = slot / MAP_PER_BLOCK;
+    return pwrite(tier.fd, (char *)tier.slot_blk + (off_t)b * BLOCK_SIZE, BLOCK_SIZE, (off_t)(1 + b) * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+}
+
+//Put block_num into slot, sending the block there now back to the capacity tier
+static int tier_move(int block_num, int slot) {
+    off_t pos;
+    int retstat = -1;
+
+    pthread_rwlock_wrlock(&tier.lock);
+    int old = tier.slot_blk[slot];
+    // Step 1: the slot is emptied, on disk too, before it takes other data
+    if (old >= 0) {
+		int fd = dev_map(old, &pos);
+		if (tier.dirty[slot] && tier_copy(tier.fd, tier_slot_pos(slot), fd, pos) < 0)
+			goto out;
+		tier.slot_of[old] = -1;
+		tier.slot_blk[slot] = -1;
+		tier.stats.demoted++;
+		if (tier_write_map(slot) < 0)
+			goto out;
+    }
+
+    // Step 2: copy the block in and point the map at it
+    int fd = dev_map(block_num, &pos);
+    if (tier_copy(fd, pos, tier.fd, tier_slot_pos(slot)) < 0)
+		goto out;
+    tier.slot_blk[slot] = block_num;
+    if (tier_write_map(slot) < 0) {
+		tier.slot_blk[slot] = -1;
+		goto out;
+    }
+    tier.slot_of[block_num] = slot;
+    tier.dirty[slot] = 0;
+    tier.stats.promoted++;
+    retstat = 0;
+out:
+    pthread_rwlock_unlock(&tier.lock);
+    return retstat;
+}
+
+struct tier_cand {
+    int blk;
+    int heat;
+};
+
+static int tier_cand_cmp(const void *a, const void *b) {
+    return ((const struct tier_cand *)b)->heat - ((const struct tier_cand *)a)->heat;
+}
+
+//One migration pass: promote the hottest blocks on the capacity tier over
+//free or clearly colder slots, then age all counts
+static void tier_migrate() {
+    struct tier_cand *cand = (struct tier_cand *)malloc(tier.nblocks * sizeof(struct tier_cand));
+    int n = 0;
+
+    if (!cand)
+		return;
+    // Step 1: candidates, with their counts taken once so the sort is stable
+    for (int b = tier.meta_blocks; b < tier.nblocks; b++) {
+		int heat = __atomic_load_n(&tier.heat[b], __ATOMIC_RELAXED);
+		if (tier.slot_of[b] < 0 && heat >= TIER_MIN_HEAT) {
+			cand[n].blk = b;
+			cand[n].heat = heat;
+			n++;
+		}
+    }
+    qsort(cand, n, sizeof(struct tier_cand), tier_cand_cmp);
+
+    // Step 2: each goes to a free slot, or replaces the coldest one if that is at most half as hot
+    for (int i = 0; i < n && i < TIER_BATCH; i++) {
+		int victim = -1, victim_heat = INT_MAX;
+		for (int s = 0; s < tier.nslots && victim_heat > 0; s++) {
+			int heat = tier.slot_blk[s] < 0 ? -1 : tier.heat[tier.slot_blk[s]];
+			if (heat < victim_heat) {
+				victim = s;
+				victim_heat = heat;
+			}
+		}
+		if (victim < 0 || victim_heat * 2 > cand[i].heat)
+			break;
+		if (tier_move(cand[i].blk, victim) < 0)
+			break;
+    }
+    free(cand);
+
+    // Step 3: age the counts, so slots follow the current working set
+    for (int b = tier.meta_blocks; b < tier.nblocks; b++)
+		__atomic_store_n(&tier.heat[b], __atomic_load_n(&tier.heat[b], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+}
+
+static void *tier_run(void *arg) {
+    pthread_mutex_lock(&tier.stop_lock);
+    while (tier.running) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += TIER_PERIOD;
+		pthread_cond_timedwait(&tier.stop, &tier.stop_lock, &ts);
+		if (!tier.running)
+			break;
+		pthread_mutex_unlock(&tier.stop_lock);
+		tier_migrate();
+		pthread_mutex_lock(&tier.stop_lock);
+    }
+    pthread_mutex_unlock(&tier.stop_lock);
+    return NULL;
+}
+
+static void tier_free() {
+    free(tier.slot_blk);
+    free(tier.slot_of);
+    free(tier.dirty);
+    free(tier.heat);
+    tier.slot_blk = NULL;
+    tier.slot_of = NULL;
+    tier.dirty = NULL;
+    tier.heat = NULL;
+}
+
+//Open the fast file after the capacity files; fresh is set for a new image,
+//whose fast file starts over. Returns 0 or -1
+static int tier_open(int fresh) {
+    struct tier_header *hdr;
+
+    if (!tier.path)
+		return 0;
+    tier.fd = open(tier.path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    hdr = (struct tier_header *)bounce_block();
+    if (tier.fd < 0 || !hdr) {
+		perror("tier_open failed");
+		return -1;
+    }
+
+    // Step 1: an existing fast file keeps its own geometry
+    memset(hdr, 0, BLOCK_SIZE);
+    int found = !fresh && pread(tier.fd, hdr, BLOCK_SIZE, 0) == BLOCK_SIZE && hdr->magic == TIER_MAGIC;
+    if (found) {
+		tier.meta_blocks = hdr->meta_blocks;
+		tier.nslots = hdr->nslots;
+    }
+    if (tier.adopted && !found) {
+		fprintf(stderr, "tier_open: %s is not a fast file, using the capacity files alone\n", tier.path);
+		close(tier.fd);
+		tier.fd = -1;
+		tier.path = NULL;
+		tier.adopted = 0;
+		unlink(tier_path);
+		return 0;
+    }
+    int clean = found && hdr->clean;
+    tier.map_blocks = (tier.nslots + MAP_PER_BLOCK - 1) / MAP_PER_BLOCK;
+    if (posix_memalign((void **)&tier.slot_blk, BLOCK_SIZE, (size_t)tier.map_blocks * BLOCK_SIZE) != 0)
+		tier.slot_blk = NULL;
+    tier.slot_of = (int *)malloc(tier.nblocks * sizeof(int));
+    tier.dirty = (unsigned char *)calloc(tier.nslots + tier.meta_blocks, 1);
+    tier.heat = (uint16_t *)calloc(tier.nblocks, sizeof(uint16_t));
+    if (!tier.slot_blk || !tier.slot_of || !tier.dirty || !tier.heat) {
+		perror("tier_open failed");
+		goto fail;
+    }
+    for (int b = 0; b < tier.nblocks; b++)
+		tier.slot_of[b] = -1;
+
+    if (found) {
+		// Step 2a: reload the slot map; after a crash everything may be newer than the capacity tier
+		if (pread(tier.fd, tier.slot_blk, (size_t)tier.map_blocks * BLOCK_SIZE, BLOCK_SIZE) != (ssize_t)tier.map_blocks * BLOCK_SIZE) {
+			perror("tier_open failed");
+			goto fail;
+		}
+		for (int s = 0; s < tier.nslots; s++) {
+			if (tier.slot_blk[s] >= tier.meta_blocks && tier.slot_blk[s] < tier.nblocks)
+				tier.slot_of[tier.slot_blk[s]] = s;
+			else
+				tier.slot_blk[s] = -1;
+		}
+		memset(tier.dirty, !clean, tier.nslots + tier.meta_blocks);
+    } else {
+		// Step 2b: a new fast file starts with no slots and the image's metadata
+		memset(tier.slot_blk, 0xff, (size_t)tier.map_blocks * BLOCK_SIZE);
+		if (ftruncate(tier.fd, tier_slot_pos(tier.nslots)) < 0 ||
+			pwrite(tier.fd, tier.slot_blk, (size_t)tier.map_blocks * BLOCK_SIZE, BLOCK_SIZE) < 0) {
+			perror("tier_open failed");
+			goto fail;
+		}
+		for (int b = 0; b < tier.meta_blocks && !fresh; b++) {
+			off_t pos;
+			int fd = dev_map(b, &pos);
+			if (tier_copy(fd, pos, tier.fd, (off_t)(1 + tier.map_blocks + b) * BLOCK_SIZE) < 0) {
+				perror("tier_open failed");
+				goto fail;
+			}
+		}
+		// the capacity copy of the metadata is stale from now on
+		memset(tier.dirty + tier.nslots, 1, tier.meta_blocks);
+    }
+
+    // Step 3: name the fast file next to the capacity files, mark it in use and start migrating
+    if (!tier.adopted) {
+		char real[PATH_MAX];
+		int mfd = open(tier_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+		if (mfd < 0 || !realpath(tier.path, real) || dprintf(mfd, "%d %s\n", tier.nblocks, real) < 0 || fsync(mfd) < 0) {
+			perror("tier_open failed");
+			if (mfd >= 0)
+				close(mfd);
+			goto fail;
+		}
+		close(mfd);
+    }
+    hdr = (struct tier_header *)bounce_block();
+    memset(hdr, 0, BLOCK_SIZE);
+    hdr->magic = TIER_MAGIC;
+    hdr->meta_blocks = tier.meta_blocks;
+    hdr->nslots = tier.nslots;
+    hdr->clean = 0;
+    if (pwrite(tier.fd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		perror("tier_open failed");
+		goto fail;
+    }
+    // an adopted fast file only serves the blocks it holds, nothing migrates
+    tier.running = !tier.adopted;
+    if (tier.running && pthread_create(&tier.thread, NULL, tier_run, NULL) != 0)
+		tier.running = 0;
+    return 0;
+
+fail:
+    close(tier.fd);
+    tier.fd = -1;
+    tier_free();
+    return -1;
+}
+
+//Stop migrating, copy everything dirty back to the capacity tier and mark the fast file clean
+static void tier_close() {
+    if (tier.fd < 0)
+		return;
+    pthread_mutex_lock(&tier.stop_lock);
+    int running = tier.running;
+    tier.running = 0;
+    pthread_cond_signal(&tier.stop);
+    pthread_mutex_unlock(&tier.stop_lock);
+    if (running)
+		pthread_join(tier.thread, NULL);
+
+    int clean = 1;
+    for (int b = 0; b < tier.meta_blocks; b++) {
+		off_t pos;
+		int fd = dev_map(b, &pos);
+		if (tier.dirty[tier.nslots + b] && tier_copy(tier.fd, (off_t)(1 + tier.map_blocks + b) * BLOCK_SIZE, fd, pos) < 0)
+			clean = 0;
+    }
+    for (int s = 0; s < tier.nslots; s++) {
+		off_t pos;
+		if (tier.slot_blk[s] < 0 || !tier.dirty[s])
+			continue;
+		int fd = dev_map(tier.slot_blk[s], &pos);
+		if (tier_copy(tier.fd, tier_slot_pos(s), fd, pos) < 0)
+			clean = 0;
+    }
+    struct tier_header *hdr = (struct tier_header *)bounce_block();
+    if (hdr && pread(tier.fd, hdr, BLOCK_SIZE, 0) == BLOCK_SIZE) {
+		hdr->clean = clean;
+		pwrite(tier.fd, hdr, BLOCK_SIZE, 0);
+    }
+    close(tier.fd);
+    tier.fd = -1;
+    tier_free();
+    if (tier.adopted)
+		tier.path = NULL;
+    tier.adopted = 0;
+}
+
+//Adopt the fast file the marker names when dev_open() has none of its own,
+//tier_open() then opens it. With retire set copy it back and forget it
+//instead. Returns 0 or -1
+static int tier_adopt(int retire) {
+    int nblocks;
+
+    if (tier.path)
+		return 0;
+
+    // Step 1: the marker names the fast file and the block numbers it covers
+    FILE *f = fopen(tier_path, "r");
+    if (!f)
+		return errno == ENOENT ? 0 : -1;
+    int n = fscanf(f, "%d %4095[^\n]", &nblocks, tier_fast);
+    fclose(f);
+    if (n != 2 || nblocks <= 0) {
+		fprintf(stderr, "tier_adopt: %s does not name a fast file\n", tier_path);
+		return -1;
+    }
+    if (access(tier_fast, F_OK) < 0) {
+		fprintf(stderr, "tier_adopt: fast file %s is gone, using the capacity files alone\n", tier_fast);
+		unlink(tier_path);
+		return 0;
+    }
+    tier.path = tier_fast;
+    tier.nblocks = nblocks;
+    tier.adopted = 1;
+    if (!retire)
+		return 0;
+    if (tier_open(0) < 0)
+		return -1;
+    if (tier.fd < 0)
+		return 0;
+
+    // Step 2: the capacity files are made complete and durable before the fast file is forgotten
+    int retstat = 0;
+    tier_close();
+    for (int i = 0; i < ndevs; i++) {
+		if (fsync(devs[i]) < 0)
+			retstat = -1;
+    }
+    int fd = open(tier_fast, O_RDWR);
+    struct tier_header *hdr = (struct tier_header *)bounce_block();
+    if (retstat < 0 || fd < 0 || !hdr || pread(fd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE || !hdr->clean)
+		retstat = -1;
+    else {
+		memset(hdr, 0, BLOCK_SIZE);
+		if (pwrite(fd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE || fsync(fd) < 0)
+			retstat = -1;
+    }
+    if (fd >= 0)
+		close(fd);
+    if (retstat == 0 && unlink(tier_path) < 0)
+		retstat = -1;
+    if (retstat < 0)
+		perror("tier_adopt failed");
+    return retstat;
+}
+
+/*
+ * Discard: freed blocks are punched out of the backing files, so the host
+ * gets their space back and copies of the image skip them. They read back
+ * as zeros. If the host file system cannot punch holes this turns itself off.
+ */
+int discard_ok = 1;
+
+//Punch count blocks from block_num out of the backing files, returns 0 or -1
+static int dev_punch(int block_num, int count) {
+    for (int b = block_num; b < block_num + count; ) {
+		// one call per run that is contiguous in one file
+		off_t pos, next;
+		int fd = dev_map(b, &pos);
+		int n = 1;
+		while (b + n < block_num + count && dev_map(b + n, &next) == fd && next == pos + (off_t)n * BLOCK_SIZE)
+			n++;
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, (off_t)n * BLOCK_SIZE) < 0) {
+			if (errno == EOPNOTSUPP)
+				discard_ok = 0;
+			else
+				perror("block_discard failed");
+			return -1;
+		}
+		b += n;
+    }
+    return 0;
+}
+
+/*
+ * Changed block tracking: while a tracking file sits next to the first
+ * backing file (DISKFILE.cbt, started by dev_cbt), every block written or
+ * discarded is noted in memory, and each checkpoint (dev_sync, or a RAM
+ * mode checkpoint) stamps the blocks noted since the previous one with the
+ * next generation number. rufs_export copies out only the blocks stamped
+ * after a given generation. A crash between a write and the checkpoint
+ * covering it loses the note, so the header is marked unclean on disk
+ * before the first write of each generation; one found unclean at open
+ * starts a new base generation, and changes since an older generation can
+ * then only be had by exporting everything.
+ *
+ * File layout: a header block, then the generation of every block.
+ */
+#define CBT_MAGIC		0x43425431
+
+struct cbt_header {
+    uint32_t magic;
+    uint32_t nblocks;				/* blocks tracked */
+    uint32_t generation;			/* last checkpoint */
+    uint32_t base;					/* changes are known from this generation on */
+    uint32_t clean;					/* nothing written since the last checkpoint */
+};
+
+static char cbt_path[PATH_MAX];		/* first backing file + ".cbt" */
+
+static struct {
+    int create;						/* start tracking this many blocks if there is no file */
+    int fd;
+    struct cbt_header hdr;
+    uint32_t *gen;					/* generation each block last changed in */
+    unsigned char *changed;			/* bitmap of blocks written since the last checkpoint */
+    unsigned char *pending;			/* bitmap taken by the checkpoint under way */
+    pthread_mutex_t lock;
+} cbt = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+//Track the blocks that change, starting a tracking file for nblocks blocks
+//if the image has none, must be called before dev_init/dev_open
+void dev_cbt(int nblocks) {
+    cbt.create = nblocks;
+}
+
+int dev_cbt_stats(struct cbt_stats *stats) {
+    if (cbt.fd < 0)
+		return -1;
+    pthread_mutex_lock(&cbt.lock);
+    stats->generation = cbt.hdr.generation;
+    stats->base = cbt.hdr.base;
+    stats->changed = 0;
+    for (uint32_t i = 0; i < (cbt.hdr.nblocks + 7) / 8; i++)
+		stats->changed += __builtin_popcount(__atomic_load_n(&cbt.changed[i], __ATOMIC_RELAXED) | cbt.pending[i]);
+    pthread_mutex_unlock(&cbt.lock);
+    return 0;
+}
+
+//Set the bits of the blocks stamped after generation since, all of them if that
+//is older than the base, returns how many or -1 without tracking
+int dev_cbt_since(unsigned since, unsigned char *bitmap, int nblocks) {
+    int count = 0;
+    if (cbt.fd < 0)
+		return -1;
+    memset(bitmap, 0, (nblocks + 7) / 8);
+    for (int b = 0; b < nblocks; b++) {
+		if (since < cbt.hdr.base || b >= (int)cbt.hdr.nblocks || cbt.gen[b] > since) {
+			bitmap[b / 8] |= 1 << (b & 7);
+			count++;
+		}
+    }
+    return count;
+}
+
+static int cbt_write_header() {
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, &cbt.hdr, sizeof(cbt.hdr));
+    if (pwrite(cbt.fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE || fdatasync(cbt.fd) < 0)
+		return -1;
+    return 0;
+}
+
+//Note count blocks from block_num as changed, ahead of writing them
+static void cbt_mark(int block_num, int count) {
+    if (cbt.fd < 0)
+		return;
+    for (int b = block_num; b < block_num + count; b++) {
+		if (b >= 0 && b < (int)cbt.hdr.nblocks)
+			__atomic_fetch_or(&cbt.changed[b / 8], 1 << (b & 7), __ATOMIC_SEQ_CST);
+    }
+    // the first write of a generation must not reach the disk before the header says so
+    if (__atomic_load_n(&cbt.hdr.clean, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&cbt.lock);
+		if (cbt.hdr.clean) {
+			cbt.hdr.clean = 0;
+			if (cbt_write_header() < 0)
+				perror("cbt_mark failed");
+		}
+		pthread_mutex_unlock(&cbt.lock);
+    }
+}
+
+//Take the blocks changed so far for the checkpoint about to be written
+static void cbt_take() {
+    if (cbt.fd < 0)
+		return;
+    pthread_mutex_lock(&cbt.lock);
+    for (uint32_t i = 0; i < (cbt.hdr.nblocks + 7) / 8; i++)
+		cbt.pending[i] |= __atomic_exchange_n(&cbt.changed[i], 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&cbt.lock);
+}
+
+//The checkpoint is on disk (ok is set) or failed: stamp the blocks it took
+//with the next generation, or hand them to the next one. Returns 0 or -1
+static int cbt_commit(int ok) {
+    uint32_t nbytes = (cbt.hdr.nblocks + 7) / 8;
+    size_t map_size = (size_t)cbt.hdr.nblocks * sizeof(uint32_t);
+    int count = 0, retstat = 0;
+
+    if (cbt.fd < 0)
+		return 0;
+    pthread_mutex_lock(&cbt.lock);
+    for (uint32_t i = 0; i < nbytes; i++)
+		count += __builtin_popcount(cbt.pending[i]);
+    if (!ok)
+		goto give_back;
+
+    // Step 1: the stamps, then the header that makes them count
+    if (count > 0) {
+		uint32_t next = cbt.hdr.generation + 1;
+		for (uint32_t b = 0; b < cbt.hdr.nblocks; b++) {
+			if (cbt.pending[b / 8] & (1 << (b & 7)))
+				cbt.gen[b] = next;
+		}
+		if (pwrite(cbt.fd, cbt.gen, map_size, BLOCK_SIZE) != (ssize_t)map_size || fdatasync(cbt.fd) < 0) {
+			perror("cbt_commit failed");
+			retstat = -1;
+			goto give_back;
+		}
+		cbt.hdr.generation = next;
+		memset(cbt.pending, 0, nbytes);
+    }
+
+    // Step 2: clean unless something was written after the take
+    int clean = 1;
+    for (uint32_t i = 0; i < nbytes && clean; i++)
+		clean = __atomic_load_n(&cbt.changed[i], __ATOMIC_SEQ_CST) == 0;
+    if (count > 0 || clean != (int)cbt.hdr.clean) {
+		__atomic_store_n(&cbt.hdr.clean, clean, __ATOMIC_SEQ_CST);
+		if (cbt_write_header() < 0) {
+			perror("cbt_commit failed");
+			retstat = -1;
+		}
+    }
+    pthread_mutex_unlock(&cbt.lock);
+    return retstat;
+
+give_back:
+    for (uint32_t i = 0; i < nbytes; i++)
+		__atomic_fetch_or(&cbt.changed[i], cbt.pending[i], __ATOMIC_SEQ_CST);
+    memset(cbt.pending, 0, nbytes);
+    pthread_mutex_unlock(&cbt.lock);
+    return retstat;
+}
+
+static void cbt_free() {
+    free(cbt.gen);
+    free(cbt.changed);
+    free(cbt.pending);
+    cbt.gen = NULL;
+    cbt.changed = cbt.pending = NULL;
+    if (cbt.fd >= 0)
+		close(cbt.fd);
+    cbt.fd = -1;
+}
+
+//Open the tracking file, or start one if dev_cbt asked for it; fresh is set
+//for a new image, which has changed all over. Returns 0 or -1
+static int cbt_open(int fresh) {
+    cbt.fd = open(cbt_path, O_RDWR | (cbt.create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+    if (cbt.fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror("cbt_open failed");
+		return -1;
+    }
+
+    // Step 1: header and stamps, a new file starts out unclean at generation 0
+    char block[BLOCK_SIZE];
+    if (pread(cbt.fd, block, BLOCK_SIZE, 0) == BLOCK_SIZE && ((struct cbt_header *)block)->magic == CBT_MAGIC)
+		memcpy(&cbt.hdr, block, sizeof(cbt.hdr));
+    else if (cbt.create > 0) {
+		memset(&cbt.hdr, 0, sizeof(cbt.hdr));
+		cbt.hdr.magic = CBT_MAGIC;
+		cbt.hdr.nblocks = cbt.create;
+    } else {
+		fprintf(stderr, "cbt_open: %s is not a tracking file, ignored\n", cbt_path);
+		close(cbt.fd);
+		cbt.fd = -1;
+		return 0;
+    }
+    size_t map_size = (size_t)cbt.hdr.nblocks * sizeof(uint32_t);
+    cbt.gen = (uint32_t *)calloc(cbt.hdr.nblocks, sizeof(uint32_t));
+    cbt.changed = (unsigned char *)calloc((cbt.hdr.nblocks + 7) / 8, 1);
+    cbt.pending = (unsigned char *)calloc((cbt.hdr.nblocks + 7) / 8, 1);
+    if (!cbt.gen || !cbt.changed || !cbt.pending || pread(cbt.fd, cbt.gen, map_size, BLOCK_SIZE) < 0) {
+		perror("cbt_open failed");
+		cbt_free();
+		return -1;
+    }
+
+    // Step 2: after a crash or over a new image nothing older can be trusted
+    if (!cbt.hdr.clean || fresh) {
+		cbt.hdr.base = cbt.hdr.generation + 1;
+		cbt.hdr.generation = cbt.hdr.base;
+		cbt.hdr.clean = 1;
+		if (ftruncate(cbt.fd, BLOCK_SIZE + map_size) < 0 || cbt_write_header() < 0) {
+			perror("cbt_open failed");
+			cbt_free();
+			return -1;
+		}
+    }
+    return 0;
+}
+
+//Stamp what the last checkpoint missed, the backing files are synced first
+static void cbt_close() {
+    if (cbt.fd < 0)
+		return;
+    cbt_take();
+    int ok = 1;
+    for (int i = 0; i < ndevs; i++) {
+		if (fsync(devs[i]) < 0)
+			ok = 0;
+    }
+    cbt_commit(ok);
+    cbt_free();
+}
+
+/*
+ * RAM mode: the whole image is read into memory at open and served from
+ * there, the backing files only see checkpoints. A checkpoint copies the
+ * dirty blocks out while no file system operation is running (they are
+ * bracketed by dev_op_begin/dev_op_end), writes the copy to a journal next
+ * to the first backing file and syncs it, then writes the blocks to their
+ * places, syncs those and empties the journal. So the backing files always
+ * hold the image as of some checkpoint: one cut short is replayed from a
+ * complete journal at the next open, an incomplete journal is dropped.
+ *
+ * Journal layout in blocks: header, block numbers, the blocks.
+ */
+#define RAM_MAGIC		0x52414d4a
+#define RAM_PERIOD		30			/* default seconds between checkpoints */
+#define NUMS_PER_BLOCK	(BLOCK_SIZE / sizeof(int32_t))
+
+enum { RAM_CLEAN, RAM_DIRTY, RAM_DISCARD };
+
+struct ram_header {
+    uint32_t magic;
+    uint32_t count;					/* blocks in the journal */
+    uint32_t complete;				/* set once all of them are in it */
+};
+
+static char journal_path[PATH_MAX];	/* first backing file + ".journal" */
+
+static struct {
+    int on;
+    int period;
+    int nblocks;
+    char *blocks;					/* the image */
+    unsigned char *state;			/* RAM_CLEAN, RAM_DIRTY or RAM_DISCARD per block */
+    int jfd;
+    pthread_rwlock_t gate;			/* shared by operations and block I/O, exclusive to copy a checkpoint */
+    int pending;					/* a checkpoint waits for the gate, new holders stay out */
+    pthread_mutex_t ckpt_lock;		/* one checkpoint at a time */
+    pthread_mutex_t stop_lock;		/* guards the rest */
+    pthread_cond_t stop;			/* wakes the thread */
+    pthread_cond_t done;			/* the gate is free again, or a checkpoint finished */
+    pthread_t thread;
+    int running;
+    unsigned asked;					/* checkpoints asked for by dev_sync() */
+    unsigned served;				/* last of those a finished checkpoint covers */
+    int failed;						/* that checkpoint failed */
+    struct ram_stats stats;
+} ram = {.jfd = -1, .ckpt_lock = PTHREAD_MUTEX_INITIALIZER, .stop_lock = PTHREAD_MUTEX_INITIALIZER,
+	 .stop = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+static __thread int ram_held;		/* times this thread holds the gate */
+
+//Serve the image from memory, must be called before dev_init/dev_open.
+//nblocks bounds the block numbers, period is the checkpoint interval in seconds
+void dev_ram(int nblocks, int period) {
+    ram.on = 1;
+    ram.nblocks = nblocks;
+    ram.period = period > 0 ? period : RAM_PERIOD;
+}
+
+/*
+ * The gate prefers readers, so block I/O nested in an operation never waits
+ * behind a checkpoint its own operation holds up. To keep a stream of
+ * operations from starving the checkpoint, a thread not holding the gate yet
+ * stays out while a checkpoint waits for it.
+ */
+static void ram_enter() {
+    if (ram_held == 0 && __atomic_load_n(&ram.pending, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&ram.stop_lock);
+		while (ram.pending)
+			pthread_cond_wait(&ram.done, &ram.stop_lock);
+		pthread_mutex_unlock(&ram.stop_lock);
+    }
+    pthread_rwlock_rdlock(&ram.gate);
+    ram_held++;
+}
+
+static void ram_leave() {
+    ram_held--;
+    pthread_rwlock_unlock(&ram.gate);
+}
+
+//Take and release the gate exclusively, for a checkpoint
+static void ram_lock_gate() {
+    pthread_mutex_lock(&ram.stop_lock);
+    __atomic_store_n(&ram.pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ram.stop_lock);
+    pthread_rwlock_wrlock(&ram.gate);
+}
+
+static void ram_unlock_gate() {
+    pthread_mutex_lock(&ram.stop_lock);
+    __atomic_store_n(&ram.pending, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ram.done);
+    pthread_mutex_unlock(&ram.stop_lock);
+    pthread_rwlock_unlock(&ram.gate);
+}
+
+//Operations take the gate shared, so a checkpoint sees the image between two of them
+void dev_op_begin() {
+    if (ram.blocks)
+		ram_enter();
+}
+
+void dev_op_end() {
+    if (ram.blocks)
+		ram_leave();
+}
+
+int dev_ram_stats(struct ram_stats *stats) {
+    if (!ram.blocks)
+		return -1;
+    ram_enter();
+    *stats = ram.stats;
+    stats->dirty = 0;
+    for (int b = 0; b < ram.nblocks; b++)
+		stats->dirty += ram.state[b] != RAM_CLEAN;
+    ram_leave();
+    return 0;
+}
+
+//Copy bytes between memory and count consecutive blocks from block_num
+static int ram_rw(int block_num, const struct iovec *iov, int count, int write) {
+    size_t off = (size_t)block_num * BLOCK_SIZE;
+    int retstat = 0;
+
+    if (block_num < 0 || block_num + iov_blocks(iov, count) > ram.nblocks) {
+		fprintf(stderr, "block_%s failed: block %d is past the image\n", write ? "write" : "read", block_num);
+		return -1;
+    }
+    ram_enter();
+    for (int i = 0; i < count; i++) {
+		if (write)
+			memcpy(ram.blocks + off, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, ram.blocks + off, iov[i].iov_len);
+		off += iov[i].iov_len;
+		retstat += iov[i].iov_len;
+    }
+    if (write) {
+		memset(ram.state + block_num, RAM_DIRTY, iov_blocks(iov, count));
+		cbt_mark(block_num, iov_blocks(iov, count));
+    }
+    ram_leave();
+    return retstat;
+}
+
+//Copy count blocks from buf to their places in the backing files
+static int ram_put(const int32_t *nums, const char *buf, int count) {
+    for (int i = 0; i < count; i++) {
+		off_t pos;
+		int fd = dev_map(nums[i], &pos);
+		if (pwrite(fd, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE, pos) != BLOCK_SIZE)
+			return -1;
+    }
+    for (int i = 0; i < ndevs; i++) {
+		if (fsync(devs[i]) < 0)
+			return -1;
+    }
+    return 0;
+}
+
+//Write the dirty blocks back through the journal, returns 0 or -1
+static int ram_checkpoint() {
+    struct timespec start, end;
+    int32_t *nums = NULL;
+    int *gone = NULL;
+    char *buf = NULL;
+    int count = 0, ngone = 0, retstat = -1;
+
+    pthread_mutex_lock(&ram.ckpt_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Step 1: copy out what changed, between two operations
+    ram_lock_gate();
+    for (int b = 0; b < ram.nblocks; b++) {
+		count += ram.state[b] == RAM_DIRTY;
+		ngone += ram.state[b] == RAM_DISCARD;
+    }
+    size_t nums_size = (size_t)(count + NUMS_PER_BLOCK - 1) / NUMS_PER_BLOCK * BLOCK_SIZE;
+    size_t size = nums_size + (size_t)count * BLOCK_SIZE;
+    gone = (int *)malloc((ngone + 1) * sizeof(int));
+    if (!gone || posix_memalign((void **)&nums, BLOCK_SIZE, size + BLOCK_SIZE) != 0) {
+		ram_unlock_gate();
+		perror("checkpoint failed");
+		free(gone);
+		pthread_mutex_unlock(&ram.ckpt_lock);
+		return -1;
+    }
+    buf = (char *)nums + nums_size;
+    memset(nums, 0, nums_size);
+    count = ngone = 0;
+    for (int b = 0; b < ram.nblocks; b++) {
+		if (ram.state[b] == RAM_DIRTY) {
+			nums[count] = b;
+			memcpy(buf + (size_t)count++ * BLOCK_SIZE, ram.blocks + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+		} else if (ram.state[b] == RAM_DISCARD)
+			gone[ngone++] = b;
+		ram.state[b] = RAM_CLEAN;
+    }
+    cbt_take();
+    ram_unlock_gate();
+
+    // Step 2: journal the copy, the header last
+    struct ram_header *hdr = (struct ram_header *)((char *)nums + size);
+    memset(hdr, 0, BLOCK_SIZE);
+    hdr->magic = RAM_MAGIC;
+    hdr->count = count;
+    if (count > 0) {
+		if (ftruncate(ram.jfd, 0) < 0 || pwrite(ram.jfd, nums, size, BLOCK_SIZE) != (ssize_t)size ||
+			pwrite(ram.jfd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE || fsync(ram.jfd) < 0)
+			goto fail;
+		hdr->complete = 1;
+		if (pwrite(ram.jfd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE || fsync(ram.jfd) < 0)
+			goto fail;
+
+		// Step 3: the blocks go home, then the journal is spent
+		if (ram_put(nums, buf, count) < 0 || ftruncate(ram.jfd, 0) < 0 || fsync(ram.jfd) < 0)
+			goto fail;
+    }
+
+    cbt_commit(1);
+
+    // Step 4: blocks freed since the last checkpoint are free in the image on disk now
+    for (int i = 0; i < ngone && discard_ok; ) {
+		int n = 1;
+		while (i + n < ngone && gone[i + n] == gone[i] + n)
+			n++;
+		dev_punch(gone[i], n);
+		i += n;
+    }
+    retstat = 0;
+    goto out;
+
+fail:
+    perror("checkpoint failed");
+    cbt_commit(0);
+    // whatever was copied goes into the next attempt
+    ram_lock_gate();
+    for (int i = 0; i < count; i++) {
+		if (ram.state[nums[i]] == RAM_CLEAN)
+			ram.state[nums[i]] = RAM_DIRTY;
+    }
+    for (int i = 0; i < ngone; i++) {
+		if (ram.state[gone[i]] == RAM_CLEAN)
+			ram.state[gone[i]] = RAM_DISCARD;
+    }
+    ram_unlock_gate();
+out:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (retstat == 0 && count > 0) {
+		ram.stats.checkpoints++;
+		ram.stats.blocks += count;
+		ram.stats.last_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    free(nums);
+    free(gone);
+    pthread_mutex_unlock(&ram.ckpt_lock);
+    return retstat;
+}
+
+static void *ram_run(void *arg) {
+    pthread_mutex_lock(&ram.stop_lock);
+    while (ram.running) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ram.period;
+		if (ram.served == ram.asked)
+			pthread_cond_timedwait(&ram.stop, &ram.stop_lock, &ts);
+		if (!ram.running)
+			break;
+		// the copy is taken after this, so it covers every request made so far
+		unsigned serving = ram.asked;
+		pthread_mutex_unlock(&ram.stop_lock);
+		int ret = ram_checkpoint();
+		pthread_mutex_lock(&ram.stop_lock);
+		ram.served = serving;
+		ram.failed = ret < 0;
+		pthread_cond_broadcast(&ram.done);
+    }
+    pthread_mutex_unlock(&ram.stop_lock);
+    return NULL;
+}
+
+//Take a checkpoint now and wait for it. The caller's holds on the gate are
+//let go meanwhile, so it must have left the image consistent
+static int ram_sync() {
+    int held = ram_held;
+    int retstat;
+
+    while (ram_held > 0)
+		ram_leave();
+    pthread_mutex_lock(&ram.stop_lock);
+    if (ram.running) {
+		unsigned ticket = ++ram.asked;
+		pthread_cond_signal(&ram.stop);
+		while (ram.running && (int)(ram.served - ticket) < 0)
+			pthread_cond_wait(&ram.done, &ram.stop_lock);
+		retstat = (int)(ram.served - ticket) >= 0 && !ram.failed ? 0 : -1;
+		pthread_mutex_unlock(&ram.stop_lock);
+    } else {
+		pthread_mutex_unlock(&ram.stop_lock);
+		retstat = ram_checkpoint();
+    }
+    while (ram_held < held)
+		ram_enter();
+    return retstat;
+}
+
+//Finish a checkpoint a crash cut short, from its journal if that is complete
+static int ram_replay() {
+    struct ram_header *hdr = (struct ram_header *)bounce_block();
+    int fd = open(journal_path, O_RDWR);
+    int retstat = 0;
+
+    if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+    if (hdr && pread(fd, hdr, BLOCK_SIZE, 0) == BLOCK_SIZE && hdr->magic == RAM_MAGIC && hdr->complete) {
+		int count = hdr->count;
+		size_t nums_size = (size_t)(count + NUMS_PER_BLOCK - 1) / NUMS_PER_BLOCK * BLOCK_SIZE;
+		int32_t *nums = NULL;
+		if (posix_memalign((void **)&nums, BLOCK_SIZE, nums_size + (size_t)count * BLOCK_SIZE) != 0 ||
+			pread(fd, nums, nums_size + (size_t)count * BLOCK_SIZE, BLOCK_SIZE) != (ssize_t)(nums_size + (size_t)count * BLOCK_SIZE) ||
+			ram_put(nums, (char *)nums + nums_size, count) < 0) {
+			perror("journal replay failed");
+			retstat = -1;
+		} else
+			fprintf(stderr, "replayed a checkpoint of %d blocks from %s\n", count, journal_path);
+		free(nums);
+    }
+    if (retstat == 0 && (ftruncate(fd, 0) < 0 || fsync(fd) < 0))
+		retstat = -1;
+    close(fd);
+    return retstat;
+}
+
+//Load the image into memory; fresh is set for a new image, which starts out zero
+static int ram_open(int fresh) {
+    pthread_rwlockattr_t attr;
+
+    if (!ram.on)
+		return 0;
+    ram.blocks = mmap(NULL, (size_t)ram.nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ram.state = (unsigned char *)calloc(ram.nblocks, 1);
+    ram.jfd = open(journal_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (ram.blocks == MAP_FAILED || !ram.state || ram.jfd < 0) {
+		perror("ram_open failed");
+		goto fail;
+    }
+
+    // Step 1: read every block in, one call per run that is contiguous in one file
+    for (int b = 0; b < ram.nblocks && !fresh; ) {
+		off_t pos, next;
+		int fd = dev_map(b, &pos);
+		int n = 1;
+		while (b + n < ram.nblocks && dev_map(b + n, &next) == fd && next == pos + (off_t)n * BLOCK_SIZE)
+			n++;
+		// short reads past the end of a file leave zeros
+		if (pread(fd, ram.blocks + (size_t)b * BLOCK_SIZE, (size_t)n * BLOCK_SIZE, pos) < 0) {
+			perror("ram_open failed");
+			goto fail;
+		}
+		b += n;
+    }
+    // Step 2: readers nested in an operation must get past a waiting checkpoint
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+    pthread_rwlock_init(&ram.gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    ram.running = 1;
+    if (pthread_create(&ram.thread, NULL, ram_run, NULL) != 0)
+		ram.running = 0;
+    return 0;
+
+fail:
+    if (ram.blocks != MAP_FAILED && ram.blocks)
+		munmap(ram.blocks, (size_t)ram.nblocks * BLOCK_SIZE);
+    ram.blocks = NULL;
+    free(ram.state);
+    ram.state = NULL;
+    if (ram.jfd >= 0)
+		close(ram.jfd);
+    ram.jfd = -1;
+    return -1;
+}
+
+//Stop the checkpoint thread and take the last checkpoint
+static void ram_close() {
+    if (!ram.blocks)
+		return;
+    pthread_mutex_lock(&ram.stop_lock);
+    int running = ram.running;
+    ram.running = 0;
+    pthread_cond_signal(&ram.stop);
+    pthread_cond_broadcast(&ram.done);
+    pthread_mutex_unlock(&ram.stop_lock);
+    if (running)
+		pthread_join(ram.thread, NULL);
+
+    // after a clean last checkpoint the journal has nothing left to say
+    if (ram_checkpoint() == 0)
+		unlink(journal_path);
+    pthread_rwlock_destroy(&ram.gate);
+    munmap(ram.blocks, (size_t)ram.nblocks * BLOCK_SIZE);
+    ram.blocks = NULL;
+    free(ram.state);
+    ram.state = NULL;
+    close(ram.jfd);
+    ram.jfd = -1;
+}
+
+//Open every file of a ':' separated list, returns the number opened or -1
+static int dev_open_all(const char* diskfile_path, int flags) {
+    char paths[PATH_MAX];
+    char *save = NULL;
+
+    strncpy(paths, diskfile_path, sizeof(paths) - 1);
+    paths[sizeof(paths) - 1] = '\0';
+    ndevs = 0;
+    for (char *p = strtok_r(paths, ":", &save); p; p = strtok_r(NULL, ":", &save)) {
+		if (ndevs == 0) {
+			snprintf(journal_path, sizeof(journal_path), "%s.journal", p);
+			snprintf(cbt_path, sizeof(cbt_path), "%s.cbt", p);
+			snprintf(tier_path, sizeof(tier_path), "%s.tier", p);
+		}
+		if (ndevs == MAX_DEVS) {
+			fprintf(stderr, "disk_open failed: more than %d backing files\n", MAX_DEVS);
+			dev_close();
+			return -1;
+		}
+		devs[ndevs] = open(p, flags | (direct_io ? O_DIRECT : 0), S_IRUSR | S_IWUSR);
+		if (devs[ndevs] < 0 && direct_io && errno == EINVAL) {
+			// the host file system has no O_DIRECT, stay buffered
+			fprintf(stderr, "disk_open: O_DIRECT not supported on %s, using buffered I/O\n", p);
+			direct_io = 0;
+			devs[ndevs] = open(p, flags, S_IRUSR | S_IWUSR);
+		}
+		if (devs[ndevs] < 0) {
+			perror("disk_open failed");
+			dev_close();
+			return -1;
+		}
+		ndevs++;
+    }
+    return ndevs > 0 ? ndevs : -1;
+}
+
+//Sizes the backing files to hold nblocks blocks, growing or cutting them
+int dev_resize(int nblocks) {
+    // each file holds its share of the rows of stripes
+    off_t size = (off_t)nblocks * BLOCK_SIZE;
+    off_t row = (off_t)ndevs * stripe_unit * BLOCK_SIZE;
+    off_t rows = (size + row - 1) / row;
+    for (int i = 0; i < ndevs; i++) {
+		if (ftruncate(devs[i], ndevs == 1 ? size : rows * stripe_unit * BLOCK_SIZE) < 0) {
+			perror("Failed to resize disk file");
+			return -1;
+		}
+    }
+    return 0;
+}
+
+/*
+ * A vectored request over several backing files is cut at stripe boundaries.
+ * The pieces that land on one file are contiguous there, so each file gets a
+ * single preadv/pwritev, and the files are driven in parallel: the caller
+ * does the first file itself and hands the others to a worker thread kept
+ * per backing file for as long as the files are open.
+ */
+struct dev_io {
+    int fd;
+    off_t pos;
+    int write;
+    int count;
+    struct iovec *iov;
+    ssize_t ret;
+    int done;
+};
+
+struct dev_worker {
+    pthread_t thread;
+    int running;
+    int stop;
+    struct dev_io *job;			/* handed over, NULL when the worker is free */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;		/* job handed over, taken or done */
+};
+
+static struct dev_worker workers[MAX_DEVS];
+
+static void dev_io_run(struct dev_io *io) {
+    io->ret = io->write ? pwritev(io->fd, io->iov, io->count, io->pos) : preadv(io->fd, io->iov, io->count, io->pos);
+}
+
+static void *dev_worker_run(void *arg) {
+    struct dev_worker *w = (struct dev_worker *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+		while (!w->job && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->job)
+			break;
+		struct dev_io *io = w->job;
+		pthread_mutex_unlock(&w->lock);
+		dev_io_run(io);
+		pthread_mutex_lock(&w->lock);
+		io->done = 1;
+		w->job = NULL;
+		pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+//One worker per backing file of a striped device, a file without one is driven by the caller
+static void dev_workers_start() {
+    for (int d = 0; d < ndevs && ndevs > 1; d++) {
+		struct dev_worker *w = &workers[d];
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		w->job = NULL;
+		w->stop = 0;
+		w->running = pthread_create(&w->thread, NULL, dev_worker_run, w) == 0;
+    }
+}
+
+static void dev_workers_stop() {
+    for (int d = 0; d < MAX_DEVS; d++) {
+		struct dev_worker *w = &workers[d];
+		if (!w->running)
+			continue;
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		w->running = 0;
+    }
+}
+
+//Hand io to the worker of file d, or do it here if there is none
+static void dev_io_submit(int d, struct dev_io *io) {
+    struct dev_worker *w = &workers[d];
+
+    io->done = 0;
+    if (!w->running) {
+		dev_io_run(io);
+		io->done = 1;
+		return;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (w->job)
+		pthread_cond_wait(&w->cond, &w->lock);
+    w->job = io;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void dev_io_wait(int d, struct dev_io *io) {
+    struct dev_worker *w = &workers[d];
+
+    if (io->done)
+		return;
+    pthread_mutex_lock(&w->lock);
+    while (!io->done)
+		pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
 
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (ndevs > 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (dev_open_all(diskfile_path, O_CREAT | O_RDWR) < 0) {
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    dev_resize(DISK_SIZE / BLOCK_SIZE);
+    dev_workers_start();
+    // a new image is fronted only by a fast file given now
+    if (!tier.path)
+		unlink(tier_path);
+    if (ram_replay() < 0 || cbt_open(1) < 0 || ram_open(1) < 0 || tier_open(1) < 0) {
+		exit(EXIT_FAILURE);
+    }
 }
 
 //Function to open the disk file
 int dev_open(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (ndevs > 0) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (dev_open_all(diskfile_path, O_RDWR) < 0) {
+		return -1;
+    }
+    dev_workers_start();
+    if (ram_replay() < 0 || tier_adopt(ram.on) < 0 || cbt_open(0) < 0 || ram_open(0) < 0 || tier_open(0) < 0) {
+		dev_close();
 		return -1;
     }
 	return 0;
 }
 
 void dev_close() {
-    if (diskfile >= 0) {
-		close(diskfile);
+    ram_close();
+    tier_close();
+    cbt_close();
+    dev_workers_stop();
+    for (int i = 0; i < ndevs; i++) {
+		if (devs[i] >= 0)
+			close(devs[i]);
+		devs[i] = -1;
     }
+    ndevs = 0;
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Flush every backing file to stable storage, in RAM mode take a checkpoint
+int dev_sync() {
+    int retstat = 0;
+    if (ram.blocks)
+		return ram_sync();
+    cbt_take();
+    for (int i = 0; i < ndevs; i++) {
+		if (fsync(devs[i]) < 0)
+			retstat = -1;
+    }
+    if (tier.fd >= 0 && fsync(tier.fd) < 0)
+		retstat = -1;
+    if (cbt_commit(retstat == 0) < 0)
+		retstat = -1;
+    return retstat;
+}
+
+//Read a block, with the tier lock held if there is one
+static int blk_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    off_t pos;
+    int fd = tier_map(block_num, &pos);
+    if (direct_io && !IS_ALIGNED(buf)) {
+		char *b = bounce_block();
+		if (!b) {
+			memset (buf, 0, BLOCK_SIZE);
+			return -1;
+		}
+		retstat = pread(fd, b, BLOCK_SIZE, pos);
+		if (retstat > 0)
+			memcpy(buf, b, BLOCK_SIZE);
+    } else
+		retstat = pread(fd, buf, BLOCK_SIZE, pos);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
+    if (tier.fd >= 0) {
+		tier_touch(block_num, 1);
+		__atomic_fetch_add(fd == tier.fd ? &tier.stats.fast_reads : &tier.stats.slow_reads, 1, __ATOMIC_RELAXED);
+    }
+
+    return retstat;
+}
+
+//Write a block, with the tier lock held if there is one
+static int blk_write(const int block_num, const void *buf) {
+    int retstat = 0;
+    off_t pos;
+    int fd = tier_map(block_num, &pos);
+    if (direct_io && !IS_ALIGNED(buf)) {
+		char *b = bounce_block();
+		if (!b) {
+			return -1;
+		}
+		memcpy(b, buf, BLOCK_SIZE);
+		buf = b;
+    }
+    retstat = pwrite(fd, buf, BLOCK_SIZE, pos);
+    if (retstat < 0) {
+		    perror("block_write failed");
+    } else if (fd == tier.fd) {
+		tier_dirty(block_num);
+    }
+    return retstat;
+}
 
+//Read a block from the disk
+int bio_read(const int block_num, void *buf) {
+    struct iovec iov = {.iov_base = buf, .iov_len = BLOCK_SIZE};
+    int retstat;
+    TRACE3(bio_start, 0, block_num, 1);
+    if (ram.blocks) {
+		retstat = ram_rw(block_num, &iov, 1, 0);
+    } else {
+		tier_rdlock();
+		retstat = blk_read(block_num, buf);
+		tier_unlock();
+    }
+    TRACE4(bio_done, 0, block_num, 1, retstat);
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = BLOCK_SIZE};
+    int retstat;
+    TRACE3(bio_start, 1, block_num, 1);
+    if (ram.blocks) {
+		retstat = ram_rw(block_num, &iov, 1, 1);
+    } else {
+		cbt_mark(block_num, 1);
+		tier_rdlock();
+		retstat = blk_write(block_num, buf);
+		tier_unlock();
+    }
+    TRACE4(bio_done, 1, block_num, 1, retstat);
+    return retstat;
+}
+
+static int bio_striped(int block_num, const struct iovec *iov, int count, int write) {
+    struct dev_io io[MAX_DEVS];
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++)
+		total += iov[i].iov_len;
+    // every input piece is cut at most once per stripe it crosses
+    int max_pieces = count + total / ((size_t)stripe_unit * BLOCK_SIZE) + 1;
+    struct iovec *pieces = (struct iovec *)malloc((size_t)ndevs * max_pieces * sizeof(struct iovec));
+    if (!pieces) {
+		return -1;
+    }
+    for (int d = 0; d < ndevs; d++) {
+		io[d].fd = devs[d];
+		io[d].write = write;
+		io[d].count = 0;
+		io[d].iov = pieces + (size_t)d * max_pieces;
+		io[d].ret = 0;
+		io[d].done = 0;
+    }
+
+    // Step 1: deal the request out to the files
+    off_t logical = (off_t)block_num * BLOCK_SIZE;
+    for (int i = 0; i < count; i++) {
+		char *base = (char *)iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			off_t pos;
+			int blk = logical / BLOCK_SIZE;
+			int d = (blk / stripe_unit) % ndevs;
+			dev_map(blk, &pos);
+			off_t stripe_end = ((off_t)(blk / stripe_unit) + 1) * stripe_unit * BLOCK_SIZE;
+			size_t len = left < (size_t)(stripe_end - logical) ? left : (size_t)(stripe_end - logical);
+
+			if (io[d].count == 0)
+				io[d].pos = pos + logical % BLOCK_SIZE;
+			io[d].iov[io[d].count].iov_base = base;
+			io[d].iov[io[d].count].iov_len = len;
+			io[d].count++;
+			base += len;
+			left -= len;
+			logical += len;
+		}
+    }
+
+    // Step 2: one call per file, all but the first on its worker; a request
+    // on a single file never leaves the calling thread
+    int first = -1;
+    for (int d = 0; d < ndevs; d++) {
+		if (io[d].count == 0)
+			continue;
+		if (first < 0)
+			first = d;
+		else
+			dev_io_submit(d, &io[d]);
+    }
+    if (first >= 0)
+		dev_io_run(&io[first]);
+
+    ssize_t retstat = 0;
+    for (int d = 0; d < ndevs; d++) {
+		if (io[d].count == 0)
+			continue;
+		if (d != first)
+			dev_io_wait(d, &io[d]);
+		if (io[d].ret < 0 || retstat < 0)
+			retstat = -1;
+		else
+			retstat += io[d].ret;
+    }
+    free(pieces);
+    return retstat;
+}
+
+//Vectored request as one block at a time, for direct mode with an unaligned
+//piece or a range partly on the fast tier
+static int bio_split(int block_num, const struct iovec *iov, int count, int write) {
+    int retstat = 0;
+    for (int i = 0; i < count; i++) {
+		for (size_t off = 0; off < iov[i].iov_len; off += BLOCK_SIZE) {
+			char *p = (char *)iov[i].iov_base + off;
+			int ret;
+			if (iov[i].iov_len - off < BLOCK_SIZE) {
+				// a partial block still moves a whole block on the device
+				char tail[BLOCK_SIZE];
+				if (write) {
+					memset(tail, 0, BLOCK_SIZE);
+					memcpy(tail, p, iov[i].iov_len - off);
+					ret = blk_write(block_num++, tail);
+				} else {
+					ret = blk_read(block_num++, tail);
+					memcpy(p, tail, iov[i].iov_len - off);
+				}
+				if (ret > 0)
+					ret = iov[i].iov_len - off;
+			} else
+				ret = write ? blk_write(block_num++, p) : blk_read(block_num++, p);
+			if (ret < 0)
+				return -1;
+			retstat += ret;
+		}
+    }
+    return retstat;
+}
+
+//Read count consecutive blocks starting at block_num, one iovec per block,
+//with a single system call
+int bio_readv(const int block_num, const struct iovec *iov, int count) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    int blocks = iov_blocks(iov, count);
+    TRACE3(bio_start, 0, block_num, blocks);
+    if (ram.blocks) {
+		retstat = ram_rw(block_num, iov, count, 0);
+		TRACE4(bio_done, 0, block_num, blocks, retstat);
+		return retstat;
+    }
+    tier_rdlock();
+    if ((direct_io && !iov_aligned(iov, count)) || tier_spans(block_num, blocks)) {
+		retstat = bio_split(block_num, iov, count, 0);
+		tier_unlock();
+		TRACE4(bio_done, 0, block_num, blocks, retstat);
+		return retstat;
+    }
+    if (ndevs > 1)
+		retstat = bio_striped(block_num, iov, count, 0);
+    else
+		retstat = preadv(devs[0], iov, count, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
-		    perror("block_write failed");
+		perror("block_readv failed");
     }
+    if (tier.fd >= 0) {
+		for (int b = block_num; b < block_num + blocks; b++)
+			tier_touch(b, 1);
+		__atomic_fetch_add(&tier.stats.slow_reads, blocks, __ATOMIC_RELAXED);
+    }
+    tier_unlock();
+    TRACE4(bio_done, 0, block_num, blocks, retstat);
+    return retstat;
+}
+
+//Write count consecutive blocks starting at block_num, one iovec per block,
+//with a single system call
+int bio_writev(const int block_num, const struct iovec *iov, int count) {
+    int retstat = 0;
+    int blocks = iov_blocks(iov, count);
+    TRACE3(bio_start, 1, block_num, blocks);
+    if (ram.blocks) {
+		retstat = ram_rw(block_num, iov, count, 1);
+		TRACE4(bio_done, 1, block_num, blocks, retstat);
+		return retstat;
+    }
+    cbt_mark(block_num, blocks);
+    tier_rdlock();
+    if ((direct_io && !iov_aligned(iov, count)) || tier_spans(block_num, blocks)) {
+		retstat = bio_split(block_num, iov, count, 1);
+		tier_unlock();
+		TRACE4(bio_done, 1, block_num, blocks, retstat);
+		return retstat;
+    }
+    if (ndevs > 1)
+		retstat = bio_striped(block_num, iov, count, 1);
+    else
+		retstat = pwritev(devs[0], iov, count, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		perror("block_writev failed");
+    }
+    tier_unlock();
+    TRACE4(bio_done, 1, block_num, blocks, retstat);
+    return retstat;
+}
+
+//Drop the contents of count blocks from block_num, returns 0 or -1
+int bio_discard(const int block_num, int count) {
+    int retstat = 0;
+    if (!discard_ok || ndevs == 0) {
+		return -1;
+    }
+
+    if (ram.blocks) {
+		// memory reads back zeros now, the files lose the blocks at the next checkpoint
+		ram_enter();
+		memset(ram.blocks + (size_t)block_num * BLOCK_SIZE, 0, (size_t)count * BLOCK_SIZE);
+		memset(ram.state + block_num, RAM_DISCARD, count);
+		cbt_mark(block_num, count);
+		ram_leave();
+		return 0;
+    }
+
+    cbt_mark(block_num, count);
+    tier_rdlock();
+    retstat = dev_punch(block_num, count);
+
+    // a freed block held by the fast tier need not be copied back
+    for (int b = block_num; b < block_num + count && tier.fd >= 0; b++) {
+		if (b >= tier.meta_blocks && b < tier.nblocks && tier.slot_of[b] >= 0)
+			tier.dirty[tier.slot_of[b]] = 0;
+    }
+    tier_unlock();
     return retstat;
 }
 
+//Locate a block in the disk file for I/O done directly on the descriptor
+//(write is set when the caller is about to modify the block), returns the
+//descriptor and sets *pos, or -1 if the block cannot be accessed that way
+int bio_fd(const int block_num, off_t *pos, int write) {
+    // O_DIRECT descriptors cannot take the unaligned transfers of fd buffers,
+    // tiered blocks may move while the caller still holds the position, and
+    // in RAM mode the files are not current
+    if (ndevs == 0 || direct_io || tier.fd >= 0 || ram.blocks) {
+		return -1;
+    }
+    if (write)
+		cbt_mark(block_num, 1);
+    return dev_map(block_num, pos);
+}
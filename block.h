@@ -8,12 +8,76 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
+//Disk size set to 32MB, the size a new image starts at
+#define DISK_SIZE	(32*1024*1024)
+
+/* Buffers handed to the bio_* calls should carry this so direct mode can
+ * transfer them without a bounce copy */
+#define BLOCK_ALIGNED __attribute__((aligned(BLOCK_SIZE)))
+
+/* diskfile_path may list several files separated by ':' to stripe over them */
+void dev_stripe_unit(int blocks);
+void dev_geometry(int *count, int *unit);
+/* Bypass the host page cache with O_DIRECT, call before dev_init/dev_open */
+void dev_direct(int on);
+
+/* Tiered mode: a fast file holds blocks below meta_blocks and slots for
+ * the most read data blocks, call before dev_init/dev_open */
+struct tier_stats {
+    int slots;
+    int used;
+    unsigned long long fast_reads;	/* blocks read from the fast tier */
+    unsigned long long slow_reads;	/* blocks read from the capacity tier */
+    unsigned long long promoted;
+    unsigned long long demoted;
+};
+void dev_tier(const char *fast_path, int meta_blocks, int nblocks, int slots);
+void dev_tier_hint(int block_num);
+int dev_tier_stats(struct tier_stats *stats);
+/* RAM mode: the image is served from memory and a background thread
+ * checkpoints it to the backing files every period seconds and at
+ * dev_close, call before dev_init/dev_open. nblocks bounds the block
+ * numbers. File system operations are bracketed by dev_op_begin/end so a
+ * checkpoint never sees one half done, dev_sync takes a checkpoint and
+ * returns once it is on disk, so call it with the image consistent. */
+struct ram_stats {
+    unsigned long long checkpoints;
+    unsigned long long blocks;		/* blocks written by checkpoints */
+    long last_ms;					/* duration of the last checkpoint */
+    int dirty;						/* blocks changed since */
+};
+void dev_ram(int nblocks, int period);
+void dev_op_begin();
+void dev_op_end();
+int dev_ram_stats(struct ram_stats *stats);
+/* Changed block tracking: blocks written are stamped with a generation
+ * number bumped at each checkpoint (dev_sync, or a RAM mode one), kept in
+ * a file next to the first backing file. dev_cbt starts the file if the
+ * image has none, call before dev_init/dev_open; images that have one are
+ * tracked either way. */
+struct cbt_stats {
+    unsigned generation;			/* last checkpoint */
+    unsigned base;					/* changes are known from this generation on */
+    int changed;					/* blocks written since */
+};
+void dev_cbt(int nblocks);
+int dev_cbt_stats(struct cbt_stats *stats);
+int dev_cbt_since(unsigned since, unsigned char *bitmap, int nblocks);
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
+int dev_resize(int nblocks);
 void dev_close();
+int dev_sync();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, int count);
+int bio_writev(const int block_num, const struct iovec *iov, int count);
+int bio_discard(const int block_num, int count);
+int bio_fd(const int block_num, off_t *pos, int write);
 
 #endif
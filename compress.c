@@ -0,0 +1,181 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	compress.c
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/*
+ * Stream format: a sequence of
+ *	token (literal length << 4 | (match length - 4))
+ *	[literal length extension bytes] literals
+ *	offset (2 bytes, little endian) [match length extension bytes]
+ * A nibble of 15 is continued by bytes of 255 plus a final remainder byte.
+ * The last sequence carries literals only and ends exactly at the end of input.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// write a length extension, returns new output position or NULL if out of space
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, int len)
+{
+	while (len >= 255)
+	{
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+// emit one sequence, match_len == 0 means literals only (last sequence)
+static uint8_t *lz_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len, int offset, int match_len)
+{
+	int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+	if (lit_len >= 15 && !(op = lz_put_len(op, oend, lit_len - 15)))
+		return NULL;
+	if (oend - op < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (ml >= 15 && !(op = lz_put_len(op, oend, ml - 15)))
+		return NULL;
+	return op;
+}
+
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t *in = (const uint8_t *)src;
+	const uint8_t *ip = in, *anchor = in, *end = in + src_len;
+	uint8_t *op = (uint8_t *)dst, *oend = op + dst_cap;
+	int table[1 << LZ_HASH_LOG];
+
+	if (src_len < 0 || src_len > LZ_MAX_INPUT)
+		return -1;
+	memset(table, 0xff, sizeof(table));
+
+	while (end - ip >= LZ_MIN_MATCH)
+	{
+		uint32_t seq = lz_read32(ip);
+		int h = lz_hash(seq);
+		int ref = table[h];
+		table[h] = ip - in;
+
+		if (ref < 0 || (ip - in) - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != seq)
+		{
+			ip++;
+			continue;
+		}
+
+		// extend the match as far as it goes
+		const uint8_t *m = in + ref + LZ_MIN_MATCH;
+		const uint8_t *p = ip + LZ_MIN_MATCH;
+		while (p < end && *p == *m)
+		{
+			p++;
+			m++;
+		}
+		op = lz_emit(op, oend, anchor, ip - anchor, (ip - in) - ref, p - ip);
+		if (!op)
+			return -1;
+		ip = anchor = p;
+	}
+
+	op = lz_emit(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return -1;
+	return op - (uint8_t *)dst;
+}
+
+// read a length extension, returns -1 on truncated input
+static int lz_get_len(const uint8_t **ipp, const uint8_t *iend, int len)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+
+	do
+	{
+		if (ip >= iend)
+			return -1;
+		b = *ip++;
+		len += b;
+	} while (b == 255 && len <= LZ_MAX_INPUT);
+	*ipp = ip;
+	return len;
+}
+
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + src_len;
+	uint8_t *out = (uint8_t *)dst, *op = out, *oend = out + dst_cap;
+
+	while (ip < iend)
+	{
+		int token = *ip++;
+		int lit_len = token >> 4;
+		int match_len = token & 15;
+
+		// Step 1: copy the literals
+		if (lit_len == 15 && (lit_len = lz_get_len(&ip, iend, lit_len)) < 0)
+			return -1;
+		if (iend - ip < lit_len || oend - op < lit_len)
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == iend)
+			break;
+
+		// Step 2: copy the match, byte by byte since it may overlap itself
+		if (iend - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (match_len == 15 && (match_len = lz_get_len(&ip, iend, match_len)) < 0)
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op - out || oend - op < match_len)
+			return -1;
+		const uint8_t *m = op - offset;
+		for (int i = 0; i < match_len; i++)
+			op[i] = m[i];
+		op += match_len;
+	}
+
+	return op - out;
+}
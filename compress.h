@@ -0,0 +1,23 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	compress.h
+ *
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+/*
+ * Small LZ77 codec (LZ4-style token stream) used for compressed file data.
+ * Inputs are limited to 64KB so that match offsets fit in 16 bits.
+ */
+#define LZ_MAX_INPUT 65536
+
+/* Returns the compressed length, or -1 if the output does not fit in dst_cap */
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+
+/* Returns the decompressed length, or -1 if the input is corrupt */
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);
+
+#endif
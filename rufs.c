@@ -16,24 +16,98 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "block.h"
 #include "rufs.h"
+#include "compress.h"
+#include "scratch.h"
+#include "alloc.h"
+#include "trace.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
 
 char diskfile_path[PATH_MAX];
 
 // Declare your in-memory data structures here
 struct superblock sb;
-#define ROOT_INO 0
+
+// mount options
+struct rufs_options opts;
+
+// compression statistics since mount
+struct comp_stats {
+	uint64_t clusters_compressed;	/* clusters stored compressed */
+	uint64_t clusters_raw;			/* clusters stored raw (incompressible) */
+	uint64_t bytes_in;				/* logical bytes of clusters written */
+	uint64_t bytes_out;				/* bytes of data blocks used to store them */
+};
+struct comp_stats cstats;
+
+// data block reference counts, mirrored from disk
+uint16_t *blk_refs;
+
+// data block bitmap, mirrored from disk
+bitmap_t d_bitmap;
+
+// dedup fingerprint index, mirrored from disk when dedup is enabled
+struct fp_entry *fp_index;
+
+// dedup statistics since mount
+struct dedup_stats {
+	uint64_t hits;					/* block writes satisfied by an existing block */
+	uint64_t misses;				/* block writes that stored new contents */
+};
+struct dedup_stats dstats;
+
+// snapshot table, mirrored from disk
+struct snapshot *snaps;
+
+// id of the last snapshot taken since mount, reported through the control file
+uint32_t last_snapshot;
+
+// time of mount, reported for the control file and snapshot directory
+time_t mount_time;
+
+/*
+ * Data block reference counts
+ * A data block may be shared by several files (dedup), it goes back to the
+ * data block bitmap only when its last reference is released.
+ */
+int set_refs(int blkno, uint16_t refs)
+{
+	blk_refs[blkno] = refs;
+
+	// write through the reference count block holding this entry
+	int first = blkno / REFS_PER_BLOCK * REFS_PER_BLOCK;
+	if (bio_write(sb.r_start_blk + blkno / REFS_PER_BLOCK, &blk_refs[first]) < 0)
+	{
+		perror("Failed to write reference count block to disk");
+		return -1;
+	}
+	return 0;
+}
+
+int share_blkno(int blkno)
+{
+	return set_refs(blkno, blk_refs[blkno] + 1);
+}
+
 /*
  * Get available inode number from bitmap
  */
 int get_avail_ino()
 {
 	// Step 1: Read inode bitmap from disk
-	bitmap_t inode_bitmap = (bitmap_t)malloc(BLOCK_SIZE);
+	bitmap_t inode_bitmap = (bitmap_t)scratch_get();
 	if (!inode_bitmap)
 	{
 		perror("Failed to allocate memory for inode bitmap");
@@ -44,7 +118,7 @@ int get_avail_ino()
 	if (bio_read(sb.i_bitmap_blk, inode_bitmap) < 0)
 	{
 		perror("Failed to read inode bitmap from disk");
-		free(inode_bitmap);
+		scratch_put(inode_bitmap);
 		return -1;
 	}
 
@@ -58,76 +132,555 @@ int get_avail_ino()
 			if (bio_write(sb.i_bitmap_blk, inode_bitmap) < 0)
 			{
 				perror("Failed to write updated inode bitmap to disk");
-				free(inode_bitmap);
+				scratch_put(inode_bitmap);
 				return -1;
 			}
-			free(inode_bitmap);
+			scratch_put(inode_bitmap);
+			TRACE1(alloc_ino, i);
 			return i; // Return the available inode number
 		}
 	}
 
 	// No available inode found
-	free(inode_bitmap);
+	scratch_put(inode_bitmap);
+	TRACE1(alloc_ino, -1);
 	return -1;
 }
 
+/*
+ * Give back an inode number get_avail_ino() handed out but that never made
+ * it into a directory
+ */
+void release_ino(int ino)
+{
+	bitmap_t inode_bitmap = (bitmap_t)scratch_get();
+	if (!inode_bitmap)
+	{
+		perror("Failed to allocate memory for inode bitmap");
+		return;
+	}
+	if (bio_read(sb.i_bitmap_blk, inode_bitmap) < 0)
+	{
+		perror("Failed to read inode bitmap from disk");
+		scratch_put(inode_bitmap);
+		return;
+	}
+	unset_bitmap(inode_bitmap, ino);
+	if (bio_write(sb.i_bitmap_blk, inode_bitmap) < 0)
+		perror("Failed to write updated inode bitmap to disk");
+	scratch_put(inode_bitmap);
+}
+
+/*
+ * Data block allocation
+ * The data block bitmap is mirrored in memory and indexed by the free extent
+ * tree (alloc.c), which finds a run of free blocks without scanning the
+ * bitmap. Changes are written through to the bitmap block on disk.
+ *
+ * Freed blocks are queued as runs and discarded from the disk file once the
+ * bitmap that frees them has been written, never before.
+ */
+#define DISCARD_RUNS 32
+
+struct discard_run {
+	int start;
+	int count;
+};
+
+static struct discard_run discards[DISCARD_RUNS];
+static int ndiscards;
+
+static int write_data_bitmap()
+{
+	if (bio_write(sb.d_bitmap_blk, d_bitmap) < 0)
+	{
+		perror("Failed to write updated data block bitmap to disk");
+		return -1;
+	}
+	for (int i = 0; i < ndiscards; i++)
+		bio_discard(discards[i].start, discards[i].count);
+	ndiscards = 0;
+	return 0;
+}
+
+// Set the reference counts of a run of blocks, one write per count block it touches
+static void set_refs_run(int start, int count, uint16_t refs)
+{
+	for (int j = start; j < start + count; j++)
+		blk_refs[j] = refs;
+	for (int r = start / REFS_PER_BLOCK; r <= (start + count - 1) / REFS_PER_BLOCK; r++)
+		bio_write(sb.r_start_blk + r, (char *)blk_refs + r * BLOCK_SIZE);
+}
+
+/*
+ * Mark a run of count contiguous available data blocks used, preferably at or
+ * after block goal (0 for no preference), returns the first one. Only the
+ * first held blocks get a reference, the rest are merely reserved.
+ */
+static int reserve_blkrun(int count, int held, int goal)
+{
+	// Step 1: the free extent tree finds the run and marks it used, after
+	// queued discards are done so none of them can hit a new block
+	if (ndiscards > 0 && write_data_bitmap() < 0)
+		return -1;
+	int start = ext_alloc(count, goal);
+	TRACE3(alloc_blocks, count, goal, start);
+	if (start < 0)
+		return -1;
+
+	// Step 2: Update data block bitmap and write to disk
+	for (int j = start; j < start + count; j++)
+		set_bitmap(d_bitmap, j);
+	if (write_data_bitmap() < 0)
+	{
+		for (int j = start; j < start + count; j++)
+			unset_bitmap(d_bitmap, j);
+		ext_mark(start, count, 0);
+		return -1;
+	}
+
+	// Step 3: the blocks handed out get their reference
+	if (held > 0)
+		set_refs_run(start, held, 1);
+	return start;
+}
+
+/*
+ * Get a run of count contiguous available data blocks, preferably at or after
+ * block goal (0 for no preference), returns the first one
+ */
+int get_avail_blkrun_near(int count, int goal)
+{
+	return reserve_blkrun(count, count, goal);
+}
+
+int get_avail_blkrun(int count)
+{
+	return get_avail_blkrun_near(count, 0);
+}
+
 /*
  * Get available data block number from bitmap
  */
 int get_avail_blkno()
 {
+	return get_avail_blkrun_near(1, 0);
+}
 
-	// Step 1: Read data block bitmap from disk
-	bitmap_t data_bitmap = (bitmap_t)malloc(BLOCK_SIZE);
-	if (!data_bitmap)
+// Where the next block of a file would continue its previous one, 0 if unknown
+int block_goal(const struct inode *inode, int i)
+{
+	return i > 0 && inode->direct_ptr[i - 1] != 0 ? inode->direct_ptr[i - 1] + 1 : 0;
+}
+
+// Return a block whose last reference has gone to the free space
+static void free_blkno(int blkno)
+{
+	TRACE1(free_block, blkno);
+	unset_bitmap(d_bitmap, blkno);
+	ext_mark(blkno, 1, 0);
+
+	// queue it for discard, extending the last run when it continues it
+	struct discard_run *last = ndiscards ? &discards[ndiscards - 1] : NULL;
+	if (last && last->start + last->count == blkno)
 	{
-		perror("Failed to allocate memory for data block bitmap");
+		last->count++;
+		return;
+	}
+	if (ndiscards == DISCARD_RUNS)
+		write_data_bitmap();
+	if (ndiscards < DISCARD_RUNS)
+	{
+		discards[ndiscards].start = blkno;
+		discards[ndiscards].count = 1;
+		ndiscards++;
+	}
+}
+
+/*
+ * Release a reference to a data block, freeing it in the data block bitmap
+ * when it was the last one
+ */
+int release_blkno(int blkno)
+{
+	if (blk_refs[blkno] > 1)
+		return set_refs(blkno, blk_refs[blkno] - 1);
+
+	free_blkno(blkno);
+	if (write_data_bitmap() < 0)
 		return -1;
+	return set_refs(blkno, 0);
+}
+
+/*
+ * Preallocation windows
+ * A file growing past its end reserves the next PREALLOC_BLOCKS blocks with
+ * one allocator call, and appends that follow take them from the window
+ * without touching the bitmap again. Windows live in memory, one slot per
+ * inode number modulo PREALLOC_SLOTS; the unused rest goes back to the free
+ * space when the file is released or another file needs the slot. Reserved
+ * blocks are only marked in the bitmap and keep a reference count of 0 until
+ * they are handed out, so nothing else (a stale dedup fingerprint, say) can
+ * take them for a block in use; after a crash rufs_fsck frees them.
+ */
+#define PREALLOC_BLOCKS 8
+#define PREALLOC_SLOTS 64
+
+struct prealloc {
+	uint16_t ino;					/* owner of the window */
+	int start;						/* next reserved block */
+	int count;						/* reserved blocks left, 0 if the slot is free */
+};
+
+static struct prealloc windows[PREALLOC_SLOTS];
+
+// Give what is left of a file's window back to the free space
+void prealloc_trim(uint16_t ino)
+{
+	struct prealloc *w = &windows[ino % PREALLOC_SLOTS];
+	if (w->count == 0 || w->ino != ino)
+		return;
+
+	for (int j = w->start; j < w->start + w->count; j++)
+		free_blkno(j);
+	write_data_bitmap();
+	w->count = 0;
+}
+
+/*
+ * Get count contiguous blocks for blocks i.. of a file, returns the first.
+ * Appends continue the file's window, or open a new one.
+ */
+int get_file_blkrun(struct inode *inode, int i, int count)
+{
+	struct prealloc *w = &windows[inode->ino % PREALLOC_SLOTS];
+	int goal = block_goal(inode, i);
+
+	// Step 1: blocks that continue the window come straight out of it
+	if (w->count >= count && w->ino == inode->ino && goal == w->start)
+	{
+		int start = w->start;
+		w->start += count;
+		w->count -= count;
+		set_refs_run(start, count, 1);
+		return start;
+	}
+
+	// Step 2: a regular file growing past its end reserves a window along with them
+	int want = count;
+	if (inode->type == S_IFREG && (off_t)i * BLOCK_SIZE >= inode->bytes)
+	{
+		want = NUM_DIRECT - i < PREALLOC_BLOCKS ? NUM_DIRECT - i : PREALLOC_BLOCKS;
+		if (want < count)
+			want = count;
+	}
+	int start = want > count ? reserve_blkrun(want, count, goal) : -1;
+	if (start < 0)
+		return get_avail_blkrun_near(count, goal);
+	prealloc_trim(w->ino);
+	w->ino = inode->ino;
+	w->start = start + count;
+	w->count = want - count;
+	return start;
+}
+
+/*
+ * Dedup fingerprint index
+ * A hash table of FP_BUCKETS blocks, a fingerprint selects the bucket block and
+ * the first slot to probe. Entries are never removed, they are only replaced,
+ * so a stale entry (block freed or rewritten since) is possible and every hit
+ * is verified against the block contents before it is shared.
+ */
+uint64_t fingerprint(const void *block)
+{
+	const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t lane[4] = {prime1, prime2, ~prime1, ~prime2};
+	const unsigned char *p = (const unsigned char *)block;
+
+	for (int i = 0; i < BLOCK_SIZE; i += 32)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			uint64_t v;
+			memcpy(&v, p + i + j * 8, sizeof(v));
+			lane[j] += v * prime2;
+			lane[j] = (lane[j] << 31) | (lane[j] >> 33);
+			lane[j] *= prime1;
+		}
+	}
+	uint64_t h = lane[0] ^ (lane[1] * prime1) ^ (lane[2] * prime2) ^ lane[3];
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	return h;
+}
+
+// Find a block holding exactly these contents, returns its number or 0
+int fp_lookup(uint64_t fp, const void *block)
+{
+	struct fp_entry *bucket = &fp_index[(fp % FP_BUCKETS) * FP_PER_BUCKET];
+	int start = (fp / FP_BUCKETS) % FP_PER_BUCKET;
+	char temp_block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	for (int i = 0; i < FP_PER_BUCKET; i++)
+	{
+		struct fp_entry *e = &bucket[(start + i) % FP_PER_BUCKET];
+		if (e->blkno == 0)
+			break;
+		if (e->fp != fp || blk_refs[e->blkno] == 0)
+			continue;
+		if (bio_read(e->blkno, temp_block) >= 0 && memcmp(temp_block, block, BLOCK_SIZE) == 0)
+			return e->blkno;
+	}
+	return 0;
+}
+
+// Record that blkno holds contents with fingerprint fp
+int fp_insert(uint64_t fp, int blkno)
+{
+	int bucket_num = fp % FP_BUCKETS;
+	struct fp_entry *bucket = &fp_index[bucket_num * FP_PER_BUCKET];
+	int start = (fp / FP_BUCKETS) % FP_PER_BUCKET;
+	struct fp_entry *slot = NULL;
+
+	// take the first empty, stale or same-fingerprint slot, else evict the home slot
+	for (int i = 0; i < FP_PER_BUCKET && !slot; i++)
+	{
+		struct fp_entry *e = &bucket[(start + i) % FP_PER_BUCKET];
+		if (e->blkno == 0 || e->fp == fp || blk_refs[e->blkno] == 0)
+			slot = e;
 	}
+	if (!slot)
+		slot = &bucket[start];
+	if (slot->fp == fp && slot->blkno == blkno)
+		return 0;
+	slot->fp = fp;
+	slot->blkno = blkno;
 
-	// Assuming the data block bitmap is located at sb.d_bitmap_blk
-	if (bio_read(sb.d_bitmap_blk, data_bitmap) < 0)
+	if (bio_write(sb.f_start_blk + bucket_num, bucket) < 0)
 	{
-		perror("Failed to read data block bitmap from disk");
-		free(data_bitmap);
+		perror("Failed to write fingerprint index block to disk");
 		return -1;
 	}
+	return 0;
+}
+
+// Block from moved to block to, repoint its entry or make a new one
+int fp_move(uint64_t fp, int from, int to)
+{
+	int bucket_num = fp % FP_BUCKETS;
+	struct fp_entry *bucket = &fp_index[bucket_num * FP_PER_BUCKET];
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	for (int i = 0; i < MAX_DNUM; i++)
+	for (int i = 0; i < FP_PER_BUCKET; i++)
 	{
-		if (get_bitmap(data_bitmap, i) == 0)
-		{ // Found a free data block
-			// Step 3: Update data block bitmap and write to disk
-			set_bitmap(data_bitmap, i);
-			if (bio_write(sb.d_bitmap_blk, data_bitmap) < 0)
-			{
-				perror("Failed to write updated data block bitmap to disk");
-				free(data_bitmap);
-				return -1;
-			}
-			free(data_bitmap);
-			return i; // Return the available data block number
+		struct fp_entry *e = &bucket[i];
+		if (e->fp != fp || e->blkno != from)
+			continue;
+		e->blkno = to;
+		if (bio_write(sb.f_start_blk + bucket_num, bucket) < 0)
+		{
+			perror("Failed to write fingerprint index block to disk");
+			return -1;
 		}
+		return 0;
 	}
-	// No available data block found
-	free(data_bitmap);
-	return -1;
+	return fp_insert(fp, to);
 }
 
 /*
  * inode operations
+ * Inodes are kept on disk as compact struct dinode records, 32 to a block,
+ * and converted to struct inode when they are read.
  */
-int readi(uint16_t ino, struct inode *inode)
+_Static_assert(sizeof(struct dinode) == 128, "on-disk inode must stay 128 bytes");
+
+static int64_t ts_to_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void ns_to_ts(int64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+void inode_decode(const struct dinode *dinode, struct inode *inode)
+{
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = dinode->ino;
+	inode->valid = dinode->version != 0;
+	inode->type = dinode->mode & S_IFMT;
+	inode->link = dinode->nlink;
+	inode->bytes = dinode->size;
+	inode->size = (dinode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (int i = 0; i < NUM_DIRECT; i++)
+		inode->direct_ptr[i] = dinode->direct_ptr[i];
+	memcpy(inode->c_len, dinode->c_len, sizeof(inode->c_len));
+	inode->vstat.st_mode = dinode->mode;
+	ns_to_ts(dinode->mtime, &inode->vstat.st_mtim);
+	ns_to_ts(dinode->ctime, &inode->vstat.st_ctim);
+	ns_to_ts(dinode->atime ? dinode->atime : dinode->mtime, &inode->vstat.st_atim);
+}
+
+void inode_encode(const struct inode *inode, struct dinode *dinode)
+{
+	memset(dinode, 0, sizeof(struct dinode));
+	if (!inode->valid)
+		return;
+	dinode->version = DINODE_VERSION;
+	dinode->ino = inode->ino;
+	dinode->mode = inode->type | (inode->vstat.st_mode & ~S_IFMT);
+	dinode->size = inode->bytes;
+	dinode->nlink = inode->link;
+	memcpy(dinode->c_len, inode->c_len, sizeof(dinode->c_len));
+	dinode->mtime = ts_to_ns(&inode->vstat.st_mtim);
+	dinode->ctime = ts_to_ns(&inode->vstat.st_ctim);
+	dinode->atime = ts_to_ns(&inode->vstat.st_atim);
+	for (int i = 0; i < NUM_DIRECT; i++)
+		dinode->direct_ptr[i] = inode->direct_ptr[i];
+}
+
+// Set the modification and change times to now
+void inode_touch(struct inode *inode)
+{
+	clock_gettime(CLOCK_REALTIME, &inode->vstat.st_mtim);
+	inode->vstat.st_ctim = inode->vstat.st_mtim;
+}
+
+/*
+ * lazytime: times that change as a side effect (atime on a read, mtime and
+ * ctime on a write that leaves the rest of the inode alone) wait in memory
+ * instead of costing an inode write each. They reach the inode table with
+ * the next write of the inode for another reason, when the file is released
+ * or synced, or once they are opts.lazytime seconds old (LAZY_EXPIRE by
+ * default). Inodes read from the live table carry them in the meantime.
+ */
+#define LAZY_EXPIRE 60
+
+static struct lazy_times
+{
+	struct timespec atime, mtime, ctime;
+	time_t since;					/* first change still in memory, 0 if none */
+} lazy[MAX_INUM];
+static int lazy_pending;
+static time_t lazy_due;				/* when the oldest pending times expire */
+
+static int lazy_expiry()
+{
+	return opts.lazytime > 0 ? opts.lazytime : LAZY_EXPIRE;
+}
+
+// Lay the pending times of a live inode over what the table holds
+static void lazy_apply(uint32_t i_start_blk, uint16_t ino, struct inode *inode)
+{
+	if (lazy_pending == 0 || i_start_blk != sb.i_start_blk || ino >= MAX_INUM || lazy[ino].since == 0)
+		return;
+	inode->vstat.st_atim = lazy[ino].atime;
+	inode->vstat.st_mtim = lazy[ino].mtime;
+	inode->vstat.st_ctim = lazy[ino].ctime;
+}
+
+static void lazy_hold(const struct inode *inode)
+{
+	struct lazy_times *lt = &lazy[inode->ino];
+
+	if (lt->since == 0)
+	{
+		lt->since = time(NULL);
+		if (lazy_pending++ == 0)
+			lazy_due = lt->since + lazy_expiry();
+	}
+	lt->atime = inode->vstat.st_atim;
+	lt->mtime = inode->vstat.st_mtim;
+	lt->ctime = inode->vstat.st_ctim;
+}
+
+// The inode was written with its times, nothing is pending for it any more
+static void lazy_forget(uint16_t ino)
+{
+	if (ino < MAX_INUM && lazy[ino].since != 0)
+	{
+		lazy[ino].since = 0;
+		lazy_pending--;
+	}
+}
+
+// Write pending times of an inode to the table, returns 0 or -1
+int lazy_flush(uint16_t ino)
+{
+	struct inode inode;
+
+	if (ino >= MAX_INUM || lazy[ino].since == 0)
+		return 0;
+	if (readi(ino, &inode) < 0)
+		return -1;
+	return writei(ino, &inode);
+}
+
+void lazy_flush_all()
+{
+	for (int ino = 0; ino < MAX_INUM && lazy_pending > 0; ino++)
+		lazy_flush(ino);
+}
+
+// Write the times that have waited long enough, called between operations
+void lazy_expire()
+{
+	if (lazy_pending == 0)
+		return;
+	time_t now = time(NULL);
+	if (now < lazy_due)
+		return;
+	time_t oldest = now;
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		if (lazy[ino].since == 0)
+			continue;
+		if (lazy[ino].since + lazy_expiry() <= now)
+			lazy_flush(ino);
+		else if (lazy[ino].since < oldest)
+			oldest = lazy[ino].since;
+	}
+	lazy_due = oldest + lazy_expiry();
+}
+
+// A live file was read, its atime moves in memory only
+void inode_accessed(struct inode *inode)
+{
+	clock_gettime(CLOCK_REALTIME, &inode->vstat.st_atim);
+	lazy_hold(inode);
+}
+
+// utimens(): set or keep (UTIME_OMIT) or take the time now (UTIME_NOW, or tv NULL)
+int inode_set_times(struct inode *inode, const struct timespec tv[2])
+{
+	struct timespec now;
+	struct timespec *times[2] = {&inode->vstat.st_atim, &inode->vstat.st_mtim};
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (int i = 0; i < 2; i++)
+	{
+		if (!tv || tv[i].tv_nsec == UTIME_NOW)
+			*times[i] = now;
+		else if (tv[i].tv_nsec != UTIME_OMIT)
+			*times[i] = tv[i];
+	}
+	inode->vstat.st_ctim = now;
+	return writei(inode->ino, inode) < 0 ? -EIO : 0;
+}
+
+int readi_at(uint32_t i_start_blk, uint16_t ino, struct inode *inode)
 {
 	// Step 1: Get the inode's on-disk block number
-	int block_num = sb.i_start_blk + ino / INODES_PER_BLOCK;
+	int block_num = i_start_blk + ino / INODES_PER_BLOCK;
 
 	// Step 2: Get offset of the inode in the inode on-disk block
 	int offset = ino % INODES_PER_BLOCK;
 
 	// Step 3: Read the block from disk and then copy into inode structure
-	struct inode *inode_block = (struct inode *)malloc(BLOCK_SIZE);
+	struct dinode *inode_block = (struct dinode *)scratch_get();
 	if (!inode_block)
 	{
 		perror("Failed to allocate memory for inode block");
@@ -136,16 +689,58 @@ int readi(uint16_t ino, struct inode *inode)
 	if (bio_read(block_num, inode_block) < 0)
 	{
 		perror("Failed to read inode block from disk");
-		free(inode_block);
+		scratch_put(inode_block);
 		return -1;
 	}
-	memcpy(inode, &inode_block[offset], sizeof(struct inode));
-	free(inode_block);
+	inode_decode(&inode_block[offset], inode);
+	scratch_put(inode_block);
+	lazy_apply(i_start_blk, ino, inode);
 
 	return 0;
 }
 
-int writei(uint16_t ino, struct inode *inode)
+int inode_cache_init(struct inode_cache *cache, uint32_t i_start_blk)
+{
+	cache->i_start_blk = i_start_blk;
+	cache->block_num = -1;
+	cache->block = (char *)scratch_get();
+	return cache->block ? 0 : -1;
+}
+
+void inode_cache_release(struct inode_cache *cache)
+{
+	scratch_put(cache->block);
+}
+
+// readi_at() through a one block cache, for walking the children of a directory
+int readi_cached(struct inode_cache *cache, uint16_t ino, struct inode *inode)
+{
+	int block_num = cache->i_start_blk + ino / INODES_PER_BLOCK;
+	if (cache->block_num != block_num)
+	{
+		if (bio_read(block_num, cache->block) < 0)
+		{
+			perror("Failed to read inode block from disk");
+			cache->block_num = -1;
+			return -1;
+		}
+		cache->block_num = block_num;
+	}
+	inode_decode((struct dinode *)cache->block + ino % INODES_PER_BLOCK, inode);
+	lazy_apply(cache->i_start_blk, ino, inode);
+	return 0;
+}
+
+int readi(uint16_t ino, struct inode *inode)
+{
+	return readi_at(sb.i_start_blk, ino, inode);
+}
+
+/*
+ * Store an inode; lazy leaves it in memory when nothing but its times
+ * changed, which is found out from the block writei() has to read anyway
+ */
+static int store_inode(uint16_t ino, struct inode *inode, int lazy)
 {
 	// Step 1: Get the block number where this inode resides on disk
 	int block_num = sb.i_start_blk + ino / INODES_PER_BLOCK;
@@ -154,7 +749,7 @@ int writei(uint16_t ino, struct inode *inode)
 	int offset = ino % INODES_PER_BLOCK;
 
 	// Step 3: Write inode to disk
-	struct inode *inode_block = (struct inode *)malloc(BLOCK_SIZE);
+	struct dinode *inode_block = (struct dinode *)scratch_get();
 	if (!inode_block)
 	{
 		perror("Failed to allocate memory for inode block");
@@ -163,236 +758,590 @@ int writei(uint16_t ino, struct inode *inode)
 	if (bio_read(block_num, inode_block) < 0)
 	{
 		perror("Failed to read inode block from disk");
-		free(inode_block);
+		scratch_put(inode_block);
 		return -1;
 	}
-	memcpy(&inode_block[offset], inode, sizeof(struct inode));
+	struct dinode dinode;
+	inode_encode(inode, &dinode);
+	if (lazy)
+	{
+		struct dinode stored = inode_block[offset];
+		stored.atime = dinode.atime;
+		stored.mtime = dinode.mtime;
+		stored.ctime = dinode.ctime;
+		if (memcmp(&stored, &dinode, sizeof(dinode)) == 0)
+		{
+			scratch_put(inode_block);
+			lazy_hold(inode);
+			return 0;
+		}
+	}
+	inode_block[offset] = dinode;
 	if (bio_write(block_num, inode_block) < 0)
 	{
 		perror("Failed to write inode block to disk");
-		free(inode_block);
+		scratch_put(inode_block);
 		return -1;
 	}
-	free(inode_block);
+	scratch_put(inode_block);
+	lazy_forget(ino);
 	return 0;
 }
 
+int writei(uint16_t ino, struct inode *inode)
+{
+	return store_inode(ino, inode, 0);
+}
+
+// writei() for an inode whose times moved as a side effect, they may wait (lazytime)
+int writei_lazy(uint16_t ino, struct inode *inode)
+{
+	return store_inode(ino, inode, 1);
+}
+
 /*
- * directory operations
+ * file data operations
+ *
+ * File blocks are grouped into clusters of CLUSTER_BLKS blocks. A cluster is
+ * either stored raw (c_len == 0, one data block per file block, 0 for holes),
+ * or compressed (c_len bytes spread over the first blocks of the cluster's
+ * direct pointers, remaining pointers 0).
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent)
+
+// Store block i of a file's data, allocating, sharing or copying as needed
+int store_block(struct inode *inode, int i, const char *buf)
 {
-	// get first name_len characters of fname
-	char *name = (char *)malloc(name_len + 1);
-	strncpy(name, fname, name_len);
-	name[name_len] = '\0';
-	
-	// printf("calling dir_find with parameters: ino: %d, fname: %s, name_len: %d, name: %s\n", ino, fname, name_len, name);
+	int *ptr = &inode->direct_ptr[i];
+	uint64_t fp = 0;
 
-	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	struct inode *inode = (struct inode *)malloc(sizeof(struct inode));
-	int result = readi(ino, inode);
-	if (result < 0)
+	// Step 1: with dedup, point at an existing block with the same contents
+	if (opts.dedup)
 	{
-		perror("Failed to read inode");
-		free(inode);
-		return -1;
+		fp = fingerprint(buf);
+		int match = fp_lookup(fp, buf);
+		if (match == *ptr && match != 0)
+			return 0;
+		if (match != 0 && blk_refs[match] < UINT16_MAX)
+		{
+			share_blkno(match);
+			if (*ptr != 0)
+				release_blkno(*ptr);
+			*ptr = match;
+			dstats.hits++;
+			return 0;
+		}
+		dstats.misses++;
 	}
-	
-	// Step 2: Get data block of current directory from inode
-	// don't support indirect pointer
-	for (int i = 0; i < inode->size; i++)
+
+	// Step 2: write in place only if nobody else references the block
+	if (*ptr == 0 || blk_refs[*ptr] > 1)
 	{
-		// The directory pointer actually stores the block number of the data block
-		if (inode->direct_ptr[i] != 0)
+		int new_block_num = get_file_blkrun(inode, i, 1);
+		if (new_block_num < 0)
 		{
-			struct dirent *dirent_block = (struct dirent *)malloc(BLOCK_SIZE);
-			if (!dirent_block)
-			{
-				perror("Failed to allocate memory for dirent block");
-				free(inode);
-				free(name);
-				return -1;
-			}
-			if (bio_read(inode->direct_ptr[i], dirent_block) < 0)
-			{
-				perror("Failed to read dirent block from disk");
-				free(inode);
-				free(dirent_block);
-				free(name);
-				return -1;
-			}
-			// Step 3: Read directory's data block and check each directory entry.
-			// If the name matches, then copy directory entry to dirent structure
+			perror("Failed to get an available block for file");
+			return -1;
+		}
+		if (*ptr != 0)
+			release_blkno(*ptr);
+		*ptr = new_block_num;
+	}
+	if (bio_write(*ptr, buf) < 0)
+		return -1;
 
-			for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
-			{
-				if (dirent_block[j].valid == 1)
-				{
-					if (strcmp(dirent_block[j].name, name) == 0)
-					{
-						// printf("find directory entry with name: %s, ino: %d\n", dirent_block[j].name, dirent_block[j].ino);
-						memcpy(dirent, &dirent_block[j], sizeof(struct dirent));
-						free(inode);
-						free(dirent_block);
-						free(name);
-						return 0;
-					}
-				}
-			}
-			free(dirent_block);
+	if (opts.dedup)
+		fp_insert(fp, *ptr);
+	return 0;
+}
+
+// Put back the pointers own_blocks() replaced, freeing the blocks it took
+void own_blocks_undo(struct inode *inode, int first, int last, const int *old)
+{
+	for (int i = first; i <= last; i++)
+	{
+		if (inode->direct_ptr[i] != old[i])
+		{
+			release_blkno(inode->direct_ptr[i]);
+			inode->direct_ptr[i] = old[i];
 		}
 	}
-	// not find
-	free(inode);
-	free(name);
-	return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len)
+// The new blocks hold the data, drop the references to the ones they replaced
+void own_blocks_done(struct inode *inode, int first, int last, const int *old)
 {
-	// // printf("calling dir_add with parameters: dir_inode: %d, f_ino: %d, fname: %s, name_len: %d\n", dir_inode.ino, f_ino, fname, name_len);
+	for (int i = first; i <= last; i++)
+	{
+		if (old[i] != 0 && inode->direct_ptr[i] != old[i])
+			release_blkno(old[i]);
+	}
+}
 
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	for (int i = 0; i < dir_inode.size; i++)
+/*
+ * Make blocks first..last of a file private to it so they can be written in
+ * place. Holes and blocks shared with a snapshot get new blocks, taken as one
+ * physically contiguous run when the bitmap has one. Old contents are not
+ * copied, callers keep what they need of partial blocks first. The pointers
+ * replaced are saved in old[] (indexed by file block) and keep their
+ * reference, the caller ends with own_blocks_done() once the data is written
+ * or own_blocks_undo() if it is not. On failure nothing is changed.
+ */
+int own_blocks(struct inode *inode, int first, int last, int *old)
+{
+	int need = 0, from = -1;
+	for (int i = first; i <= last; i++)
 	{
-		if (dir_inode.direct_ptr[i] != 0)
+		int blkno = inode->direct_ptr[i];
+		old[i] = blkno;
+		if (blkno == 0 || blk_refs[blkno] > 1)
 		{
-			struct dirent *dirent_block = (struct dirent *)malloc(BLOCK_SIZE);
-			if (!dirent_block)
-			{
-				perror("Failed to allocate memory for dirent block");
+			if (from < 0)
+				from = i;
+			need++;
+		}
+	}
+	if (need == 0)
+		return 0;
+
+	int run = get_file_blkrun(inode, from, need);
+	for (int i = first; i <= last; i++)
+	{
+		int *ptr = &inode->direct_ptr[i];
+		if (*ptr != 0 && blk_refs[*ptr] == 1)
+			continue;
+		int new_block_num = run >= 0 ? run++ : get_file_blkrun(inode, i, 1);
+		if (new_block_num < 0)
+		{
+			perror("Failed to get an available block for file");
+			own_blocks_undo(inode, first, i - 1, old);
+			return -1;
+		}
+		*ptr = new_block_num;
+	}
+	return 0;
+}
+
+/*
+ * A run of physically contiguous disk blocks moved with one preadv/pwritev,
+ * each block mapped straight onto the caller's memory
+ */
+struct block_run {
+	int start;						/* first disk block of the run */
+	int count;						/* blocks in the run */
+	struct iovec iov[NUM_DIRECT];
+};
+
+// Move the blocks collected so far, returns 0 if all of them were transferred
+int run_flush(struct block_run *run, int write)
+{
+	if (run->count == 0)
+		return 0;
+	int ret = write ? bio_writev(run->start, run->iov, run->count) : bio_readv(run->start, run->iov, run->count);
+	int expected = run->count * BLOCK_SIZE;
+	run->count = 0;
+	return ret == expected ? 0 : -1;
+}
+
+// Add disk block blkno backed by buf, flushing the run first if blkno does not continue it
+int run_add(struct block_run *run, int blkno, void *buf, int write)
+{
+	if (run->count > 0 && blkno != run->start + run->count && run_flush(run, write) < 0)
+		return -1;
+	if (run->count == 0)
+		run->start = blkno;
+	run->iov[run->count].iov_base = buf;
+	run->iov[run->count].iov_len = BLOCK_SIZE;
+	run->count++;
+	return 0;
+}
+
+// Read a whole cluster into buf (CLUSTER_SIZE bytes), holes read as zeros
+int read_cluster(struct inode *inode, int cluster, char *buf)
+{
+	int first = cluster * CLUSTER_BLKS;
+
+	if (inode->c_len[cluster] == 0)
+	{
+		for (int i = 0; i < CLUSTER_BLKS; i++)
+		{
+			if (inode->direct_ptr[first + i] == 0)
+				memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+			else if (bio_read(inode->direct_ptr[first + i], buf + i * BLOCK_SIZE) < 0)
 				return -1;
+		}
+		return 0;
+	}
+
+	// compressed: gather the stored bytes, then decompress
+	char zbuf[CLUSTER_SIZE] BLOCK_ALIGNED;
+	int clen = inode->c_len[cluster];
+	for (int i = 0; i * BLOCK_SIZE < clen; i++)
+	{
+		if (bio_read(inode->direct_ptr[first + i], zbuf + i * BLOCK_SIZE) < 0)
+			return -1;
+	}
+	int n = lz_decompress(zbuf, clen, buf, CLUSTER_SIZE);
+	if (n < 0)
+	{
+		fprintf(stderr, "corrupt compressed cluster %d of inode %d\n", cluster, inode->ino);
+		return -1;
+	}
+	memset(buf + n, 0, CLUSTER_SIZE - n);
+	return 0;
+}
+
+// Where write_cluster() puts a block of the cluster
+enum { CLUSTER_KEEP, CLUSTER_SHARE, CLUSTER_INPLACE, CLUSTER_NEW };
+
+// Undo write_cluster() for the first n blocks: drop the references it took and
+// point the cluster back at its old blocks
+static void cluster_unwind(struct inode *inode, int first, const int *old, const int *how, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (how[i] == CLUSTER_SHARE || how[i] == CLUSTER_NEW)
+			release_blkno(inode->direct_ptr[first + i]);
+		inode->direct_ptr[first + i] = old[i];
+	}
+}
+
+// Store a whole cluster from buf, nblocks is the number of file blocks it holds
+int write_cluster(struct inode *inode, int cluster, const char *buf, int nblocks)
+{
+	int first = cluster * CLUSTER_BLKS;
+	char zbuf[CLUSTER_SIZE] BLOCK_ALIGNED;
+	const char *src = buf;
+	int clen = 0;
+
+	// Step 1: compress if enabled, keep it only if it saves at least one block
+	if (opts.compress && nblocks > 1)
+	{
+		clen = lz_compress(buf, nblocks * BLOCK_SIZE, zbuf, (nblocks - 1) * BLOCK_SIZE);
+		if (clen > 0)
+		{
+			memset(zbuf + clen, 0, CLUSTER_SIZE - clen);
+			src = zbuf;
+		}
+		else
+			clen = 0;
+	}
+	int need = clen ? (clen + BLOCK_SIZE - 1) / BLOCK_SIZE : nblocks;
+
+	// Step 2: find a home for every block before any is written, so running
+	// out of space leaves the cluster as it was. A block goes to an existing
+	// one with the same contents (dedup, shared right away so no later block
+	// of the cluster overwrites it in place), in place if the cluster owns it
+	// alone, or to a new block. The cluster points at them as they are found
+	// so allocations continue each other.
+	int old[CLUSTER_BLKS], how[CLUSTER_BLKS];
+	uint64_t fps[CLUSTER_BLKS];
+	memcpy(old, &inode->direct_ptr[first], sizeof(old));
+	for (int i = 0; i < need; i++)
+	{
+		int *ptr = &inode->direct_ptr[first + i];
+		if (opts.dedup)
+		{
+			fps[i] = fingerprint(src + i * BLOCK_SIZE);
+			int match = fp_lookup(fps[i], src + i * BLOCK_SIZE);
+			if (match != 0 && match == old[i])
+			{
+				how[i] = CLUSTER_KEEP;
+				continue;
 			}
-			if (bio_read(dir_inode.direct_ptr[i], dirent_block) < 0)
+			if (match != 0 && blk_refs[match] < UINT16_MAX && share_blkno(match) == 0)
 			{
-				perror("Failed to read dirent block from disk");
-				free(dirent_block);
+				how[i] = CLUSTER_SHARE;
+				*ptr = match;
+				continue;
+			}
+		}
+		if (old[i] != 0 && blk_refs[old[i]] == 1)
+			how[i] = CLUSTER_INPLACE;
+		else
+		{
+			int new_block_num = get_file_blkrun(inode, first + i, 1);
+			if (new_block_num < 0)
+			{
+				perror("Failed to get an available block for file");
+				cluster_unwind(inode, first, old, how, i);
 				return -1;
 			}
-			for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+			how[i] = CLUSTER_NEW;
+			*ptr = new_block_num;
+		}
+	}
+
+	// Step 3: write the contents no block holds yet, new blocks before the
+	// ones overwritten in place
+	for (int pass = CLUSTER_NEW; pass >= CLUSTER_INPLACE; pass--)
+	{
+		for (int i = 0; i < need; i++)
+		{
+			if (how[i] == pass && bio_write(inode->direct_ptr[first + i], src + i * BLOCK_SIZE) < 0)
 			{
-				if (dirent_block[j].valid == 0)
-				{
-					// Step 2: Check if fname (directory name) is already used in other entries
-					if (strcmp(dirent_block[j].name, fname) == 0)
-					{
-						perror("Directory name already used in other entries");
-						free(dirent_block);
-						return -1;
-					}
-				}
+				cluster_unwind(inode, first, old, how, need);
+				return -1;
 			}
-			free(dirent_block);
 		}
 	}
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	struct dirent *new_dirent = (struct dirent *)malloc(sizeof(struct dirent));
-	memset(new_dirent, 0, sizeof(struct dirent));
-	if (!new_dirent)
+
+	// Step 4: drop the blocks the cluster no longer uses
+	for (int i = 0; i < CLUSTER_BLKS; i++)
+	{
+		int blkno = inode->direct_ptr[first + i];
+		if (i < need && (how[i] == CLUSTER_KEEP || how[i] == CLUSTER_SHARE))
+			dstats.hits++;
+		else if (i < need && opts.dedup)
+		{
+			fp_insert(fps[i], blkno);
+			dstats.misses++;
+		}
+		if (i >= need)
+			inode->direct_ptr[first + i] = 0;
+		if (old[i] != 0 && old[i] != inode->direct_ptr[first + i])
+			release_blkno(old[i]);
+	}
+	inode->c_len[cluster] = clen;
+
+	// Step 5: account for the achieved ratio
+	if (clen)
+		cstats.clusters_compressed++;
+	else
+		cstats.clusters_raw++;
+	cstats.bytes_in += nblocks * BLOCK_SIZE;
+	cstats.bytes_out += need * BLOCK_SIZE;
+	return 0;
+}
+
+/*
+ * directory operations
+ */
+
+// Bit j is set where slot j of a directory block tail holds fingerprint fp
+static uint32_t dir_fp_match(const struct dir_tail *tail, uint8_t fp)
+{
+#ifdef __SSE2__
+	// two overlapping 16 byte compares cover the slots
+	_Static_assert(DIRENTS_PER_BLOCK > 16 && DIRENTS_PER_BLOCK <= 32, "fingerprints do not fit two vectors");
+	__m128i key = _mm_set1_epi8((char)fp);
+	uint32_t lo = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)tail->fp), key));
+	uint32_t hi = _mm_movemask_epi8(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(tail->fp + DIRENTS_PER_BLOCK - 16)), key));
+	return lo | hi << (DIRENTS_PER_BLOCK - 16);
+#else
+	uint32_t hits = 0;
+	for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+		hits |= (uint32_t)(tail->fp[j] == fp) << j;
+	return hits;
+#endif
+}
+
+// Slot of the valid entry named fname in a directory block, -1 if there is none
+static int dir_block_find(struct dirent *dirent_block, const char *fname, size_t name_len)
+{
+	struct dir_tail *tail = dir_tail(dirent_block);
+	uint32_t hits = (1u << DIRENTS_PER_BLOCK) - 1;
+
+	// an indexed block only needs the names whose fingerprint matches
+	if (tail->magic == DIR_TAIL_MAGIC)
+		hits = dir_fp_match(tail, name_fp(fname, name_len));
+	for (; hits; hits &= hits - 1)
+	{
+		int j = __builtin_ctz(hits);
+		if (dirent_block[j].valid == 1 && strncmp(dirent_block[j].name, fname, name_len) == 0 &&
+			dirent_block[j].name[name_len] == '\0')
+			return j;
+	}
+	return -1;
+}
+
+// First free slot of a directory block, -1 if it is full
+static int dir_block_free(struct dirent *dirent_block)
+{
+	struct dir_tail *tail = dir_tail(dirent_block);
+
+	if (tail->magic == DIR_TAIL_MAGIC)
+	{
+		uint32_t free = dir_fp_match(tail, 0);
+		return free ? __builtin_ctz(free) : -1;
+	}
+	for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+		if (dirent_block[j].valid != 1)
+			return j;
+	return -1;
+}
+
+static int dir_scan(uint32_t i_start_blk, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent)
+{
+	// printf("calling dir_find with parameters: ino: %d, fname: %s, name_len: %d\n", ino, fname, name_len);
+
+	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode inode;
+	int result = readi_at(i_start_blk, ino, &inode);
+	if (result < 0)
 	{
-		perror("Failed to allocate memory for new dirent");
+		perror("Failed to read inode");
 		return -1;
 	}
-	new_dirent->ino = f_ino;
-	new_dirent->valid = 1;
-	memcpy(new_dirent->name, fname, name_len);
-	// find a free entry (valid == 0)
-	for (int i = 0; i < dir_inode.size; i++)
+	if (name_len >= sizeof(dirent->name))
+		return -1;
+
+	// Step 2: Get data block of current directory from inode
+	// don't support indirect pointer
+	struct dirent *dirent_block = (struct dirent *)scratch_get();
+	if (!dirent_block)
 	{
-		struct dirent *dirent_block = (struct dirent *)malloc(BLOCK_SIZE);
-		if (!dirent_block)
+		perror("Failed to allocate memory for dirent block");
+		return -1;
+	}
+	for (int i = 0; i < inode.size; i++)
+	{
+		// The directory pointer actually stores the block number of the data block
+		if (inode.direct_ptr[i] == 0)
+			continue;
+		if (bio_read(inode.direct_ptr[i], dirent_block) < 0)
 		{
-			perror("Failed to allocate memory for dirent block");
+			perror("Failed to read dirent block from disk");
+			scratch_put(dirent_block);
 			return -1;
 		}
+		// directory blocks are read on every lookup, keep them on the fast tier
+		dev_tier_hint(inode.direct_ptr[i]);
+		// Step 3: Read directory's data block and check each directory entry.
+		// If the name matches, then copy directory entry to dirent structure
+		int j = dir_block_find(dirent_block, fname, name_len);
+		if (j >= 0)
+		{
+			// printf("find directory entry with name: %s, ino: %d\n", dirent_block[j].name, dirent_block[j].ino);
+			memcpy(dirent, &dirent_block[j], sizeof(struct dirent));
+			scratch_put(dirent_block);
+			return 0;
+		}
+	}
+	// not find
+	scratch_put(dirent_block);
+	return -1;
+}
+
+// Look up fname in directory ino of an inode table
+int dir_find_at(uint32_t i_start_blk, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent)
+{
+	TRACE3(dir_find_start, ino, fname, name_len);
+	int ret = dir_scan(i_start_blk, ino, fname, name_len, dirent);
+	TRACE4(dir_find_done, ino, fname, name_len, ret < 0 ? ret : dirent->ino);
+	return ret;
+}
+
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent)
+{
+	return dir_find_at(sb.i_start_blk, ino, fname, name_len, dirent);
+}
+
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len)
+{
+	if (name_len > DIRENT_NAME_MAX)
+		return -ENAMETOOLONG;
+
+	// // printf("calling dir_add with parameters: dir_inode: %d, f_ino: %d, fname: %s, name_len: %d\n", dir_inode.ino, f_ino, fname, name_len);
+	struct dirent *dirent_block = (struct dirent *)scratch_get();
+	if (!dirent_block)
+	{
+		perror("Failed to allocate memory for dirent block");
+		return -ENOMEM;
+	}
+
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode,
+	// remembering the first free entry on the way
+	int free_blk = -1, free_slot = -1;
+	for (int i = 0; i < dir_inode.size; i++)
+	{
+		if (dir_inode.direct_ptr[i] == 0)
+			continue;
 		if (bio_read(dir_inode.direct_ptr[i], dirent_block) < 0)
 		{
 			perror("Failed to read dirent block from disk");
-			free(dirent_block);
-			return -1;
+			scratch_put(dirent_block);
+			return -EIO;
 		}
-		for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+		// Step 2: Check if fname (directory name) is already used in other entries
+		if (dir_block_find(dirent_block, fname, name_len) >= 0)
 		{
-			if (dirent_block[j].valid == 0)
-			{
-				memcpy(&dirent_block[j], new_dirent, sizeof(struct dirent));
-				if (bio_write(dir_inode.direct_ptr[i], dirent_block) < 0)
-				{
-					perror("Failed to write dirent block to disk");
-					free(dirent_block);
-					free(new_dirent);
-					return -1;
-				}
-				free(dirent_block);
-				free(new_dirent);
-				return 0;
-			}
+			scratch_put(dirent_block);
+			return -EEXIST;
+		}
+		if (free_blk < 0 && (free_slot = dir_block_free(dirent_block)) >= 0)
+			free_blk = i;
+	}
+
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	struct dirent new_dirent;
+	memset(&new_dirent, 0, sizeof(struct dirent));
+	new_dirent.ino = f_ino;
+	new_dirent.valid = 1;
+	memcpy(new_dirent.name, fname, name_len);
+	new_dirent.len = name_len;
+
+	if (free_blk >= 0)
+	{
+		if (bio_read(dir_inode.direct_ptr[free_blk], dirent_block) < 0)
+		{
+			perror("Failed to read dirent block from disk");
+			scratch_put(dirent_block);
+			return -EIO;
+		}
+		memcpy(&dirent_block[free_slot], &new_dirent, sizeof(struct dirent));
+		dir_tail_build(dirent_block);
+		// the block may be shared with a snapshot, store_block copies it then
+		if (store_block(&dir_inode, free_blk, (char *)dirent_block) < 0)
+		{
+			perror("Failed to write dirent block to disk");
+			scratch_put(dirent_block);
+			return -EIO;
 		}
+		inode_touch(&dir_inode);
+		writei_lazy(dir_inode.ino, &dir_inode);
+		scratch_put(dirent_block);
+		return 0;
 	}
+
 	// cannot find a free entry
-	if (dir_inode.size == 16)
+	if (dir_inode.size == NUM_DIRECT)
 	{
 		perror("cannot find a free entry");
-		free(new_dirent);
-		return -1;
+		scratch_put(dirent_block);
+		return -ENOSPC;
 	}
-	// Allocate a new data block for this directory if it does not exist
-	int new_block_num = get_avail_blkno();
+	// Allocate a new data block for this directory, holding just the new entry
+	int new_block_num = get_avail_blkrun_near(1, block_goal(&dir_inode, dir_inode.size));
 	if (new_block_num < 0)
 	{
 		perror("Failed to get an available block for directory");
-		free(new_dirent);
-		return -1;
+		scratch_put(dirent_block);
+		return -ENOSPC;
 	}
-	// allocate a new data block
-	struct dirent *new_block = (struct dirent *)malloc(BLOCK_SIZE);
-	// zero out the new data block
-	memset(new_block, 0, BLOCK_SIZE);
-	// write the new directory entry to the new data block
-	memcpy(new_block, new_dirent, sizeof(struct dirent));
-	// write the new data block to disk
-	if (bio_write(new_block_num, new_block) < 0)
+	memset(dirent_block, 0, BLOCK_SIZE);
+	memcpy(dirent_block, &new_dirent, sizeof(struct dirent));
+	dir_tail_build(dirent_block);
+	if (bio_write(new_block_num, dirent_block) < 0)
 	{
 		perror("Failed to write new data block to disk");
-		free(new_block);
-		free(new_dirent);
-		return -1;
+		release_blkno(new_block_num);
+		scratch_put(dirent_block);
+		return -EIO;
 	}
+	scratch_put(dirent_block);
 	// // printf("DIR_ADD: adding new block, new block number: %d\n", new_block_num);
-	// Update directory inode
+
+	// Update directory inode and write it to disk
 	dir_inode.size += 1;
+	dir_inode.bytes = dir_inode.size * BLOCK_SIZE;
 	dir_inode.direct_ptr[dir_inode.size - 1] = new_block_num;
-	// Update bitmap
-	bitmap_t data_bitmap = (bitmap_t)malloc(BLOCK_SIZE);
-	if (!data_bitmap)
-	{
-		perror("Failed to allocate memory for data block bitmap");
-		free(new_block);
-		free(new_dirent);
-		return -1;
-	}
-	if (bio_read(sb.d_bitmap_blk, data_bitmap) < 0)
-	{
-		perror("Failed to read data block bitmap from disk");
-		free(new_block);
-		free(new_dirent);
-		free(data_bitmap);
-		return -1;
-	}
-	set_bitmap(data_bitmap, new_block_num);
-	// Write directory inode to disk
+	inode_touch(&dir_inode);
 	if (writei(dir_inode.ino, &dir_inode) < 0)
 	{
 		perror("Failed to write directory inode to disk");
-		free(new_block);
-		free(new_dirent);
-		free(data_bitmap);
-		return -1;
+		return -EIO;
 	}
-	free(new_dirent);
-	free(new_block);
-	free(data_bitmap);
 	return 0;
 }
 
@@ -409,6 +1358,49 @@ int dir_remove(struct inode dir_inode, const char *fname, size_t name_len)
 	return 0;
 }
 
+/*
+ * Walk the entries of a directory in on-disk order, starting after cookie
+ * offset (0 starts at the first entry). fn gets each valid entry and the
+ * cookie of the entry after it, a non-zero return stops the walk.
+ * Cookies encode (block, slot) so a caller can resume where it left off.
+ */
+int dir_iterate(struct inode *dir_inode, off_t offset, dir_iter_t fn, void *ctx)
+{
+	int blk = offset / DIRENTS_PER_BLOCK;
+	int slot = offset % DIRENTS_PER_BLOCK;
+	struct dirent *dirent_block = (struct dirent *)scratch_get();
+	if (!dirent_block)
+	{
+		perror("Failed to allocate memory for dirent block");
+		return -1;
+	}
+
+	for (; blk < dir_inode->size; blk++, slot = 0)
+	{
+		if (dir_inode->direct_ptr[blk] == 0)
+			continue;
+		if (bio_read(dir_inode->direct_ptr[blk], dirent_block) < 0)
+		{
+			perror("Failed to read dirent block from disk");
+			scratch_put(dirent_block);
+			return -1;
+		}
+		dev_tier_hint(dir_inode->direct_ptr[blk]);
+		for (; slot < DIRENTS_PER_BLOCK; slot++)
+		{
+			if (dirent_block[slot].valid != 1)
+				continue;
+			if (fn(ctx, &dirent_block[slot], (off_t)blk * DIRENTS_PER_BLOCK + slot + 1))
+			{
+				scratch_put(dirent_block);
+				return 0;
+			}
+		}
+	}
+	scratch_put(dirent_block);
+	return 0;
+}
+
 /*
  * namei operation
  * This is the actual namei function which follows a pathname until a terminal point is found.
@@ -416,7 +1408,7 @@ int dir_remove(struct inode dir_inode, const char *fname, size_t name_len)
  * then call dir_find() to lookup each component in the path,
  * and finally read the inode of the terminal point to "struct inode *inode".
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
+int get_node_by_path_at(uint32_t i_start_blk, const char *path, uint16_t ino, struct inode *inode)
 {
 	// printf("calling get_node_by_path with parameters: path: %s, ino: %d\n", path, ino);
 
@@ -426,7 +1418,7 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
 	if (strcmp(path, "/") == 0 || strcmp(path, "") == 0)
 	{
 
-		readi(ino, inode);
+		readi_at(i_start_blk, ino, inode);
 		// printf("find directory inode with id: %d, type: %d expected type: %d, size: %d\n", ino, inode->type, S_IFDIR, inode->size);
 		// // printf("Successfully find directory inode with id: %d\n", inode->ino);
 		return 0;
@@ -437,29 +1429,18 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
 		path++;
 	}
 	// printf("path: %s\n", path);
-	size_t name_len = 0;
-	for (int i = 0; i < strlen(path); i++)
-	{
-		if (path[i] == '/')
-		{
-			break;
-		}
-		else
-		{
-			name_len++;
-		}
-	}
+	size_t name_len = strcspn(path, "/");
 
 	// check end condition, if inode is a file, return
-	readi(ino, inode);
+	readi_at(i_start_blk, ino, inode);
 	// if is file
 	if (inode-> valid && inode->type == S_IFREG)
 	{
 		// printf("find file inode: %d, name_len: %d, name: %s type: %d expected type: %d\n", ino, name_len, path, inode->type, S_IFREG);
 		return 0;
 	}
-	struct dirent *dirent = (struct dirent *)malloc(sizeof(struct dirent));
-	int success = dir_find(ino, path, name_len, dirent);
+	struct dirent dirent;
+	int success = dir_find_at(i_start_blk, ino, path, name_len, &dirent);
 	// printf("dir find result %d\n", success);
 
 	if (success < 0)
@@ -469,15 +1450,15 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
 	}
 
 	// if is directory
-	if(name_len == strlen(path)){
+	if(path[name_len] == '\0'){
 		// end condition
-		readi(dirent->ino, inode);
-		// printf("find directory inode with id: %d, type: %d expected type: %d, size: %d\n", dirent->ino, inode->type, S_IFDIR, inode->size);
+		readi_at(i_start_blk, dirent.ino, inode);
+		// printf("find directory inode with id: %d, type: %d expected type: %d, size: %d\n", dirent.ino, inode->type, S_IFDIR, inode->size);
 		return 0;
 	}
 	// recursive implementation
 	// + 1 to skip the '/'
-	success = get_node_by_path(path + name_len + 1, dirent->ino, inode);
+	success = get_node_by_path_at(i_start_blk, path + name_len + 1, dirent.ino, inode);
 	if (success < 0)
 	{
 		// not found
@@ -486,63 +1467,648 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
 	return 0;
 }
 
-/*
- * Make file system
- */
-int rufs_mkfs()
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode)
 {
+	TRACE2(lookup_start, path, ino);
+	int ret = get_node_by_path_at(sb.i_start_blk, path, ino, inode);
+	TRACE3(lookup_done, path, ino, ret < 0 ? ret : inode->ino);
+	return ret;
+}
 
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path); // Initialize the disk file using dev_init(), using the diskfile_path as the file path
-
-	// write superblock information
-	sb.magic_num = MAGIC_NUM;
-	sb.max_dnum = MAX_DNUM;
-	sb.max_inum = MAX_INUM;
-
-	sb.i_bitmap_blk = 1;
-	sb.d_bitmap_blk = 2;
-
-	int total_inode_size = (MAX_INUM * sizeof(struct inode) + BLOCK_SIZE - 1); // Calculate the total size required for all inodes
-	int number_of_inode_blocks = total_inode_size / BLOCK_SIZE;				   // Calculate the number of blocks required to store all inodes
-	sb.i_start_blk = sb.d_bitmap_blk + 1;
-	sb.d_start_blk = sb.i_start_blk + number_of_inode_blocks;
+/*
+ * snapshot operations
+ *
+ * A snapshot is a frozen copy of the inode table. Taking one copies the inode
+ * table and adds a reference to every data block the inodes point at, so it
+ * costs metadata I/O only. Live writes go through store_block(), which copies
+ * any block that is still shared with a snapshot before modifying it.
+ */
 
-	// write super block to disk
-	char temp_buffer[BLOCK_SIZE];
-	memset(temp_buffer, 0, BLOCK_SIZE);
-	memcpy(temp_buffer, &sb, sizeof(sb));
-	bio_write(0, temp_buffer);
+// Add delta to the reference count of every data block used by an inode table
+int adjust_table_refs(uint32_t i_start_blk, int delta)
+{
+	char dirty[REF_BLOCKS];
+	memset(dirty, 0, sizeof(dirty));
 
-	// initialize inode bitmap (to zero using calloc)
-	bitmap_t inode_bitmap = (bitmap_t)calloc(1, BLOCK_SIZE);
-	if (!inode_bitmap)
+	struct dinode *inode_block = (struct dinode *)scratch_get();
+	uint32_t *counts = (uint32_t *)calloc(MAX_DNUM, sizeof(uint32_t));
+	if (!inode_block || !counts)
 	{
-		perror("Failed to allocate inode bitmap");
-		return -1;
+		perror("Failed to allocate memory for reference counting");
+		scratch_put(inode_block);
+		free(counts);
+		return -ENOMEM;
 	}
-	bio_write(sb.i_bitmap_blk, inode_bitmap); // Write the initialized inode bitmap to the disk
 
-	// initialize data block bitmap
-	bitmap_t data_bitmap = (bitmap_t)calloc(1, BLOCK_SIZE);
+	// Step 1: count the table's references to each data block
+	for (int b = 0; b < INODE_BLOCKS; b++)
+	{
+		if (bio_read(i_start_blk + b, inode_block) < 0)
+		{
+			scratch_put(inode_block);
+			free(counts);
+			return -EIO;
+		}
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			if (inode_block[j].version == 0)
+				continue;
+			for (int k = 0; k < NUM_DIRECT; k++)
+			{
+				int blkno = inode_block[j].direct_ptr[k];
+				if (blkno >= sb.d_start_blk && blkno < MAX_DNUM)
+					counts[blkno]++;
+			}
+		}
+	}
+	scratch_put(inode_block);
+
+	// Step 2: a block whose count would overflow fails the whole table before anything changes
+	if (delta > 0)
+	{
+		for (int blkno = sb.d_start_blk; blkno < MAX_DNUM; blkno++)
+		{
+			if (blk_refs[blkno] + (uint64_t)counts[blkno] * delta > UINT16_MAX)
+			{
+				fprintf(stderr, "data block %d would get more than %d references\n", blkno, UINT16_MAX);
+				free(counts);
+				return -EMLINK;
+			}
+		}
+	}
+
+	// Step 3: update the in-memory counts, freeing blocks that drop to zero
+	for (int blkno = sb.d_start_blk; blkno < MAX_DNUM; blkno++)
+	{
+		if (counts[blkno] == 0)
+			continue;
+		int refs = blk_refs[blkno] + (int)counts[blkno] * delta;
+		blk_refs[blkno] = refs < 0 ? 0 : refs;
+		dirty[blkno / REFS_PER_BLOCK] = 1;
+		if (blk_refs[blkno] == 0)
+			free_blkno(blkno);
+	}
+	free(counts);
+
+	// Step 4: write back each touched reference count block once
+	for (int i = 0; i < REF_BLOCKS; i++)
+	{
+		if (dirty[i])
+			bio_write(sb.r_start_blk + i, (char *)blk_refs + i * BLOCK_SIZE);
+	}
+	write_data_bitmap();
+	return 0;
+}
+
+// Give back the inode table run of a snapshot that could not be taken
+static void drop_snapshot_table(int start)
+{
+	for (int b = 0; b < INODE_BLOCKS; b++)
+		release_blkno(start + b);
+}
+
+// Take a snapshot of the whole file system, returns its id
+int take_snapshot()
+{
+	struct snapshot *slot = NULL;
+	uint32_t id = 1;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snaps[i].id == 0 && !slot)
+			slot = &snaps[i];
+		if (snaps[i].id >= id)
+			id = snaps[i].id + 1;
+	}
+	if (!slot)
+		return -ENOSPC;
+
+	// Step 1: copy the inode table, with the times still in memory
+	lazy_flush_all();
+	int start = get_avail_blkrun(INODE_BLOCKS);
+	if (start < 0)
+		return -ENOSPC;
+	char temp_block[BLOCK_SIZE] BLOCK_ALIGNED;
+	for (int b = 0; b < INODE_BLOCKS; b++)
+	{
+		if (bio_read(sb.i_start_blk + b, temp_block) < 0 || bio_write(start + b, temp_block) < 0)
+		{
+			drop_snapshot_table(start);
+			return -EIO;
+		}
+	}
+
+	// Step 2: the copy now references every data block too
+	int ret = adjust_table_refs(start, 1);
+	if (ret < 0)
+	{
+		drop_snapshot_table(start);
+		return ret;
+	}
+
+	// Step 3: record it in the snapshot table
+	slot->id = id;
+	slot->ctime = time(NULL);
+	slot->i_start_blk = start;
+	if (bio_write(sb.s_table_blk, snaps) < 0)
+	{
+		memset(slot, 0, sizeof(struct snapshot));
+		adjust_table_refs(start, -1);
+		drop_snapshot_table(start);
+		return -EIO;
+	}
+	last_snapshot = id;
+	return id;
+}
+
+int delete_snapshot(uint32_t id)
+{
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snaps[i].id != id || id == 0)
+			continue;
+
+		// drop the snapshot's data block references, then its inode table
+		int ret = adjust_table_refs(snaps[i].i_start_blk, -1);
+		if (ret < 0)
+			return ret;
+		drop_snapshot_table(snaps[i].i_start_blk);
+		memset(&snaps[i], 0, sizeof(struct snapshot));
+		if (bio_write(sb.s_table_blk, snaps) < 0)
+			return -EIO;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Split a path under SNAP_DIR. Returns 0 if it is not in SNAP_DIR, 1 if it
+ * is SNAP_DIR itself, 2 if it is inside a snapshot (*snap and *rest are set),
+ * -ENOENT if the snapshot does not exist.
+ */
+int snapshot_path(const char *path, struct snapshot **snap, const char **rest)
+{
+	size_t len = strlen(SNAP_DIR);
+	if (strncmp(path, SNAP_DIR, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+		return 0;
+	path += len;
+	if (strcmp(path, "") == 0 || strcmp(path, "/") == 0)
+		return 1;
+
+	char *end;
+	unsigned long id = strtoul(path + 1, &end, 10);
+	if (end == path + 1 || (*end != '\0' && *end != '/'))
+		return -ENOENT;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snaps[i].id != 0 && snaps[i].id == id)
+		{
+			if (snap)
+				*snap = &snaps[i];
+			if (rest)
+				*rest = end;
+			return 2;
+		}
+	}
+	return -ENOENT;
+}
+
+/*
+ * Resolve a live or snapshot path, returns 1 for snapshot (read-only) inodes.
+ * *i_start_blk (if not NULL) is set to the inode table the inode lives in.
+ */
+int resolve_path_at(const char *path, struct inode *inode, uint32_t *i_start_blk)
+{
+	struct snapshot *snap;
+	const char *rest;
+
+	switch (snapshot_path(path, &snap, &rest))
+	{
+	case 0:
+		if (i_start_blk)
+			*i_start_blk = sb.i_start_blk;
+		return get_node_by_path(path, ROOT_INO, inode);
+	case 2:
+		if (get_node_by_path_at(snap->i_start_blk, rest, ROOT_INO, inode) < 0)
+			return -ENOENT;
+		if (i_start_blk)
+			*i_start_blk = snap->i_start_blk;
+		return 1;
+	default:
+		return -ENOENT;
+	}
+}
+
+int resolve_path(const char *path, struct inode *inode)
+{
+	return resolve_path_at(path, inode, NULL);
+}
+
+/*
+ * Online defragmentation
+ * A file's data blocks are fragmented when they form more than one physically
+ * contiguous run. Defragmenting copies them into a single free run, switches
+ * the inode over with one inode write and only then frees the old blocks, so
+ * an interruption leaks blocks at worst. Blocks shared with another file or a
+ * snapshot are left where they are.
+ */
+struct frag_stats {
+	int files;						/* files and directories with data */
+	int fragmented;					/* of those, stored in more than one run */
+	int extents;					/* runs over all of them */
+};
+
+// Number of physically contiguous runs holding a file's data
+static int inode_extents(const struct inode *inode)
+{
+	int extents = 0, prev = 0;
+	for (int i = 0; i < NUM_DIRECT; i++)
+	{
+		int blkno = inode->direct_ptr[i];
+		if (blkno == 0)
+			continue;
+		if (blkno != prev + 1)
+			extents++;
+		prev = blkno;
+	}
+	return extents;
+}
+
+static void frag_scan(struct frag_stats *fs)
+{
+	struct inode_cache cache;
+	struct inode inode;
+
+	memset(fs, 0, sizeof(struct frag_stats));
+	if (inode_cache_init(&cache, sb.i_start_blk) < 0)
+		return;
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		if (readi_cached(&cache, ino, &inode) < 0 || !inode.valid)
+			continue;
+		int extents = inode_extents(&inode);
+		if (extents == 0)
+			continue;
+		fs->files++;
+		fs->extents += extents;
+		if (extents > 1)
+			fs->fragmented++;
+	}
+	inode_cache_release(&cache);
+}
+
+// Move a file's data into one contiguous run, returns blocks moved or -errno
+static int defrag_inode(struct inode *inode)
+{
+	char *buf[NUM_DIRECT];
+	uint64_t fps[NUM_DIRECT];
+	int count = 0;
+
+	// Step 1: only files whose blocks are all private to them
+	for (int i = 0; i < NUM_DIRECT; i++)
+	{
+		if (inode->direct_ptr[i] != 0 && blk_refs[inode->direct_ptr[i]] > 1)
+			return 0;
+		if (inode->direct_ptr[i] != 0)
+			count++;
+	}
+	if (inode_extents(inode) <= 1)
+		return 0;
+	int start = get_avail_blkrun(count);
+	if (start < 0)
+		return -ENOSPC;
+
+	// Step 2: copy the data, reading each old run and writing the new one with one call each
+	struct block_run run = {0};
+	int ret = 0, n = 0;
+	for (int i = 0; i < NUM_DIRECT && ret == 0; i++)
+	{
+		if (inode->direct_ptr[i] == 0)
+			continue;
+		buf[n] = scratch_get();
+		if (!buf[n] || run_add(&run, inode->direct_ptr[i], buf[n], 0) < 0)
+			ret = -EIO;
+		n++;
+	}
+	if (ret == 0 && run_flush(&run, 0) < 0)
+		ret = -EIO;
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		// the dedup index has to follow the blocks it knows
+		if (opts.dedup)
+			fps[i] = fingerprint(buf[i]);
+		if (run_add(&run, start + i, buf[i], 1) < 0)
+			ret = -EIO;
+	}
+	if (ret == 0 && run_flush(&run, 1) < 0)
+		ret = -EIO;
+	for (int i = 0; i < n; i++)
+		scratch_put(buf[i]);
+	if (ret < 0)
+	{
+		for (int i = 0; i < count; i++)
+			release_blkno(start + i);
+		return ret;
+	}
+
+	// Step 3: point the inode at the copy, then let the old blocks go
+	int old[NUM_DIRECT];
+	memcpy(old, inode->direct_ptr, sizeof(old));
+	for (int i = 0, next = start; i < NUM_DIRECT; i++)
+	{
+		if (inode->direct_ptr[i] != 0)
+			inode->direct_ptr[i] = next++;
+	}
+	if (writei(inode->ino, inode) < 0)
+	{
+		memcpy(inode->direct_ptr, old, sizeof(old));
+		for (int i = 0; i < count; i++)
+			release_blkno(start + i);
+		return -EIO;
+	}
+	for (int i = 0, moved = 0; i < NUM_DIRECT; i++)
+	{
+		if (old[i] == 0)
+			continue;
+		release_blkno(old[i]);
+		if (opts.dedup)
+			fp_move(fps[moved], old[i], inode->direct_ptr[i]);
+		moved++;
+	}
+	return count;
+}
+
+// Outcome of the last defrag run, reported through the control file
+struct defrag_stats {
+	int runs;						/* defrag runs since mount */
+	int files;						/* files moved into one run */
+	int moved;						/* blocks they hold */
+	int shared;						/* files left as they are, blocks shared */
+	int nospace;					/* files left as they are, no free run for them */
+	int failed;						/* files whose move failed otherwise */
+	struct frag_stats before, after;
+};
+static struct defrag_stats last_defrag;
+
+// Defragment every live file, -ENOSPC if none could be moved for want of a free run
+int defrag()
+{
+	struct inode inode;
+	int runs = last_defrag.runs;
+
+	memset(&last_defrag, 0, sizeof(last_defrag));
+	last_defrag.runs = runs + 1;
+	frag_scan(&last_defrag.before);
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		if (readi(ino, &inode) < 0 || !inode.valid || inode_extents(&inode) <= 1)
+			continue;
+		int ret = defrag_inode(&inode);
+		if (ret > 0)
+		{
+			last_defrag.files++;
+			last_defrag.moved += ret;
+		}
+		else if (ret == 0)
+			last_defrag.shared++;
+		else if (ret == -ENOSPC)
+			last_defrag.nospace++;
+		else
+			last_defrag.failed++;
+	}
+	frag_scan(&last_defrag.after);
+
+	if (last_defrag.files == 0 && last_defrag.nospace > 0)
+		return -ENOSPC;
+	if (last_defrag.files == 0 && last_defrag.failed > 0)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Online resize
+ * Blocks between the volume size and max_dnum are free in the bitmap but out
+ * of the allocator's range, so growing only extends the backing files,
+ * rebuilds the free extent index over the new size and records it in the
+ * superblock. Shrinking moves blocks and is left to the offline rufs_resize.
+ */
+static int resized_from;	/* size before the last online resize, 0 if none */
+
+static int resize(long long nblocks)
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	if (nblocks < sb_nblocks(&sb))
+		return -EINVAL;
+	if (nblocks > sb.max_dnum)
+		return -EFBIG;
+	if (nblocks == sb_nblocks(&sb))
+		return 0;
+
+	// Step 1: room in the backing files first, a crash before the superblock leaves them long
+	if (dev_resize(nblocks) < 0)
+		return -EIO;
+
+	// Step 2: the new blocks become allocatable
+	if (ext_init(d_bitmap, nblocks) < 0)
+	{
+		perror("Failed to rebuild free extent index");
+		ext_init(d_bitmap, sb_nblocks(&sb));
+		return -ENOMEM;
+	}
+
+	// Step 3: superblock records the new size
+	int old_nblocks = sb_nblocks(&sb);
+	sb.s_nblocks = nblocks;
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &sb, sizeof(sb));
+	if (bio_write(0, block) <= 0 || dev_sync() < 0)
+		return -EIO;
+	resized_from = old_nblocks;
+	return 0;
+}
+
+/*
+ * control file
+ * Reading CTL_PATH reports snapshots and data statistics, writing it runs a
+ * command: "snapshot", "delete <id>", "defrag", "resize <size>" or
+ * "checkpoint" (write the times kept in memory and sync, in RAM mode write
+ * the image back now rather than at the next interval). A resize beyond
+ * max_dnum fails with EFBIG, the status reports that limit.
+ */
+int ctl_status(char *buf, size_t size)
+{
+	int len = 0;
+
+	len += snprintf(buf + len, size - len, "snapshots:");
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snaps[i].id != 0)
+			len += snprintf(buf + len, size - len, " %u", snaps[i].id);
+	}
+	if (last_snapshot)
+		len += snprintf(buf + len, size - len, ", last taken %u", last_snapshot);
+	len += snprintf(buf + len, size - len, "\n");
+	len += snprintf(buf + len, size - len, "compression: %llu clusters compressed, %llu raw, %llu -> %llu bytes\n",
+					(unsigned long long)cstats.clusters_compressed, (unsigned long long)cstats.clusters_raw,
+					(unsigned long long)cstats.bytes_in, (unsigned long long)cstats.bytes_out);
+	len += snprintf(buf + len, size - len, "dedup: %llu hits, %llu misses\n",
+					(unsigned long long)dstats.hits, (unsigned long long)dstats.misses);
+	struct frag_stats fs;
+	frag_scan(&fs);
+	len += snprintf(buf + len, size - len, "fragmentation: %d of %d files fragmented, %d extents\n",
+					fs.fragmented, fs.files, fs.extents);
+	if (last_defrag.runs)
+		len += snprintf(buf + len, size - len,
+						"defrag: last run moved %d blocks of %d files, left %d shared, %d without a free run, "
+						"%d failed; %d of %d files fragmented in %d extents before, %d in %d after\n",
+						last_defrag.moved, last_defrag.files, last_defrag.shared, last_defrag.nospace,
+						last_defrag.failed, last_defrag.before.fragmented, last_defrag.before.files,
+						last_defrag.before.extents, last_defrag.after.fragmented, last_defrag.after.extents);
+	len += snprintf(buf + len, size - len, "free space: %d blocks, largest run %d\n",
+					ext_free_blocks(), ext_largest());
+	len += snprintf(buf + len, size - len, "size: %d blocks, online resize limit %d blocks (%d MiB)", sb_nblocks(&sb),
+					sb.max_dnum, (int)((long long)sb.max_dnum * BLOCK_SIZE >> 20));
+	if (resized_from)
+		len += snprintf(buf + len, size - len, ", resized from %d", resized_from);
+	len += snprintf(buf + len, size - len, "\n");
+	struct ram_stats rs;
+	if (dev_ram_stats(&rs) == 0)
+		len += snprintf(buf + len, size - len, "ram: %llu checkpoints, %llu blocks written, last took %ld ms, %d blocks dirty\n",
+						rs.checkpoints, rs.blocks, rs.last_ms, rs.dirty);
+	len += snprintf(buf + len, size - len, "lazy times: %d inodes, written within %d s\n", lazy_pending,
+					lazy_expiry());
+	struct cbt_stats cs;
+	if (dev_cbt_stats(&cs) == 0)
+		len += snprintf(buf + len, size - len, "changed blocks: generation %u, known since %u, %d blocks changed since\n",
+						cs.generation, cs.base, cs.changed);
+	struct tier_stats ts;
+	if (dev_tier_stats(&ts) == 0)
+		len += snprintf(buf + len, size - len, "tiering: %d of %d slots used, %llu fast reads, %llu slow, %llu promoted, %llu demoted\n",
+						ts.used, ts.slots, ts.fast_reads, ts.slow_reads, ts.promoted, ts.demoted);
+	return len;
+}
+
+int ctl_command(const char *buffer, size_t size)
+{
+	char cmd[64];
+	unsigned int id;
+
+	if (size >= sizeof(cmd))
+		return -EINVAL;
+	memcpy(cmd, buffer, size);
+	cmd[size] = '\0';
+
+	if (strcmp(cmd, "snapshot") == 0 || strcmp(cmd, "snapshot\n") == 0)
+	{
+		int ret = take_snapshot();
+		return ret < 0 ? ret : 0;
+	}
+	if (sscanf(cmd, "delete %u", &id) == 1)
+		return delete_snapshot(id);
+	if (strcmp(cmd, "defrag") == 0 || strcmp(cmd, "defrag\n") == 0)
+		return defrag();
+	if (strcmp(cmd, "checkpoint") == 0 || strcmp(cmd, "checkpoint\n") == 0)
+	{
+		lazy_flush_all();
+		return dev_sync() < 0 ? -EIO : 0;
+	}
+	if (strncmp(cmd, "resize ", 7) == 0)
+	{
+		long long nblocks = parse_size(cmd + 7);
+		return nblocks < 0 ? -EINVAL : resize(nblocks);
+	}
+	return -EINVAL;
+}
+
+/*
+ * Make file system
+ */
+int rufs_mkfs()
+{
+
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile_path); // Initialize the disk file using dev_init(), using the diskfile_path as the file path
+
+	// write superblock information
+	sb_layout(&sb);
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	sb.s_ndevs = ndevs;
+	sb.s_stripe_unit = stripe_unit;
+	// a new image starts at DISK_SIZE and may grow online up to max_dnum
+	sb.s_nblocks = DISK_SIZE / BLOCK_SIZE < sb.max_dnum ? DISK_SIZE / BLOCK_SIZE : sb.max_dnum;
+	if (opts.size)
+	{
+		long long nblocks = parse_size(opts.size);
+		if (nblocks <= sb.d_start_blk || nblocks > sb.max_dnum)
+		{
+			fprintf(stderr, "size=%s: an image holds %d to %d blocks of %d bytes\n", opts.size,
+					sb.d_start_blk + 1, sb.max_dnum, BLOCK_SIZE);
+			return -1;
+		}
+		sb.s_nblocks = nblocks;
+	}
+	if (dev_resize(sb.s_nblocks) < 0)
+		return -1;
+	int number_of_inode_blocks = INODE_BLOCKS; // Calculate the number of blocks required to store all inodes
+
+	// write super block to disk
+	char temp_buffer[BLOCK_SIZE] BLOCK_ALIGNED;
+	memset(temp_buffer, 0, BLOCK_SIZE);
+	memcpy(temp_buffer, &sb, sizeof(sb));
+	bio_write(0, temp_buffer);
+
+	// initialize inode bitmap (to zero)
+	bitmap_t inode_bitmap = (bitmap_t)scratch_get();
+	if (!inode_bitmap)
+	{
+		perror("Failed to allocate inode bitmap");
+		return -1;
+	}
+	memset(inode_bitmap, 0, BLOCK_SIZE);
+	bio_write(sb.i_bitmap_blk, inode_bitmap); // Write the initialized inode bitmap to the disk
+
+	// initialize data block bitmap
+	bitmap_t data_bitmap = (bitmap_t)scratch_get();
 	if (!data_bitmap)
 	{
 		perror("Failed to allocate data block bitmap");
-		free(inode_bitmap);
+		scratch_put(inode_bitmap);
 		return -1;
 	}
+	memset(data_bitmap, 0, BLOCK_SIZE);
 	for(int i=0;i< sb.d_start_blk; i++){
 		set_bitmap(data_bitmap, i);
 	}
 	bio_write(sb.d_bitmap_blk, data_bitmap); // Write the initialized data block bitmap to the disk
 
+	// initialize reference counts, metadata blocks hold a single reference
+	char *zero_block = temp_buffer;
+	memset(zero_block, 0, BLOCK_SIZE);
+	for (int i = 0; i < REF_BLOCKS; i++)
+	{
+		uint16_t *refs = (uint16_t *)temp_buffer;
+		for (int j = 0; j < REFS_PER_BLOCK; j++)
+			refs[j] = i * REFS_PER_BLOCK + j < sb.d_start_blk ? 1 : 0;
+		bio_write(sb.r_start_blk + i, refs);
+	}
+	// empty fingerprint index, snapshot table and inode table
+	memset(zero_block, 0, BLOCK_SIZE);
+	for (int i = 0; i < FP_BUCKETS; i++)
+		bio_write(sb.f_start_blk + i, zero_block);
+	bio_write(sb.s_table_blk, zero_block);
+	for (int i = 0; i < number_of_inode_blocks; i++)
+		bio_write(sb.i_start_blk + i, zero_block);
+
 	// update inode for root directory
 	struct inode root_inode;
+	memset(&root_inode, 0, sizeof(root_inode));
 	root_inode.ino = 0;
 	root_inode.valid = 1;
 	root_inode.size = 0;	   // Initially, size is 0
 	root_inode.type = S_IFDIR; // Directory type
 	root_inode.link = 2;	   // Standard for directories
+	inode_touch(&root_inode);
 
 	// The first inode starts right after the inode bitmap
 	writei(0, &root_inode);
@@ -550,55 +2116,759 @@ int rufs_mkfs()
 	set_bitmap(inode_bitmap, 0);			  // set the 0th bit to 1
 	bio_write(sb.i_bitmap_blk, inode_bitmap); // rewrite
 
-	free(inode_bitmap);
-	free(data_bitmap);
+	scratch_put(inode_bitmap);
+	scratch_put(data_bitmap);
+
+	return 0;
+}
+
+/*
+ * file operations on inodes, shared by the path based (rufs.c) and the
+ * inode based (rufs_ll.c) front ends
+ */
+
+// Fill in stat from an inode, read_only strips the write bits
+void fill_stat(struct inode *inode, struct stat *stbuf, int read_only)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = inode->ino;
+	stbuf->st_size = inode->bytes;
+	// blocks actually held, which counts preallocation past the end and not holes
+	for (int i = 0; i < NUM_DIRECT; i++)
+		stbuf->st_blocks += inode->direct_ptr[i] != 0 ? BLOCK_SIZE / 512 : 0;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+
+	if (inode->type == S_IFREG)
+	{
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFREG | 0755;
+	}
+	else
+	{
+		stbuf->st_nlink = 2;
+		stbuf->st_mode = S_IFDIR | 0755;
+	}
+	if (read_only)
+	{
+		// snapshots are read-only
+		stbuf->st_mode &= ~0222;
+	}
+	// stored times keep attributes stable, so the kernel can cache them
+	stbuf->st_mtim = inode->vstat.st_mtim;
+	stbuf->st_ctim = inode->vstat.st_ctim;
+	stbuf->st_atim = inode->vstat.st_atim;
+}
+
+/*
+ * Create a file or directory called name in parent (steps shared by mkdir and create)
+ */
+int make_node(struct inode *parent_inode, const char *name, uint32_t type, struct inode *new_inode)
+{
+	if (strlen(name) > DIRENT_NAME_MAX)
+		return -ENAMETOOLONG;
+
+	// Step 1: Call get_avail_ino() to get an available inode number
+	int ino = get_avail_ino();
+	if (ino == -1)
+	{
+		// no availiable inode
+		return -ENOSPC;
+	}
+
+	// Step 2: Call dir_add() to add directory entry of target to parent directory
+	// printf("adding directory entry with ino: %d to parent directory with id: %d\n",ino, parent_inode->ino);
+	int ret = dir_add(*parent_inode, ino, name, strlen(name));
+	if (ret < 0)
+	{
+		// failed to add directory entry, the inode goes back unused
+		release_ino(ino);
+		return ret;
+	}
+
+	// Step 3: Update inode for target, direct and indirect pointers start at 0
+	memset(new_inode, 0, sizeof(struct inode));
+	new_inode->ino = ino;
+	new_inode->valid = 1;
+	new_inode->size = 0;		 // New file or directory, so size is 0
+	new_inode->type = type;
+	new_inode->link = type == S_IFDIR ? 2 : 1; // Initial link count
+	inode_touch(new_inode);
+
+	// Step 4: Call writei() to write inode to disk
+	writei(ino, new_inode);
+	return 0;
+}
+
+// Read size bytes at offset from a file, returns the number of bytes read
+int file_read(struct inode *inode, char *buffer, size_t size, off_t offset)
+{
+	// printf("get inode with id %d file size: %d\n", inode->ino, inode->size);
+	if (offset >= inode->bytes)
+	{
+		// No data is read
+		return 0;
+	}
+	if (offset + size > inode->bytes)
+	{
+		// Adjust size if offset + size is beyond the end of the file
+		size = inode->bytes - offset;
+	}
+
+	// Step 1: Based on size and offset, read its data blocks from disk
+	char temp_block[BLOCK_SIZE] BLOCK_ALIGNED;
+	char cluster_buf[CLUSTER_SIZE] BLOCK_ALIGNED;
+	int cached_cluster = -1;
+	struct block_run run = {0};
+	size_t bytes_read = 0;
+	while (bytes_read < size)
+	{
+		int block_num = (offset + bytes_read) / BLOCK_SIZE;
+		int block_offset = (offset + bytes_read) % BLOCK_SIZE;
+		int space_in_block = BLOCK_SIZE - block_offset;
+		int bytes_to_read = space_in_block < (size - bytes_read) ? space_in_block : (size - bytes_read);
+		int cluster = block_num / CLUSTER_BLKS;
+		int blkno = inode->direct_ptr[block_num];
+		const char *src;
+
+		if (inode->c_len[cluster] == 0 && blkno != 0 && bytes_to_read == BLOCK_SIZE)
+		{
+			// whole raw block, read together with its physical neighbours straight into buffer
+			if (run_add(&run, blkno, buffer + bytes_read, 0) < 0)
+				return -EIO;
+			bytes_read += bytes_to_read;
+			continue;
+		}
+		if (inode->c_len[cluster] != 0)
+		{
+			// compressed cluster, decompress it once for all its blocks
+			if (cached_cluster != cluster)
+			{
+				if (read_cluster(inode, cluster, cluster_buf) < 0)
+					return -EIO;
+				cached_cluster = cluster;
+			}
+			src = cluster_buf + (block_num % CLUSTER_BLKS) * BLOCK_SIZE;
+		}
+		else if (inode->direct_ptr[block_num] == 0)
+		{
+			// hole
+			memset(temp_block, 0, BLOCK_SIZE);
+			src = temp_block;
+		}
+		else
+		{
+			// Read block from disk into temp block
+			if (bio_read(inode->direct_ptr[block_num], temp_block) < 0)
+				return -EIO;
+			src = temp_block;
+		}
+		// Step 2: copy the correct amount of data from offset to buffer
+		memcpy(buffer + bytes_read, src + block_offset, bytes_to_read);
+		bytes_read += bytes_to_read;
+	}
+	if (run_flush(&run, 0) < 0)
+		return -EIO;
+
+	// Note: this function should return the amount of bytes you copied to buffer
+	return bytes_read;
+}
+
+/*
+ * Write path for raw data without dedup: blocks are made private up front and
+ * written in place, physically contiguous ones with a single pwritev()
+ */
+int file_write_inplace(struct inode *inode, const char *buffer, size_t size, off_t offset)
+{
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	char bounce[2][BLOCK_SIZE] BLOCK_ALIGNED;
+	const char *src[NUM_DIRECT];
+	int old[NUM_DIRECT];
+
+	// Step 1: merge partial first and last blocks with their old contents
+	for (int i = first; i <= last; i++)
+	{
+		off_t start = (off_t)i * BLOCK_SIZE;
+		if (start >= offset && start + BLOCK_SIZE <= offset + size)
+		{
+			src[i] = buffer + (start - offset);
+			continue;
+		}
+		char *temp_block = bounce[i == first ? 0 : 1];
+		if (inode->direct_ptr[i] == 0)
+			memset(temp_block, 0, BLOCK_SIZE);
+		else if (bio_read(inode->direct_ptr[i], temp_block) < 0)
+			return -EIO;
+		off_t from = start > offset ? start : offset;
+		off_t to = start + BLOCK_SIZE < offset + size ? start + BLOCK_SIZE : offset + size;
+		memcpy(temp_block + (from - start), buffer + (from - offset), to - from);
+		src[i] = temp_block;
+	}
+
+	// Step 2: new and shared blocks get private ones, as one run where possible
+	if (own_blocks(inode, first, last, old) < 0)
+		return -ENOSPC;
+
+	// Step 3: write them, one system call per physically contiguous run; if
+	// that fails the inode keeps the blocks it had, the new ones go back
+	struct block_run run = {0};
+	for (int i = first; i <= last; i++)
+	{
+		if (run_add(&run, inode->direct_ptr[i], (void *)src[i], 1) < 0)
+		{
+			own_blocks_undo(inode, first, last, old);
+			return -EIO;
+		}
+	}
+	if (run_flush(&run, 1) < 0)
+	{
+		own_blocks_undo(inode, first, last, old);
+		return -EIO;
+	}
+	own_blocks_done(inode, first, last, old);
+
+	// Step 4: Update the inode info and write it to disk
+	if (last + 1 > inode->size)
+		inode->size = last + 1;
+	if (offset + size > inode->bytes)
+		inode->bytes = offset + size;
+	inode_touch(inode);
+	writei_lazy(inode->ino, inode);
+	return size;
+}
+
+// Write size bytes at offset to a file and write back its inode, returns the number of bytes written
+int file_write(struct inode *inode, const char *buffer, size_t size, off_t offset)
+{
+	if (offset + size > NUM_DIRECT * BLOCK_SIZE)
+	{
+		perror("File size exceeds maximum file size");
+		return -EFBIG;
+	}
+	if (size == 0)
+		return 0;
+
+	// raw clusters without dedup take the vectored in-place path
+	int compressed = 0;
+	for (int c = offset / CLUSTER_SIZE; c <= (offset + size - 1) / CLUSTER_SIZE; c++)
+		compressed |= inode->c_len[c] != 0;
+	if (!compressed && !opts.compress && !opts.dedup)
+		return file_write_inplace(inode, buffer, size, offset);
+
+	// Step 1: Based on size and offset, write its data blocks to disk
+	char temp_block[BLOCK_SIZE] BLOCK_ALIGNED;
+	char cluster_buf[CLUSTER_SIZE] BLOCK_ALIGNED;
+	size_t bytes_written = 0;
+	while (bytes_written < size)
+	{
+		int block_num = (offset + bytes_written) / BLOCK_SIZE;
+		int block_offset = (offset + bytes_written) % BLOCK_SIZE;
+		int space_in_block = BLOCK_SIZE - block_offset;
+		int bytes_to_write = space_in_block < (size - bytes_written) ? space_in_block : (size - bytes_written);
+		int cluster = block_num / CLUSTER_BLKS;
+		int old_size = inode->size;
+
+		// the reason using block_num+1 is that the offset might be greater than original
+		// file size, so we need to update the size to the offset
+		if (block_num + 1 > inode->size)
+			inode->size = block_num + 1;
+
+		if (opts.compress || inode->c_len[cluster] != 0)
+		{
+			// compressed data is rewritten a whole cluster at a time
+			int cluster_offset = (offset + bytes_written) % CLUSTER_SIZE;
+			int space_in_cluster = CLUSTER_SIZE - cluster_offset;
+			bytes_to_write = space_in_cluster < (size - bytes_written) ? space_in_cluster : (size - bytes_written);
+			int last_block = (offset + bytes_written + bytes_to_write - 1) / BLOCK_SIZE;
+			if (last_block + 1 > inode->size)
+				inode->size = last_block + 1;
+			int nblocks = inode->size - cluster * CLUSTER_BLKS;
+			if (nblocks > CLUSTER_BLKS)
+				nblocks = CLUSTER_BLKS;
+
+			if (read_cluster(inode, cluster, cluster_buf) < 0)
+				return -EIO;
+			memcpy(cluster_buf + cluster_offset, buffer + bytes_written, bytes_to_write);
+			if (write_cluster(inode, cluster, cluster_buf, nblocks) < 0)
+			{
+				// the cluster is as it was, keep what earlier ones took
+				inode->size = old_size;
+				writei(inode->ino, inode);
+				return -ENOSPC;
+			}
+			bytes_written += bytes_to_write;
+			continue;
+		}
+
+		if (inode->direct_ptr[block_num] == 0)
+		{
+			// new data block, start from zeros
+			memset(temp_block, 0, BLOCK_SIZE);
+		}
+		else if (block_offset != 0 || bytes_to_write < BLOCK_SIZE)
+		{
+			// Read the block from disk if partial write
+			bio_read(inode->direct_ptr[block_num], temp_block);
+		}
+
+		// Write the data from buffer to the temporary block
+		memcpy(temp_block + block_offset, buffer + bytes_written, bytes_to_write);
+
+		// printf("writing block %d\n", inode->direct_ptr[block_num]);
+		// Write the modified block back to disk
+		if (store_block(inode, block_num, temp_block) < 0)
+		{
+			writei(inode->ino, inode);
+			return -ENOSPC;
+		}
+
+		// Update bytes_written
+		bytes_written += bytes_to_write;
+	}
+
+	// Step 2: Update the inode info and write it to disk
+	if (offset + bytes_written > inode->bytes)
+		inode->bytes = offset + bytes_written;
+	inode_touch(inode);
+	writei_lazy(inode->ino, inode);
+	// Note: this function should return the amount of bytes you write to disk
+	return bytes_written;
+}
+
+/*
+ * Allocate the blocks under length bytes at offset of a file. The holes get
+ * one contiguous run and are zeroed with one pwritev, so they read back as
+ * zeros. The file grows to cover the range unless mode has KEEP_SIZE, then
+ * blocks past the end stay allocated for later writes. Returns 0 or -errno
+ */
+int file_fallocate(struct inode *inode, int mode, off_t offset, off_t length)
+{
+	static char zero_block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+	if (inode->type != S_IFREG)
+		return -ENODEV;
+	if (offset + length > NUM_DIRECT * BLOCK_SIZE)
+		return -EFBIG;
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + length - 1) / BLOCK_SIZE;
+
+	// Step 1: count the holes, compressed clusters keep their blocks packed and are left alone
+	int holes = 0;
+	for (int i = first; i <= last; i++)
+		holes += inode->direct_ptr[i] == 0 && inode->c_len[i / CLUSTER_BLKS] == 0;
+
+	// Step 2: fill them from one run, block by block if free space is fragmented
+	int ret = 0;
+	if (holes > 0)
+	{
+		struct block_run run = {0};
+		int next = -1;
+		for (int i = first; i <= last && ret == 0; i++)
+		{
+			if (inode->direct_ptr[i] != 0 || inode->c_len[i / CLUSTER_BLKS] != 0)
+				continue;
+			if (next < 0)
+				next = get_avail_blkrun_near(holes, block_goal(inode, i));
+			int blkno = next >= 0 ? next++ : get_avail_blkrun_near(1, block_goal(inode, i));
+			if (blkno < 0)
+			{
+				ret = -ENOSPC;
+				break;
+			}
+			inode->direct_ptr[i] = blkno;
+			if (run_add(&run, blkno, zero_block, 1) < 0)
+				ret = -EIO;
+		}
+		if (run_flush(&run, 1) < 0 && ret == 0)
+			ret = -EIO;
+	}
+
+	// Step 3: Update the inode info and write it to disk
+	if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->bytes)
+	{
+		inode->bytes = offset + length;
+		inode->size = (inode->bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	inode_touch(inode);
+	if (writei_lazy(inode->ino, inode) < 0)
+		return -EIO;
+	return ret;
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * Zero-copy data path (FUSE >= 2.9)
+ * Raw data blocks are handed to libfuse as descriptor + offset pairs into the
+ * disk file, so it can splice them to and from /dev/fuse without passing
+ * through our buffers. Compressed clusters and dedup go through
+ * file_read()/file_write() instead.
+ */
+
+// Map size bytes at offset of a file to a buffer vector, memory segments are malloc'd
+int file_read_buf(struct inode *inode, struct fuse_bufvec **bufp, size_t size, off_t offset)
+{
+	struct fuse_bufvec *bufv;
+	int compressed = 0;
+
+	if (offset >= inode->bytes)
+		size = 0;
+	else if (offset + size > inode->bytes)
+		size = inode->bytes - offset;
+	for (int i = 0; i < NUM_CLUSTERS; i++)
+		compressed |= inode->c_len[i] != 0;
+
+	// fall back to a single memory buffer filled by file_read()
+	if (compressed || size == 0)
+	{
+		bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+		if (!bufv)
+			return -ENOMEM;
+		*bufv = FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem = block_alloc(size);
+		int ret = bufv->buf[0].mem ? file_read(inode, bufv->buf[0].mem, size, offset) : -ENOMEM;
+		if (ret < 0)
+		{
+			free(bufv->buf[0].mem);
+			free(bufv);
+			return ret;
+		}
+		bufv->buf[0].size = ret;
+		*bufp = bufv;
+		return 0;
+	}
+
+	// Step 1: one segment per block at most, physically contiguous blocks are merged below
+	int max_segs = size / BLOCK_SIZE + 2;
+	bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) + (max_segs - 1) * sizeof(struct fuse_buf));
+	if (!bufv)
+		return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = 0;
+
+	// Step 2: map each block of the range to the disk file
+	size_t bytes_read = 0;
+	while (bytes_read < size)
+	{
+		int block_num = (offset + bytes_read) / BLOCK_SIZE;
+		int block_offset = (offset + bytes_read) % BLOCK_SIZE;
+		int space_in_block = BLOCK_SIZE - block_offset;
+		int bytes_to_read = space_in_block < (size - bytes_read) ? space_in_block : (size - bytes_read);
+		int blkno = inode->direct_ptr[block_num];
+		struct fuse_buf *prev = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+		off_t pos = 0;
+		int fd = blkno ? bio_fd(blkno, &pos, 0) : -1;
+
+		if (fd >= 0 && prev && (prev->flags & FUSE_BUF_IS_FD) && prev->fd == fd &&
+			prev->pos + prev->size == pos + block_offset)
+		{
+			// continues the previous segment
+			prev->size += bytes_to_read;
+		}
+		else
+		{
+			struct fuse_buf *seg = &bufv->buf[bufv->count++];
+			memset(seg, 0, sizeof(struct fuse_buf));
+			seg->size = bytes_to_read;
+			if (fd >= 0)
+			{
+				seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				seg->fd = fd;
+				seg->pos = pos + block_offset;
+			}
+			else
+			{
+				// holes and blocks without a descriptor are copied, libfuse frees the memory
+				char *mem = (char *)block_alloc(BLOCK_SIZE);
+				if (!mem)
+				{
+					bufv->count--;
+					break;
+				}
+				if (blkno == 0)
+					memset(mem, 0, BLOCK_SIZE);
+				else
+					bio_read(blkno, mem);
+				memmove(mem, mem + block_offset, bytes_to_read);
+				seg->fd = -1;
+				seg->mem = mem;
+			}
+		}
+		bytes_read += bytes_to_read;
+	}
+
+	*bufp = bufv;
+	return 0;
+}
+
+// Write a buffer vector at offset of a file and write back its inode, returns the number of bytes written
+int file_write_buf(struct inode *inode, struct fuse_bufvec *buf, off_t offset)
+{
+	size_t size = fuse_buf_size(buf);
+	int compressed = 0;
+
+	for (int i = 0; i < NUM_CLUSTERS; i++)
+		compressed |= inode->c_len[i] != 0;
+
+	// compressed or deduplicated data has to be looked at, copy it into memory first
+	if (compressed || opts.compress || opts.dedup)
+	{
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = block_alloc(size);
+		if (!mem.buf[0].mem)
+			return -ENOMEM;
+		ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+		int ret = copied < 0 ? copied : file_write(inode, mem.buf[0].mem, copied, offset);
+		free(mem.buf[0].mem);
+		return ret;
+	}
+	if (offset + size > NUM_DIRECT * BLOCK_SIZE)
+	{
+		perror("File size exceeds maximum file size");
+		return -EFBIG;
+	}
+
+	// whole blocks are made private up front, so new ones come as one contiguous run
+	int first_whole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int last_whole = (offset + size) / BLOCK_SIZE - 1;
+	int old[NUM_DIRECT];
+	if (first_whole <= last_whole)
+	{
+		if (own_blocks(inode, first_whole, last_whole, old) < 0)
+			return -ENOSPC;
+		own_blocks_done(inode, first_whole, last_whole, old);
+	}
+
+	char temp_block[BLOCK_SIZE] BLOCK_ALIGNED;
+	size_t bytes_written = 0;
+	while (bytes_written < size)
+	{
+		int block_num = (offset + bytes_written) / BLOCK_SIZE;
+		int block_offset = (offset + bytes_written) % BLOCK_SIZE;
+		int space_in_block = BLOCK_SIZE - block_offset;
+		int bytes_to_write = space_in_block < (size - bytes_written) ? space_in_block : (size - bytes_written);
+		int *ptr = &inode->direct_ptr[block_num];
+		off_t pos = 0;
+		int fd = -1;
+
+		// Step 1: whole blocks are made private, then written straight into the disk file
+		if (block_offset == 0 && bytes_to_write == BLOCK_SIZE)
+		{
+			if (*ptr == 0 || blk_refs[*ptr] > 1)
+			{
+				int new_block_num = get_file_blkrun(inode, block_num, 1);
+				if (new_block_num < 0)
+					break;
+				if (*ptr != 0)
+					release_blkno(*ptr);
+				*ptr = new_block_num;
+			}
+			fd = bio_fd(*ptr, &pos, 1);
+		}
+		if (fd >= 0)
+		{
+			// extend over following whole blocks that are private and physically contiguous
+			int run = 1;
+			off_t next_pos;
+			while (bytes_written + (run + 1) * BLOCK_SIZE <= size)
+			{
+				int next = inode->direct_ptr[block_num + run];
+				if (next == 0 || blk_refs[next] > 1 || bio_fd(next, &next_pos, 1) != fd ||
+					next_pos != pos + run * BLOCK_SIZE)
+					break;
+				run++;
+			}
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run * BLOCK_SIZE);
+			dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			dst.buf[0].fd = fd;
+			dst.buf[0].pos = pos;
+			ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+			if (copied != run * BLOCK_SIZE)
+			{
+				if (copied > 0)
+					bytes_written += copied;
+				break;
+			}
+			bytes_to_write = run * BLOCK_SIZE;
+		}
+		else
+		{
+			// Step 2: partial blocks are read, modified and stored through memory
+			if (*ptr == 0)
+				memset(temp_block, 0, BLOCK_SIZE);
+			else
+				bio_read(*ptr, temp_block);
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(bytes_to_write);
+			dst.buf[0].mem = temp_block + block_offset;
+			if (fuse_buf_copy(&dst, buf, 0) != bytes_to_write || store_block(inode, block_num, temp_block) < 0)
+				break;
+		}
 
-	return 0;
+		bytes_written += bytes_to_write;
+	}
+	if ((offset + bytes_written + BLOCK_SIZE - 1) / BLOCK_SIZE > inode->size)
+		inode->size = (offset + bytes_written + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// Step 3: Update the inode info and write it to disk
+	if (offset + bytes_written > inode->bytes)
+		inode->bytes = offset + bytes_written;
+	inode_touch(inode);
+	writei_lazy(inode->ino, inode);
+	if (bytes_written == 0 && size > 0)
+		return -EIO;
+	return bytes_written;
 }
+#endif
 
 /*
- * FUSE file operations
+ * Mount and unmount, shared by both front ends
  */
-static void *rufs_init(struct fuse_conn_info *conn)
+int rufs_setup()
 {
 	// Step 1a: If disk file is not found, call mkfs
-	// seems that this does not work
-	rufs_mkfs();
-	if (dev_open(diskfile_path) == -1)
+	char temp_buffer[BLOCK_SIZE] BLOCK_ALIGNED;
+	dev_stripe_unit(opts.stripe_unit);
+	dev_direct(opts.odirect);
+	if (opts.cbt)
+		dev_cbt(MAX_DNUM);
+	if (opts.ram)
+	{
+		// memory stands in for the whole block space, a fast tier would sit behind it unused
+		struct superblock layout;
+		sb_layout(&layout);
+		dev_ram(layout.max_dnum, opts.checkpoint);
+		if (opts.fast)
+			fprintf(stderr, "fast=%s: ignored in RAM mode\n", opts.fast);
+	}
+	else if (opts.fast)
+	{
+		// the whole metadata region stays on the fast tier
+		struct superblock layout;
+		sb_layout(&layout);
+		dev_tier(opts.fast, layout.d_start_blk, layout.max_dnum, opts.fast_blocks);
+	}
+	if (dev_open(diskfile_path) == -1 || bio_read(0, temp_buffer) <= 0 ||
+		((struct superblock *)temp_buffer)->magic_num != MAGIC_NUM)
 	{
+		if (rufs_mkfs() < 0)
+			return -1;
 	}
 	else
 	{
-		// read superblock from memory
-		char temp_buffer[BLOCK_SIZE];
-		bio_read(0, temp_buffer);
+		// Step 1b: If disk file is found, read superblock from disk
 		memcpy(&sb, temp_buffer, sizeof(sb));
-	}
-
-	// Step 1b: If disk file is found, just initialize in-memory data structures
-	// and read superblock from disk
+		if (sb.i_version != DINODE_VERSION)
+		{
+			fprintf(stderr, "%s: inode format %u, expected %u\n", diskfile_path, sb.i_version, DINODE_VERSION);
+			exit(EXIT_FAILURE);
+		}
 
-	// possibly put the superblock, inode, and dirent in heap here (malloc)
+		// block 0 is in the same place for any stripe unit, the rest follows the image's
+		int ndevs, stripe_unit;
+		dev_geometry(&ndevs, &stripe_unit);
+		if (sb.s_ndevs > 1 && sb.s_ndevs != ndevs)
+		{
+			fprintf(stderr, "%s: image is striped over %u files, %d given\n", diskfile_path, sb.s_ndevs, ndevs);
+			exit(EXIT_FAILURE);
+		}
+		dev_stripe_unit(sb.s_stripe_unit);
+	}
 
-	return NULL;
+	// Step 2: initialize in-memory data structures
+	mount_time = time(NULL);
+	d_bitmap = (bitmap_t)block_alloc(BLOCK_SIZE);
+	bio_read(sb.d_bitmap_blk, d_bitmap);
+	if (ext_init(d_bitmap, sb_nblocks(&sb)) < 0)
+	{
+		perror("Failed to build free extent index");
+		return -1;
+	}
+	blk_refs = (uint16_t *)block_alloc(REF_BLOCKS * BLOCK_SIZE);
+	for (int i = 0; i < REF_BLOCKS; i++)
+		bio_read(sb.r_start_blk + i, (char *)blk_refs + i * BLOCK_SIZE);
+	snaps = (struct snapshot *)block_alloc(BLOCK_SIZE);
+	bio_read(sb.s_table_blk, snaps);
+	if (opts.dedup)
+	{
+		fp_index = (struct fp_entry *)block_alloc(FP_BUCKETS * BLOCK_SIZE);
+		for (int i = 0; i < FP_BUCKETS; i++)
+			bio_read(sb.f_start_blk + i, (char *)fp_index + i * BLOCK_SIZE);
+	}
+	return 0;
 }
 
-static void rufs_destroy(void *userdata)
+void rufs_teardown()
 {
 
 	// Step 1: De-allocate in-memory data structures
+	if (opts.dedup)
+	{
+		printf("dedup: %llu block writes shared an existing block, %llu stored new contents\n",
+			   (unsigned long long)dstats.hits, (unsigned long long)dstats.misses);
+	}
+	for (int i = 0; i < PREALLOC_SLOTS; i++)
+		prealloc_trim(windows[i].ino);
+	lazy_flush_all();
+	ext_destroy();
+	free(d_bitmap);
+	free(blk_refs);
+	free(fp_index);
+	free(snaps);
+
+	if (cstats.bytes_out > 0)
+	{
+		printf("compression: %llu clusters compressed, %llu raw, ratio %.2f (%llu -> %llu bytes)\n",
+			   (unsigned long long)cstats.clusters_compressed, (unsigned long long)cstats.clusters_raw,
+			   (double)cstats.bytes_in / cstats.bytes_out,
+			   (unsigned long long)cstats.bytes_in, (unsigned long long)cstats.bytes_out);
+	}
 
 	// Step 2: Close diskfile
 	dev_close();
 }
 
+/*
+ * FUSE file operations
+ */
+static void *rufs_init(struct fuse_conn_info *conn)
+{
+	rufs_setup();
+
+#if FUSE_VERSION >= 29
+	// let libfuse splice data between /dev/fuse and the disk file
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+	return NULL;
+}
+
+static void rufs_destroy(void *userdata)
+{
+	rufs_teardown();
+}
+
 static int rufs_getattr(const char *path, struct stat *stbuf)
 {
 
+	// hidden control file and snapshot directory
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, CTL_PATH) == 0 || snapshot_path(path, NULL, NULL) == 1)
+	{
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_nlink = strcmp(path, CTL_PATH) == 0 ? 1 : 2;
+		stbuf->st_mode = strcmp(path, CTL_PATH) == 0 ? S_IFREG | 0644 : S_IFDIR | 0555;
+		stbuf->st_mtime = mount_time;
+		return 0;
+	}
+
 	// Step 1: call get_node_by_path() to get inode from path
 	// printf("calling rufs_getattr with parameters: path: %s\n", path);
-	struct inode *inode = (struct inode *)malloc(sizeof(struct inode));
-	int success = get_node_by_path(path, ROOT_INO, inode);
+	struct inode inode;
+	int success = resolve_path(path, &inode);
 	if (success < 0)
 	{
 		// file not found
@@ -606,91 +2876,119 @@ static int rufs_getattr(const char *path, struct stat *stbuf)
 	}
 
 	// Step 2: fill attribute of file into stbuf from inode
-	stbuf->st_ino = inode->ino;
-	stbuf->st_size = inode->size * BLOCK_SIZE;
-	stbuf->st_uid = getuid();
-	stbuf->st_gid = getgid();
-
-	if (inode->type == S_IFREG)
-	{
-		stbuf->st_nlink = 1;
-		stbuf->st_mode = S_IFREG | 0755;
-	}
-	else
-	{
-		stbuf->st_nlink = 2;
-		stbuf->st_mode = S_IFDIR | 0755;
-	}
-	time(&stbuf->st_mtime);
-	// // printf("Successfully get file attribute with id: %d\n", inode->ino);
+	fill_stat(&inode, stbuf, success == 1);
 	return 0;
 }
 
+/*
+ * An open directory keeps its inode table and inode number in fi->fh, so
+ * readdir calls that follow do not walk the path again
+ */
+#define DIR_FH(i_start_blk, ino) (((uint64_t)(i_start_blk) << 32) | (ino))
+
 static int rufs_opendir(const char *path, struct fuse_file_info *fi)
 {
 
+	if (snapshot_path(path, NULL, NULL) == 1)
+		return 0;
+
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *inode = (struct inode *)malloc(sizeof(struct inode));
-	int success = get_node_by_path(path, ROOT_INO, inode);
+	struct inode inode;
+	uint32_t i_start_blk;
+	int success = resolve_path_at(path, &inode, &i_start_blk);
 	// Step 2: If not find, return -1
 	if (success < 0)
 	{
 		// file not found
-		return -1;
+		return -ENOENT;
 	}
+	if (inode.type != S_IFDIR)
+		return -ENOTDIR;
 
+	fi->fh = DIR_FH(i_start_blk, inode.ino);
 	return 0;
 }
 
+// directory listing being handed to the FUSE filler
+struct readdir_ctx {
+	void *buffer;
+	fuse_fill_dir_t filler;
+	struct inode_cache icache;		/* children's inodes, for their attributes */
+	int read_only;
+};
+
+static int readdir_fill(void *ctx, const struct dirent *dirent, off_t next)
+{
+	struct readdir_ctx *rc = (struct readdir_ctx *)ctx;
+	struct inode child;
+	struct stat st;
+
+	// the child's inode block is usually already cached, so its attributes come for free
+	if (readi_cached(&rc->icache, dirent->ino, &child) < 0)
+		return rc->filler(rc->buffer, dirent->name, NULL, next);
+	fill_stat(&child, &st, rc->read_only);
+	return rc->filler(rc->buffer, dirent->name, &st, next);
+}
+
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *inode = (struct inode *)malloc(sizeof(struct inode));
-	int success = get_node_by_path(path, ROOT_INO, inode);
-	if (success < 0)
+	// the snapshot directory lists one entry per snapshot id, cookies are the table slot + 1
+	if (snapshot_path(path, NULL, NULL) == 1)
 	{
-		// file not found
-		return -ENOENT;
+		char name[16];
+		for (int i = offset; i < MAX_SNAPSHOTS; i++)
+		{
+			if (snaps[i].id == 0)
+				continue;
+			snprintf(name, sizeof(name), "%u", snaps[i].id);
+			if (filler(buffer, name, NULL, i + 1))
+				break;
+		}
+		return 0;
 	}
 
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	for (int i = 0; i < inode->size; i++)
+	// Step 1: Get the directory inode, from opendir if it was opened
+	struct inode inode;
+	uint32_t i_start_blk;
+	if (fi && fi->fh != 0)
 	{
-		if (inode->direct_ptr[i] != 0)
-		{
-			struct dirent *dirent_block = (struct dirent *)malloc(BLOCK_SIZE);
-			if (!dirent_block)
-			{
-				perror("Failed to allocate memory for dirent block");
-				return -1;
-			}
-			if (bio_read(inode->direct_ptr[i], dirent_block) < 0)
-			{
-				perror("Failed to read dirent block from disk");
-				free(dirent_block);
-				return -1;
-			}
-			for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
-			{
-				if (dirent_block[j].valid == 1)
-				{
-					filler(buffer, dirent_block[j].name, NULL, 0);
-				}
-			}
-			free(dirent_block);
-		}
+		i_start_blk = fi->fh >> 32;
+		if (readi_at(i_start_blk, fi->fh & 0xffff, &inode) < 0)
+			return -EIO;
+	}
+	else if (resolve_path_at(path, &inode, &i_start_blk) < 0)
+	{
+		// file not found
+		return -ENOENT;
 	}
 
-	return 0;
+	// Step 2: Read directory entries from its data blocks, starting after the
+	// cookie the kernel passed back, until the filler's buffer is full
+	struct readdir_ctx rc;
+	rc.buffer = buffer;
+	rc.filler = filler;
+	rc.read_only = i_start_blk != sb.i_start_blk;
+	if (inode_cache_init(&rc.icache, i_start_blk) < 0)
+		return -ENOMEM;
+	int ret = dir_iterate(&inode, offset, readdir_fill, &rc);
+	inode_cache_release(&rc.icache);
+
+	return ret < 0 ? -EIO : 0;
 }
 
 static int rufs_mkdir(const char *path, mode_t mode)
 {
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+	if (strcmp(path, CTL_PATH) == 0)
+		return -EEXIST;
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
+	char path_copy1[PATH_MAX], path_copy2[PATH_MAX];
+	strncpy(path_copy1, path, PATH_MAX - 1);
+	path_copy1[PATH_MAX - 1] = '\0';
+	strcpy(path_copy2, path_copy1);
 	char *dir_path = dirname(path_copy1);
 	char *file_name = basename(path_copy2);
 	// printf("calling rufs_mkdir with parameters: dir_path: %s, file_name: %s\n", dir_path, file_name);
@@ -701,38 +2999,14 @@ static int rufs_mkdir(const char *path, mode_t mode)
 	{
 		// parent directory not found
 		// printf("parent directory not found\n");
-		free(path_copy1);
-		free(path_copy2);
 		return -ENOENT;
 	}
 	
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino = get_avail_ino();
-
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	// printf("adding directory entry with ino: %d to parent directory with id: %d\n",ino, parent_inode.ino);
-	if (dir_add(parent_inode, ino, file_name, strlen(file_name)) == -1)
-	{
-		// failed to add directory entry
-		free(path_copy1);
-		free(path_copy2);
-		return -1;
-	}
-	// Step 5: Update inode for target directory
+	// Step 3: allocate the inode, add its directory entry and write it to disk
 	struct inode new_inode;
-	new_inode.ino = ino;
-	new_inode.valid = 1;
-	new_inode.size = 0;		 // New directory, so size is 0
-	new_inode.type = S_IFDIR; // Directory type
-	new_inode.link = 2;		 // Initial link count
-	// Initialize direct and indirect pointers to 0
-	for (int i = 0; i < 16; i++){
-		new_inode.direct_ptr[i] = 0;
-	}
-	// Step 6: Call writei() to write inode to disk
-	writei(ino, &new_inode);
+	int ret = make_node(&parent_inode, file_name, S_IFDIR, &new_inode);
 
-	return 0;
+	return ret;
 }
 
 // skip this
@@ -763,11 +3037,17 @@ static int rufs_releasedir(const char *path, struct fuse_file_info *fi)
 
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+	if (strcmp(path, CTL_PATH) == 0)
+		return -EEXIST;
 	// printf("CREATE: In rufs_create\n");
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
+	char path_copy1[PATH_MAX], path_copy2[PATH_MAX];
+	strncpy(path_copy1, path, PATH_MAX - 1);
+	path_copy1[PATH_MAX - 1] = '\0';
+	strcpy(path_copy2, path_copy1);
 	char *dir_path = dirname(path_copy1);
 	char *file_name = basename(path_copy2);
 
@@ -776,71 +3056,46 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	if (get_node_by_path(dir_path, ROOT_INO, &parent_inode) < 0)
 	{
 		// parent directory not found
-		free(path_copy1);
-		free(path_copy2);
 		// // printf("parent directory not found\n");
 		return -ENOENT;
 	}
 	// // printf("Successfully get parent inode with id: %d\n", parent_inode.ino);
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino = get_avail_ino();
-	// // printf("get_avail_ino: %d\n", ino);
-	if (ino == -1)
-	{
-		// no availiable inode
-		free(path_copy1);
-		free(path_copy2);
-		return -1;
-	}
-
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	if (dir_add(parent_inode, ino, file_name, strlen(file_name)) == -1)
-	{
-		// failed to add directory entry
-		free(path_copy1);
-		free(path_copy2);
-		return -1;
-	}
-
-	// Step 5: Update inode for target file
+	// Step 3: allocate the inode, add its directory entry and write it to disk
 	struct inode new_inode;
-	new_inode.ino = ino;
-	new_inode.valid = 1;
-	new_inode.size = 0;		  // New file, so size is 0
-	new_inode.type = S_IFREG; // Regular file type
-	new_inode.link = 1;		  // Initial link count
-							  // Initialize direct and indirect pointers to 0
-	for (int i = 0; i < 16; i++)
-		new_inode.direct_ptr[i] = 0;
-	for (int i = 0; i < 8; i++)
-		new_inode.indirect_ptr[i] = 0;
-	
-	// printf("creating new inode with id: %d\n", ino);
+	int ret = make_node(&parent_inode, file_name, S_IFREG, &new_inode);
+	if (ret == 0)
+		fi->fh = new_inode.ino;
 
-	// Step 6: Call writei() to write inode to disk
-	writei(ino, &new_inode);
-
-	free(path_copy1);
-	free(path_copy2);
 
 	// // printf("Successfully create file with id: %d\n", ino);
-	return 0;
+	return ret;
 }
 
 static int rufs_open(const char *path, struct fuse_file_info *fi)
 {
 
+	// the control file has no fixed size, bypass the page cache for it
+	if (strcmp(path, CTL_PATH) == 0)
+	{
+		fi->direct_io = 1;
+		return 0;
+	}
+
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode file_inode;
-	if (get_node_by_path(path, ROOT_INO, &file_inode) == -1)
+	int success = resolve_path(path, &file_inode);
+	// Step 2: If not find, return -1
+	if (success < 0)
 	{
 		// file not found
-		return -1;
+		return -ENOENT;
 	}
-	// Step 2: If not find, return -1
-	// use fi pointer??
+	if (success == 1 && (fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
 
+	// release trims the file's preallocation window by inode number
+	fi->fh = file_inode.ino;
 	return 0;
 }
 
@@ -848,134 +3103,109 @@ static int rufs_read(const char *path, char *buffer, size_t size, off_t offset,
 {
 	// // printf("calling rufs_read with parameters: path: %s, size: %d, offset: %d\n", path, size, offset);
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode file_inode;
-	if (get_node_by_path(path, ROOT_INO, &file_inode) == -1)
-	{
-		// File is not found
-		return -1;
-	}
-	// printf("get inode with id %d file size: %d\n", file_inode.ino, file_inode.size);
-	if (offset >= file_inode.size * BLOCK_SIZE)
-	{
-		// No data is read
-		return 0;
-	}
-	if (offset + size > file_inode.size * BLOCK_SIZE)
+	if (strcmp(path, CTL_PATH) == 0)
 	{
-		// Adjust size if offset + size is beyond the end of the file
-		size = file_inode.size * BLOCK_SIZE - offset;
+		char status[4096];
+		int len = ctl_status(status, sizeof(status));
+		if (offset >= len)
+			return 0;
+		if (offset + size > len)
+			size = len - offset;
+		memcpy(buffer, status + offset, size);
+		return size;
 	}
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	char temp_block[BLOCK_SIZE];
-	size_t bytes_read = 0;
-	while (bytes_read < size)
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode file_inode;
+	int success = resolve_path(path, &file_inode);
+	if (success < 0)
 	{
-		int block_num = (offset + bytes_read) / BLOCK_SIZE;
-		int block_offset = (offset + bytes_read) % BLOCK_SIZE;
-		int space_in_block = BLOCK_SIZE - block_offset;
-		int bytes_to_read = space_in_block < (size - bytes_read) ? space_in_block : (size - bytes_read);
-		if (block_num >= 16)
-		{
-			perror("File size exceeds maximum file size");
-			return -1;
-		}
-		// Step 2: Read the block from disk if partial read
-		if (block_offset != 0 || bytes_to_read < BLOCK_SIZE)
-		{
-			bio_read(file_inode.direct_ptr[block_num], temp_block);
-		}
-		// Read block from disk into temp block
-		// // printf("reading block %d, bytes_read %d\n", file_inode.direct_ptr[block_num], bytes_read);
-		bio_read(file_inode.direct_ptr[block_num], temp_block);
-		// Step 3: copy the correct amount of data from offset to buffer
-		memcpy(buffer + bytes_read, temp_block + block_offset, bytes_to_read);
-		bytes_read += bytes_to_read;
+		// File is not found
+		return -ENOENT;
 	}
-
-	// Note: this function should return the amount of bytes you copied to buffer
-	return bytes_read;
+	int ret = file_read(&file_inode, buffer, size, offset);
+	if (ret >= 0 && success == 0)
+		inode_accessed(&file_inode);
+	return ret;
 }
 
 static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	if (strcmp(path, CTL_PATH) == 0)
+	{
+		int ret = ctl_command(buffer, size);
+		return ret < 0 ? ret : size;
+	}
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+
 	// Step 1: You could call get_node_by_path() to get inode from path
 	struct inode file_inode;
-	if (get_node_by_path(path, ROOT_INO, &file_inode) == -1)
+	if (get_node_by_path(path, ROOT_INO, &file_inode) < 0)
 	{
 		// File not found
-		return -1;
-	}
-	// load block bitmap
-	bitmap_t data_bitmap = (bitmap_t)malloc(BLOCK_SIZE);
-	if (!data_bitmap)
-	{
-		perror("Failed to allocate memory for data block bitmap");
-		return -1;
-	}
-	if (bio_read(sb.d_bitmap_blk, data_bitmap) < 0)
-	{
-		perror("Failed to read data block bitmap from disk");
-		free(data_bitmap);
-		return -1;
+		return -ENOENT;
 	}
-	// Step 2: Based on size and offset, read its data blocks from disk
-	char temp_block[BLOCK_SIZE];
-	size_t bytes_written = 0;
-	while (bytes_written < size)
-	{
-		int block_num = (offset + bytes_written) / BLOCK_SIZE;
-		int block_offset = (offset + bytes_written) % BLOCK_SIZE;
-		int space_in_block = BLOCK_SIZE - block_offset;
-		int bytes_to_write = space_in_block < (size - bytes_written) ? space_in_block : (size - bytes_written);
-		if (block_num >= 16)
-		{
-			perror("File size exceeds maximum file size");
-			free(data_bitmap);
-			return -1;
-		}
+	return file_write(&file_inode, buffer, size, offset);
+}
 
-		// Read the block from disk if partial write
-		if (block_offset != 0 || bytes_to_write < BLOCK_SIZE)
-		{
-			// printf("detect partial write, reading block %d\n", file_inode.direct_ptr[block_num]);
-			bio_read(file_inode.direct_ptr[block_num], temp_block);
-		}
-		else
+#if FUSE_VERSION >= 29
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct inode file_inode;
+
+	// the control file is generated in memory
+	if (strcmp(path, CTL_PATH) == 0)
+	{
+		struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+		if (!bufv)
+			return -ENOMEM;
+		*bufv = FUSE_BUFVEC_INIT(size);
+		bufv->buf[0].mem = malloc(size ? size : 1);
+		int ret = bufv->buf[0].mem ? rufs_read(path, bufv->buf[0].mem, size, offset, fi) : -ENOMEM;
+		if (ret < 0)
 		{
-			// allocate a new data block
-			int new_block_num = get_avail_blkno();
-			if (new_block_num < 0)
-			{
-				perror("Failed to get an available block for directory");
-				free(data_bitmap);
-				return -1;
-			}
-			file_inode.direct_ptr[block_num] = new_block_num;
-			// update inode size
-			// the reason using block_num+1 is that the offset might be greater than original
-			// file size, so we need to update the size to the offset
-			file_inode.size = block_num + 1;
+			free(bufv->buf[0].mem);
+			free(bufv);
+			return ret;
 		}
+		bufv->buf[0].size = ret;
+		*bufp = bufv;
+		return 0;
+	}
 
-		// Write the data from buffer to the temporary block
-		memcpy(temp_block + block_offset, buffer + bytes_written, bytes_to_write);
+	int success = resolve_path(path, &file_inode);
+	if (success < 0)
+		return -ENOENT;
+	int ret = file_read_buf(&file_inode, bufp, size, offset);
+	if (ret >= 0 && success == 0)
+		inode_accessed(&file_inode);
+	return ret;
+}
 
-		// printf("writing block %d\n", file_inode.direct_ptr[block_num]);
-		// Write the modified block back to disk
-		bio_write(file_inode.direct_ptr[block_num], temp_block);
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	struct inode file_inode;
 
-		// Update bytes_written
-		bytes_written += bytes_to_write;
-		free(data_bitmap);
+	// the control file and snapshots take the regular write path
+	if (strcmp(path, CTL_PATH) == 0 || snapshot_path(path, NULL, NULL) != 0)
+	{
+		size_t size = fuse_buf_size(buf);
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size ? size : 1);
+		if (!mem.buf[0].mem)
+			return -ENOMEM;
+		ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+		int ret = copied < 0 ? copied : rufs_write(path, mem.buf[0].mem, copied, offset, NULL);
+		free(mem.buf[0].mem);
+		return ret;
 	}
 
-	// Step 4: Update the inode info and write it to disk
-	writei(file_inode.ino, &file_inode);
-	// Note: this function should return the amount of bytes you write to disk
-	return bytes_written;
+	if (get_node_by_path(path, ROOT_INO, &file_inode) < 0)
+		return -ENOENT;
+	return file_write_buf(&file_inode, buf, offset);
 }
+#endif
 
 // skip this
 static int rufs_unlink(const char *path)
@@ -998,6 +3228,9 @@ static int rufs_unlink(const char *path)
 
 static int rufs_truncate(const char *path, off_t size)
 {
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
 	return 0;
@@ -1005,11 +3238,42 @@ static int rufs_truncate(const char *path, off_t size)
 
 static int rufs_release(const char *path, struct fuse_file_info *fi)
 {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	// blocks reserved past the end of a file go back when it is closed, times it owes get written
+	if (strcmp(path, CTL_PATH) != 0 && snapshot_path(path, NULL, NULL) == 0)
+	{
+		prealloc_trim(fi->fh);
+		if (lazy_flush(fi->fh) < 0)
+			return -EIO;
+	}
 	return 0;
 }
 
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	if (strcmp(path, CTL_PATH) == 0 || snapshot_path(path, NULL, NULL) != 0)
+		return 0;
+
+	// fdatasync() may leave the times behind, they are not needed to read the data back
+	if (!datasync && lazy_flush(fi->fh) < 0)
+		return -EIO;
+	return dev_sync() < 0 ? -EIO : 0;
+}
+
+#if FUSE_VERSION >= 29
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	if (strcmp(path, CTL_PATH) == 0)
+		return -EOPNOTSUPP;
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+
+	struct inode file_inode;
+	if (get_node_by_path(path, ROOT_INO, &file_inode) < 0)
+		return -ENOENT;
+	return file_fallocate(&file_inode, mode, offset, length);
+}
+#endif
+
 static int rufs_flush(const char *path, struct fuse_file_info *fi)
 {
 	// For this project, you don't need to fill this function
@@ -1019,41 +3283,139 @@ static int rufs_flush(const char *path, struct fuse_file_info *fi)
 
 static int rufs_utimens(const char *path, const struct timespec tv[2])
 {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	if (strcmp(path, CTL_PATH) == 0)
+		return 0;
+	if (snapshot_path(path, NULL, NULL) != 0)
+		return -EROFS;
+
+	struct inode inode;
+	if (get_node_by_path(path, ROOT_INO, &inode) < 0)
+		return -ENOENT;
+	return inode_set_times(&inode, tv);
 }
 
+/*
+ * Every callback is entered through a wrapper firing op_start and op_done
+ * (trace.h) around it, op_done carries the result. It also holds off RAM
+ * mode checkpoints while the operation runs, and writes expired lazy times
+ * before it.
+ */
+#define TRACED(op, params, args)			\
+	static int traced_##op params			\
+	{										\
+		TRACE2(op_start, #op, path);		\
+		dev_op_begin();						\
+		lazy_expire();						\
+		int ret = rufs_##op args;			\
+		dev_op_end();						\
+		TRACE3(op_done, #op, path, ret);	\
+		return ret;							\
+	}
+
+TRACED(getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+TRACED(opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+	   (path, buffer, filler, offset, fi))
+TRACED(releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(mkdir, (const char *path, mode_t mode), (path, mode))
+TRACED(rmdir, (const char *path), (path))
+TRACED(create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+TRACED(open, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(read, (const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+	   (path, buffer, size, offset, fi))
+TRACED(write, (const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+	   (path, buffer, size, offset, fi))
+#if FUSE_VERSION >= 29
+TRACED(read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi),
+	   (path, bufp, size, offset, fi))
+TRACED(write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi),
+	   (path, buf, offset, fi))
+TRACED(fallocate, (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+	   (path, mode, offset, length, fi))
+#endif
+TRACED(unlink, (const char *path), (path))
+TRACED(truncate, (const char *path, off_t size), (path, size))
+TRACED(flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(utimens, (const char *path, const struct timespec tv[2]), (path, tv))
+TRACED(release, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+
 static struct fuse_operations rufs_ope = {
 	.init = rufs_init,
 	.destroy = rufs_destroy,
 
-	.getattr = rufs_getattr,
-	.readdir = rufs_readdir,
-	.opendir = rufs_opendir,
-	.releasedir = rufs_releasedir,
-	.mkdir = rufs_mkdir,
-	.rmdir = rufs_rmdir,
+	.getattr = traced_getattr,
+	.readdir = traced_readdir,
+	.opendir = traced_opendir,
+	.releasedir = traced_releasedir,
+	.mkdir = traced_mkdir,
+	.rmdir = traced_rmdir,
+
+	.create = traced_create,
+	.open = traced_open,
+	.read = traced_read,
+	.write = traced_write,
+#if FUSE_VERSION >= 29
+	.read_buf = traced_read_buf,
+	.write_buf = traced_write_buf,
+	.fallocate = traced_fallocate,
+#endif
+	.unlink = traced_unlink,
+
+	.truncate = traced_truncate,
+	.flush = traced_flush,
+	.utimens = traced_utimens,
+	.release = traced_release,
+	.fsync = traced_fsync};
 
-	.create = rufs_create,
-	.open = rufs_open,
-	.read = rufs_read,
-	.write = rufs_write,
-	.unlink = rufs_unlink,
-
-	.truncate = rufs_truncate,
-	.flush = rufs_flush,
-	.utimens = rufs_utimens,
-	.release = rufs_release};
+/*
+ * Mount profile, inserted ahead of the user's options so those still win.
+ * Large requests with big_writes, and stable attributes the kernel may cache
+ * together with file pages.
+ */
+#define RUFS_PROFILE "-obig_writes,max_write=131072,max_read=131072"
+#define RUFS_PROFILE_HL "-okernel_cache,attr_timeout=1,entry_timeout=1"
+
+static const struct fuse_opt rufs_opts[] = {
+	{"compress", offsetof(struct rufs_options, compress), 1},
+	{"dedup", offsetof(struct rufs_options, dedup), 1},
+	{"lowlevel", offsetof(struct rufs_options, lowlevel), 1},
+	{"devices=%s", offsetof(struct rufs_options, devices), 0},
+	{"stripe_unit=%u", offsetof(struct rufs_options, stripe_unit), 0},
+	{"odirect", offsetof(struct rufs_options, odirect), 1},
+	{"fast=%s", offsetof(struct rufs_options, fast), 0},
+	{"fast_blocks=%u", offsetof(struct rufs_options, fast_blocks), 0},
+	{"size=%s", offsetof(struct rufs_options, size), 0},
+	{"ram", offsetof(struct rufs_options, ram), 1},
+	{"checkpoint=%u", offsetof(struct rufs_options, checkpoint), 0},
+	{"cbt", offsetof(struct rufs_options, cbt), 1},
+	{"lazytime=%u", offsetof(struct rufs_options, lazytime), 0},
+	FUSE_OPT_END};
 
 int main(int argc, char *argv[])
 {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	// pick out rufs's own -o options, the rest go to FUSE
+	if (fuse_opt_parse(&args, &opts, rufs_opts, NULL) == -1)
+		return 1;
+	if (opts.devices)
+		snprintf(diskfile_path, PATH_MAX, "%s", opts.devices);
+
+	// the low-level front end sets its timeouts and page caching per reply
+	fuse_opt_insert_arg(&args, 1, RUFS_PROFILE);
+	if (!opts.lowlevel)
+		fuse_opt_insert_arg(&args, 1, RUFS_PROFILE_HL);
+
+	if (opts.lowlevel)
+		fuse_stat = rufs_ll_main(&args);
+	else
+		fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
 
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
@@ -7,6 +7,11 @@
  */
 
 #include <linux/limits.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -18,12 +23,33 @@
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+#define ROOT_INO 0
+
 #define BLOCK_SIZE 4096
-#define INODE_SIZE sizeof(struct inode)
+#define INODE_SIZE sizeof(struct dinode)
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define INODE_BLOCKS ((MAX_INUM + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK)
 #define DIRENT_SIZE sizeof(struct dirent)
 #define DIRENTS_PER_BLOCK (BLOCK_SIZE / DIRENT_SIZE)
 
+#define REFS_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define REF_BLOCKS ((MAX_DNUM + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK)
+#define FP_BUCKETS 64									/* fingerprint index blocks */
+#define FP_PER_BUCKET (BLOCK_SIZE / sizeof(struct fp_entry))
+
+#define MAX_SNAPSHOTS (BLOCK_SIZE / sizeof(struct snapshot))
+
+#define NUM_DIRECT 16
+#define CLUSTER_BLKS 4									/* data blocks per compression cluster */
+#define CLUSTER_SIZE (CLUSTER_BLKS * BLOCK_SIZE)
+#define NUM_CLUSTERS (NUM_DIRECT / CLUSTER_BLKS)
+
+/* hidden control file and snapshot directory at the root */
+#define CTL_NAME ".rufs"
+#define SNAP_NAME ".snapshots"
+#define CTL_PATH "/" CTL_NAME
+#define SNAP_DIR "/" SNAP_NAME
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
 	uint16_t	max_inum;			/* maximum inode number */
@@ -34,19 +60,47 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	r_start_blk;		/* start block of data block reference counts */
+	uint32_t	f_start_blk;		/* start block of dedup fingerprint index */
+	uint32_t	s_table_blk;		/* block holding the snapshot table */
+	uint32_t	i_version;			/* on-disk inode format */
+	uint32_t	s_ndevs;			/* backing files the blocks are striped over */
+	uint32_t	s_stripe_unit;		/* stripe unit in blocks */
+	uint32_t	s_nblocks;			/* blocks the image holds now, 0 for max_dnum */
 };
 
+/* in-memory inode */
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
+	uint32_t	size;				/* size of the file in blocks */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
+	int			direct_ptr[NUM_DIRECT];	/* direct pointer to data block */
 	int			indirect_ptr[8];	/* indirect pointer to data block (not required to support indirect pointers) */
+	uint16_t	c_len[NUM_CLUSTERS];	/* compressed length of each cluster, 0 if stored raw */
+	uint64_t	bytes;				/* size of the file in bytes */
 	struct stat	vstat;				/* inode stat */
 };
 
+/* on-disk inode, see inode_encode()/inode_decode() */
+#define DINODE_VERSION 1
+
+struct dinode {
+	uint16_t	version;			/* DINODE_VERSION, 0 if the slot is free */
+	uint16_t	ino;				/* inode number */
+	uint32_t	mode;				/* file type and permission bits */
+	uint64_t	size;				/* size in bytes */
+	uint32_t	nlink;				/* link count */
+	uint16_t	c_len[NUM_CLUSTERS];	/* compressed length of each cluster, 0 if stored raw */
+	uint32_t	pad;
+	int64_t		mtime;				/* modification time, ns since the epoch */
+	int64_t		ctime;				/* status change time, ns since the epoch */
+	int32_t		direct_ptr[NUM_DIRECT];	/* data block of each file block, 0 for a hole */
+	int64_t		atime;				/* access time, ns since the epoch, 0 if never stored */
+	uint8_t		reserved[8];
+};
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -54,22 +108,229 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/* longest name a directory entry holds, longer ones get ENAMETOOLONG */
+#define DIRENT_NAME_MAX (sizeof(((struct dirent *)0)->name) - 1)
+
+/*
+ * a directory block ends with a one byte fingerprint of each entry's name (0
+ * for a free slot) in the space the entries leave, so a lookup compares names
+ * only where the fingerprint matches. Blocks written before the tail existed
+ * lack the magic and are scanned entry by entry until they are next written.
+ */
+#define DIR_TAIL_MAGIC 0x46524444
+
+struct dir_tail {
+	uint8_t fp[DIRENTS_PER_BLOCK];
+	uint8_t pad[BLOCK_SIZE - DIRENTS_PER_BLOCK * DIRENT_SIZE - DIRENTS_PER_BLOCK - sizeof(uint32_t)];
+	uint32_t magic;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct dir_tail) == BLOCK_SIZE - DIRENTS_PER_BLOCK * DIRENT_SIZE,
+			   "directory block tail must fill the space after the entries");
+
+struct fp_entry {
+	uint64_t fp;					/* fingerprint of the block contents */
+	uint32_t blkno;					/* data block holding them, 0 if the slot is empty */
+	uint32_t pad;
+};
+
+struct snapshot {
+	uint32_t id;					/* snapshot id, 0 if the slot is unused */
+	uint32_t ctime;					/* creation time */
+	uint32_t i_start_blk;			/* start block of the frozen inode table */
+	uint32_t pad;
+};
+
+/*
+ * delta stream written by rufs_export and read by rufs_apply: a header, then
+ * runs of blocks, each a delta_run followed by its blocks unless they are
+ * all zeros, and a run of count 0 at the end
+ */
+#define DELTA_MAGIC 0x52464453
+
+struct delta_header {
+	uint32_t magic;
+	uint32_t from_gen;				/* changes after this generation, 0 for the whole image */
+	uint32_t to_gen;				/* up to and including this one */
+	uint32_t nblocks;				/* blocks the image holds */
+	uint32_t ndevs;					/* backing files it is striped over */
+	uint32_t stripe_unit;
+};
+
+struct delta_run {
+	uint32_t start;					/* first block */
+	uint32_t count;					/* blocks in the run, 0 ends the stream */
+	uint32_t zero;					/* the blocks are zeros, none follow */
+	uint32_t pad;
+};
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * on-disk layout, everything after the bitmaps follows from the constants
+ * above (shared by rufs_mkfs and the offline tools), the stripe geometry is
+ * left to the caller
+ */
+static inline void sb_layout(struct superblock *sb) {
+	sb->magic_num = MAGIC_NUM;
+	sb->max_inum = MAX_INUM;
+	sb->max_dnum = MAX_DNUM;
+	sb->i_version = DINODE_VERSION;
+	sb->i_bitmap_blk = 1;
+	sb->d_bitmap_blk = 2;
+	sb->i_start_blk = sb->d_bitmap_blk + 1;
+	sb->r_start_blk = sb->i_start_blk + INODE_BLOCKS;
+	sb->f_start_blk = sb->r_start_blk + REF_BLOCKS;
+	sb->s_table_blk = sb->f_start_blk + FP_BUCKETS;
+	sb->d_start_blk = sb->s_table_blk + 1;
+}
+
+/*
+ * blocks the volume spans, images grow up to max_dnum as the bitmap and
+ * reference counts are sized for that many
+ */
+static inline int sb_nblocks(const struct superblock *sb) {
+	return sb->s_nblocks ? sb->s_nblocks : sb->max_dnum;
+}
+
+/*
+ * size in blocks from "N" bytes with an optional K, M or G suffix, -1 if
+ * malformed; sizes too large to count saturate rather than wrap, so callers
+ * reject them as beyond the limit
+ */
+static inline long long parse_size(const char *str) {
+	char *end;
+	long long size = strtoll(str, &end, 10);
+	int shift = 0;
+
+	switch (*end) {
+	case 'g': case 'G': shift += 10;	/* fall through */
+	case 'm': case 'M': shift += 10;	/* fall through */
+	case 'k': case 'K': shift += 10; end++;
+	}
+	if (size > (LLONG_MAX - BLOCK_SIZE) >> shift)
+		size = LLONG_MAX - BLOCK_SIZE;
+	else if (size > 0)
+		size <<= shift;
+	while (*end == '\n' || *end == ' ')
+		end++;
+	if (end == str || *end != '\0' || size <= 0)
+		return -1;
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*
+ * directory block fingerprints
+ */
+static inline struct dir_tail *dir_tail(void *block) {
+	return (struct dir_tail *)((char *)block + DIRENTS_PER_BLOCK * DIRENT_SIZE);
+}
+
+/* FNV-1a of the name folded to a byte, never 0 */
+static inline uint8_t name_fp(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return (uint8_t)h ? (uint8_t)h : 1;
+}
+
+/* recompute the tail of a directory block from its entries */
+static inline void dir_tail_build(void *block) {
+	struct dirent *dirents = (struct dirent *)block;
+	struct dir_tail *tail = dir_tail(block);
+
+	for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+		tail->fp[j] = dirents[j].valid == 1 ?
+			name_fp(dirents[j].name, strnlen(dirents[j].name, sizeof(dirents[j].name))) : 0;
+	memset(tail->pad, 0, sizeof(tail->pad));
+	tail->magic = DIR_TAIL_MAGIC;
+}
+
+/*
+ * shared by the path based (rufs.c) and inode based (rufs_ll.c) front ends
+ */
+struct fuse_args;
+struct fuse_bufvec;
+
+struct rufs_options {
+	int compress;					/* compress file data written during this mount */
+	int dedup;						/* share identical data blocks written during this mount */
+	int lowlevel;					/* serve the inode based low-level API */
+	char *devices;					/* backing files to stripe over, ':' separated */
+	int stripe_unit;				/* stripe unit in blocks for a new image */
+	int odirect;					/* bypass the host page cache for the backing files */
+	char *fast;						/* fast tier file for metadata and hot blocks */
+	int fast_blocks;				/* data block slots on the fast tier */
+	char *size;						/* initial size of a new image */
+	int ram;						/* serve the image from memory, checkpointing it */
+	int checkpoint;					/* seconds between checkpoints in RAM mode */
+	int cbt;						/* track changed blocks for rufs_export */
+	int lazytime;					/* seconds timestamp-only inode changes may wait in memory */
+};
+
+extern struct rufs_options opts;
+extern struct superblock sb;
+extern struct snapshot *snaps;
+extern time_t mount_time;
+
+typedef int (*dir_iter_t)(void *ctx, const struct dirent *dirent, off_t next);
+
+// last inode table block read, the children of a directory tend to share one
+struct inode_cache {
+	uint32_t i_start_blk;			/* inode table the block belongs to */
+	int block_num;					/* block held in block, -1 if none */
+	char *block;					/* scratch block */
+};
+
+void inode_decode(const struct dinode *dinode, struct inode *inode);
+void inode_encode(const struct inode *inode, struct dinode *dinode);
+void inode_touch(struct inode *inode);
+int readi_at(uint32_t i_start_blk, uint16_t ino, struct inode *inode);
+int readi(uint16_t ino, struct inode *inode);
+int inode_cache_init(struct inode_cache *cache, uint32_t i_start_blk);
+void inode_cache_release(struct inode_cache *cache);
+int readi_cached(struct inode_cache *cache, uint16_t ino, struct inode *inode);
+int writei(uint16_t ino, struct inode *inode);
+int writei_lazy(uint16_t ino, struct inode *inode);
+void inode_accessed(struct inode *inode);
+int inode_set_times(struct inode *inode, const struct timespec tv[2]);
+int lazy_flush(uint16_t ino);
+void lazy_flush_all();
+void lazy_expire();
+int dir_find_at(uint32_t i_start_blk, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_iterate(struct inode *dir_inode, off_t offset, dir_iter_t fn, void *ctx);
+int ctl_status(char *buf, size_t size);
+int ctl_command(const char *buffer, size_t size);
+
+void fill_stat(struct inode *inode, struct stat *stbuf, int read_only);
+int make_node(struct inode *parent_inode, const char *name, uint32_t type, struct inode *new_inode);
+int file_read(struct inode *inode, char *buffer, size_t size, off_t offset);
+int file_write(struct inode *inode, const char *buffer, size_t size, off_t offset);
+int file_fallocate(struct inode *inode, int mode, off_t offset, off_t length);
+void prealloc_trim(uint16_t ino);
+int file_read_buf(struct inode *inode, struct fuse_bufvec **bufp, size_t size, off_t offset);
+int file_write_buf(struct inode *inode, struct fuse_bufvec *buf, off_t offset);
+
+int rufs_setup();
+void rufs_teardown();
+int rufs_ll_main(struct fuse_args *args);
+
 #endif
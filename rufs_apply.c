@@ -0,0 +1,238 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_apply.c
+ *
+ *	Restore side of rufs_export, writes a delta stream read from standard
+ *	input into a copy of the image.
+ *	usage: rufs_apply [-n] [-f] DISKFILE[:DISKFILE...] < DELTA
+ *
+ *	A full delta creates the copy, or wipes the one given, and rebuilds it.
+ *	Incremental deltas are applied in the order they were exported, each to
+ *	the copy the one before it left: they only carry what changed, so
+ *	skipping one leaves a copy that mixes generations. The generation a
+ *	copy holds is kept next to its first file (DISKFILE.applied), written
+ *	once an apply is complete and removed while one is under way, and an
+ *	incremental delta that does not start from it is refused unless -f
+ *	(--force) is given. The copy is resized to the image's size. -n reads
+ *	the stream through and checks it without touching anything. The copy
+ *	must not be mounted.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define RUN_MAX 256							/* most blocks written at once */
+
+static char run_buf[RUN_MAX * BLOCK_SIZE] BLOCK_ALIGNED;
+static char applied_path[PATH_MAX];			/* first file of the copy + ".applied" */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n] [-f] DISKFILE[:DISKFILE...] < DELTA\n", prog);
+	exit(2);
+}
+
+// The generation the copy holds, -1 if none is recorded
+static long long applied_read()
+{
+	FILE *f = fopen(applied_path, "r");
+	unsigned gen;
+	int ok;
+
+	if (!f)
+		return -1;
+	ok = fscanf(f, "generation %u", &gen) == 1;
+	fclose(f);
+	return ok ? gen : -1;
+}
+
+// Record the generation the copy holds once it is on disk
+static int applied_write(uint32_t gen)
+{
+	FILE *f = fopen(applied_path, "w");
+
+	if (!f || fprintf(f, "generation %u\n", gen) < 0 || fflush(f) != 0 || fsync(fileno(f)) < 0)
+	{
+		perror(applied_path);
+		if (f)
+			fclose(f);
+		return -1;
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static int take(void *buf, size_t len)
+{
+	return fread(buf, 1, len, stdin) == len ? 0 : -1;
+}
+
+// count blocks from start, read from the stream unless they are zeros
+static int apply_run(int start, int count, int zero, int dry_run)
+{
+	struct iovec iov[RUN_MAX];
+
+	if (zero)
+		memset(run_buf, 0, sizeof(run_buf));
+	for (int done = 0; done < count; )
+	{
+		int n = count - done < RUN_MAX ? count - done : RUN_MAX;
+		if (!zero && take(run_buf, (size_t)n * BLOCK_SIZE) < 0)
+		{
+			fprintf(stderr, "Delta ends inside the run at block %d\n", start + done);
+			return -1;
+		}
+		if (!dry_run)
+		{
+			// zeros are punched where the host allows it and written where it does not
+			if (zero && bio_discard(start + done, n) == 0)
+			{
+				done += n;
+				continue;
+			}
+			for (int i = 0; i < n; i++)
+			{
+				iov[i].iov_base = run_buf + (size_t)i * BLOCK_SIZE;
+				iov[i].iov_len = BLOCK_SIZE;
+			}
+			if (bio_writev(start + done, iov, n) != n * BLOCK_SIZE)
+			{
+				fprintf(stderr, "Failed to write blocks %d-%d\n", start + done, start + done + n - 1);
+				return -1;
+			}
+		}
+		done += n;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct delta_header hdr;
+	struct delta_run run;
+	static const struct option longopts[] = {
+		{"dry-run", no_argument, NULL, 'n'},
+		{"force", no_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt, dry_run = 0, force = 0;
+
+	while ((opt = getopt_long(argc, argv, "nf", longopts, NULL)) != -1)
+	{
+		if (opt == 'n')
+			dry_run = 1;
+		else if (opt == 'f')
+			force = 1;
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	snprintf(applied_path, sizeof(applied_path), "%.*s.applied", (int)strcspn(argv[optind], ":"), argv[optind]);
+
+	// Step 1: the delta, and a copy laid out like the image it came from
+	if (take(&hdr, sizeof(hdr)) < 0 || hdr.magic != DELTA_MAGIC)
+	{
+		fprintf(stderr, "Not a rufs delta\n");
+		return 1;
+	}
+	if (hdr.nblocks == 0 || hdr.nblocks > MAX_DNUM)
+	{
+		fprintf(stderr, "Delta is for an image of %u blocks, at most %d are supported\n", hdr.nblocks, MAX_DNUM);
+		return 1;
+	}
+	int full = hdr.from_gen == 0;
+	long long held = applied_read();
+	if (!full && held != hdr.from_gen)
+	{
+		if (held < 0)
+			fprintf(stderr, "%s: no generation recorded for the copy, the delta starts after %u\n", argv[optind],
+					hdr.from_gen);
+		else
+			fprintf(stderr, "%s: the copy holds generation %lld, the delta starts after %u\n", argv[optind], held,
+					hdr.from_gen);
+		if (!force)
+		{
+			fprintf(stderr, "Apply the deltas in order, or use -f to apply this one anyway\n");
+			return 1;
+		}
+	}
+	if (!dry_run)
+	{
+		dev_stripe_unit(hdr.stripe_unit);
+		if (full)
+			dev_init(argv[optind]);
+		else if (dev_open(argv[optind]) < 0)
+		{
+			fprintf(stderr, "%s: an incremental delta needs the copy it applies to\n", argv[optind]);
+			return 1;
+		}
+		int ndevs, stripe_unit;
+		dev_geometry(&ndevs, &stripe_unit);
+		if (hdr.ndevs > 1 && (int)hdr.ndevs != ndevs)
+		{
+			fprintf(stderr, "Image is striped over %u files, %d given\n", hdr.ndevs, ndevs);
+			return 1;
+		}
+		// until the apply is complete the copy holds no generation in particular
+		if (unlink(applied_path) < 0 && errno != ENOENT)
+		{
+			perror(applied_path);
+			return 1;
+		}
+		// a full delta starts from nothing, anything not in it is zeros
+		if ((full && dev_resize(0) < 0) || dev_resize(hdr.nblocks) < 0)
+			return 1;
+	}
+
+	// Step 2: every run, up to the one that ends the stream
+	int runs = 0, blocks = 0;
+	for (;;)
+	{
+		if (take(&run, sizeof(run)) < 0)
+		{
+			fprintf(stderr, "Delta ends early%s\n", dry_run ? "" : ", the copy is half updated");
+			return 1;
+		}
+		if (run.count == 0)
+			break;
+		if (run.start >= hdr.nblocks || run.count > hdr.nblocks - run.start)
+		{
+			fprintf(stderr, "Run of %u blocks at %u is past the image\n", run.count, run.start);
+			return 1;
+		}
+		if (apply_run(run.start, run.count, run.zero, dry_run) < 0)
+			return 1;
+		runs++;
+		blocks += run.count;
+	}
+	if (!dry_run)
+	{
+		if (dev_sync() < 0)
+		{
+			fprintf(stderr, "Failed to sync %s\n", argv[optind]);
+			return 1;
+		}
+		dev_close();
+		if (applied_write(hdr.to_gen) < 0)
+			return 1;
+	}
+
+	if (full)
+		printf("%s: generation %u in full, %d blocks in %d runs%s\n", argv[optind], hdr.to_gen, blocks, runs,
+			   dry_run ? " (not written)" : "");
+	else
+		printf("%s: generation %u to %u, %d blocks in %d runs%s\n", argv[optind], hdr.from_gen, hdr.to_gen,
+			   blocks, runs, dry_run ? " (not written)" : "");
+	return 0;
+}
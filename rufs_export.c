@@ -0,0 +1,180 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_export.c
+ *
+ *	Incremental backup, writes the blocks changed since a generation to
+ *	standard output as a delta stream for rufs_apply.
+ *	usage: rufs_export [-s GENERATION] DISKFILE[:DISKFILE...] > DELTA
+ *
+ *	Generations come from changed block tracking: mount with -o cbt once
+ *	and every checkpoint after that stamps the blocks it wrote. Without -s,
+ *	or when the tracking cannot vouch for changes that far back (a crash
+ *	starts it over), the whole image goes out and rufs_apply rebuilds the
+ *	copy from scratch. Runs of zeros take no room in the stream. The
+ *	generation exported up to is reported on standard error, it is the -s
+ *	of the next export. The image must not be mounted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define RUN_MAX 256							/* most blocks in one run */
+
+struct superblock sb;
+
+static char run_buf[(RUN_MAX + 1) * BLOCK_SIZE] BLOCK_ALIGNED;	/* a run and the block after it */
+static const char zero_block[BLOCK_SIZE];
+static unsigned char changed[(MAX_DNUM + 7) / 8];
+static long long bytes_out;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s GENERATION] DISKFILE[:DISKFILE...] > DELTA\n", prog);
+	exit(2);
+}
+
+static int emit(const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, stdout) != len)
+	{
+		perror("Failed to write delta");
+		return -1;
+	}
+	bytes_out += len;
+	return 0;
+}
+
+// One run, its blocks follow unless they are zeros
+static int emit_run(int start, int count, int zero)
+{
+	struct delta_run run = {.start = start, .count = count, .zero = zero};
+
+	if (count == 0)
+		return 0;
+	if (emit(&run, sizeof(run)) < 0)
+		return -1;
+	return zero ? 0 : emit(run_buf, (size_t)count * BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+	long long since = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1)
+	{
+		if (opt == 's')
+			since = atoll(optarg);
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 1 || since < 0)
+		usage(argv[0]);
+	if (isatty(STDOUT_FILENO))
+	{
+		fprintf(stderr, "%s: refusing to write a delta to a terminal\n", argv[0]);
+		return 2;
+	}
+
+	// Step 1: superblock, and the stripe geometry it records
+	if (dev_open(argv[optind]) < 0)
+		return 1;
+	if (bio_read(0, block) <= 0)
+	{
+		fprintf(stderr, "Failed to read superblock\n");
+		return 1;
+	}
+	memcpy(&sb, block, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM)
+	{
+		fprintf(stderr, "Bad magic number %#x, not a rufs image\n", sb.magic_num);
+		return 1;
+	}
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	if (sb.s_ndevs > 1 && sb.s_ndevs != ndevs)
+	{
+		fprintf(stderr, "Image is striped over %u files, %d given\n", sb.s_ndevs, ndevs);
+		return 1;
+	}
+	dev_stripe_unit(sb.s_stripe_unit);
+	int nblocks = sb_nblocks(&sb);
+
+	// Step 2: which blocks go out, all of them for a full export
+	struct cbt_stats cs = {0};
+	int count;
+	int tracked = dev_cbt_stats(&cs) == 0;
+	if (since > 0 && !tracked)
+	{
+		fprintf(stderr, "%s: changed blocks are not tracked, mount with -o cbt first\n", argv[optind]);
+		return 1;
+	}
+	if (since > cs.generation)
+	{
+		fprintf(stderr, "%s: generation %lld is ahead of the image, which is at %u\n", argv[optind], since,
+				cs.generation);
+		return 1;
+	}
+	int full = since == 0 || since < cs.base;
+	if (full)
+	{
+		memset(changed, 0xff, sizeof(changed));
+		count = nblocks;
+	}
+	else
+		count = dev_cbt_since(since, changed, nblocks);
+
+	// Step 3: the stream, runs cut where a block is unchanged or turns to or from zeros
+	struct delta_header hdr = {.magic = DELTA_MAGIC, .from_gen = full ? 0 : since, .to_gen = cs.generation,
+							   .nblocks = nblocks, .ndevs = sb.s_ndevs, .stripe_unit = sb.s_stripe_unit};
+	if (emit(&hdr, sizeof(hdr)) < 0)
+		return 1;
+	int start = 0, len = 0, zero = 0, zeros = 0;
+	for (int b = 0; b < nblocks; b++)
+	{
+		if (!get_bitmap(changed, b))
+			continue;
+		char *p = run_buf + (size_t)len * BLOCK_SIZE;
+		if (bio_read(b, p) < 0)
+		{
+			fprintf(stderr, "Failed to read block %d\n", b);
+			return 1;
+		}
+		int is_zero = memcmp(p, zero_block, BLOCK_SIZE) == 0;
+		if (len > 0 && (b != start + len || is_zero != zero || len == RUN_MAX))
+		{
+			// this block starts the next run, it was read into the wrong place
+			if (emit_run(start, len, zero) < 0)
+				return 1;
+			memmove(run_buf, p, BLOCK_SIZE);
+			len = 0;
+		}
+		if (len == 0)
+		{
+			start = b;
+			zero = is_zero;
+		}
+		len++;
+		zeros += is_zero;
+	}
+	struct delta_run end = {0};
+	if (emit_run(start, len, zero) < 0 || emit(&end, sizeof(end)) < 0 || fflush(stdout) != 0)
+		return 1;
+	dev_close();
+
+	if (full)
+		fprintf(stderr, "%s: generation %u, all %d blocks (%d zeros), %lld bytes written\n", argv[optind],
+				cs.generation, nblocks, zeros, bytes_out);
+	else
+		fprintf(stderr, "%s: generation %u, %d of %d blocks changed since %lld (%d zeros), %lld bytes written\n",
+				argv[optind], cs.generation, count, nblocks, since, zeros, bytes_out);
+	return 0;
+}
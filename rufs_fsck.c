@@ -0,0 +1,688 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_fsck.c
+ *
+ *	Offline consistency check and repair of a DISKFILE.
+ *	usage: rufs_fsck [-n] [-j threads] DISKFILE[:DISKFILE...]
+ *
+ *	The inode tables (the live one and every snapshot's) are split into
+ *	contiguous block ranges, one per thread. Each thread validates the inodes
+ *	in its range and collects the entries of live directories, the live tree
+ *	is then walked from ROOT_INO, and the threads count the data block
+ *	references of every inode that survived. The reference count blocks and
+ *	both bitmaps are reconciled against those counts.
+ *
+ *	Exit status: 0 clean, 1 errors corrected, 4 errors left uncorrected,
+ *	8 operational error.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define FSCK_CLEAN 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_ERROR 8
+
+// an inode table, kept in memory for the whole check
+struct table {
+	uint32_t i_start_blk;			/* first block of the table */
+	int live;						/* the live table, otherwise a snapshot's */
+	struct dinode *inodes;			/* MAX_INUM on-disk inodes */
+	char dirty[INODE_BLOCKS];		/* blocks changed in memory */
+};
+
+// a directory entry of the live tree
+struct edge {
+	uint16_t parent;				/* directory holding the entry */
+	uint16_t child;					/* inode it names */
+	int blkno;						/* directory block holding it */
+	int slot;						/* index in that block */
+};
+
+// one thread's share, blocks [first, last) of all tables taken end to end
+struct worker {
+	pthread_t thread;
+	int id;
+	int first;
+	int last;
+	struct edge *edges;				/* live directory entries found */
+	int nedges;
+	int cap;
+	int problems;					/* inodes repaired in memory */
+	int failed;						/* an I/O or allocation error */
+};
+
+struct superblock sb;
+struct snapshot *snaps;
+static struct table tables[1 + MAX_SNAPSHOTS];
+static int ntables;
+
+static struct worker *workers;
+static int nworkers;
+
+// entries of each live directory, a slice of one worker's edge list
+static struct {
+	int worker;
+	int start;
+	int count;
+} dir_edges[MAX_INUM];
+
+static uint32_t want_refs[MAX_DNUM];	/* data block references found */
+static char reachable[MAX_INUM];
+
+static int read_only;
+static int fixed, unfixed;
+
+// Print one problem, repairable is set when the check knows how to fix it
+static void report(int repairable, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (repairable && !read_only)
+	{
+		printf(", fixed\n");
+		fixed++;
+	}
+	else
+	{
+		printf(repairable ? ", not fixed (-n)\n" : ", not fixed\n");
+		unfixed++;
+	}
+}
+
+/*
+ * Phase 1: load and validate the inodes of a range of table blocks.
+ * Problems confined to one inode are repaired in memory right away.
+ */
+static void check_inode(struct worker *w, struct table *t, int ino)
+{
+	struct dinode *d = &t->inodes[ino];
+	int blk = ino / INODES_PER_BLOCK;
+
+	if (d->version == 0)
+		return;
+	if (d->version != DINODE_VERSION || ((d->mode & S_IFMT) != S_IFDIR && (d->mode & S_IFMT) != S_IFREG))
+	{
+		printf("table %u: inode %d has version %u mode %o, clearing it\n", t->i_start_blk, ino, d->version, d->mode);
+		memset(d, 0, sizeof(struct dinode));
+		t->dirty[blk] = 1;
+		w->problems++;
+		return;
+	}
+	if (d->ino != ino)
+	{
+		printf("table %u: inode %d records number %u, correcting it\n", t->i_start_blk, ino, d->ino);
+		d->ino = ino;
+		t->dirty[blk] = 1;
+		w->problems++;
+	}
+	if (d->size > (uint64_t)NUM_DIRECT * BLOCK_SIZE)
+	{
+		printf("table %u: inode %d size %llu is beyond the largest file, clamping it\n",
+			   t->i_start_blk, ino, (unsigned long long)d->size);
+		d->size = (uint64_t)NUM_DIRECT * BLOCK_SIZE;
+		t->dirty[blk] = 1;
+		w->problems++;
+	}
+	for (int k = 0; k < NUM_DIRECT; k++)
+	{
+		int blkno = d->direct_ptr[k];
+		if (blkno == 0 || (blkno >= sb.d_start_blk && blkno < sb_nblocks(&sb)))
+			continue;
+		printf("table %u: inode %d block %d points at %d outside the data region, dropping it\n",
+			   t->i_start_blk, ino, k, blkno);
+		d->direct_ptr[k] = 0;
+		t->dirty[blk] = 1;
+		w->problems++;
+	}
+}
+
+static int add_edge(struct worker *w, uint16_t parent, uint16_t child, int blkno, int slot)
+{
+	if (w->nedges == w->cap)
+	{
+		int cap = w->cap ? w->cap * 2 : 256;
+		struct edge *edges = (struct edge *)realloc(w->edges, cap * sizeof(struct edge));
+		if (!edges)
+			return -1;
+		w->edges = edges;
+		w->cap = cap;
+	}
+	w->edges[w->nedges].parent = parent;
+	w->edges[w->nedges].child = child;
+	w->edges[w->nedges].blkno = blkno;
+	w->edges[w->nedges].slot = slot;
+	w->nedges++;
+	return 0;
+}
+
+// Record the valid entries of a live directory
+static int collect_entries(struct worker *w, const struct dinode *d, int ino)
+{
+	struct dirent dirent_block[DIRENTS_PER_BLOCK + 1];	/* bio_read fills a whole block */
+	int nblocks = (d->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	dir_edges[ino].worker = w->id;
+	dir_edges[ino].start = w->nedges;
+	for (int k = 0; k < nblocks; k++)
+	{
+		int blkno = d->direct_ptr[k];
+		if (blkno == 0)
+			continue;
+		if (bio_read(blkno, dirent_block) < 0)
+			return -1;
+		for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
+		{
+			if (dirent_block[j].valid == 1 && add_edge(w, ino, dirent_block[j].ino, blkno, j) < 0)
+				return -1;
+		}
+	}
+	dir_edges[ino].count = w->nedges - dir_edges[ino].start;
+	return 0;
+}
+
+static void *load_range(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+
+	for (int u = w->first; u < w->last; u++)
+	{
+		struct table *t = &tables[u / INODE_BLOCKS];
+		int blk = u % INODE_BLOCKS;
+		struct dinode *inode_block = &t->inodes[blk * INODES_PER_BLOCK];
+
+		if (bio_read(t->i_start_blk + blk, inode_block) < 0)
+		{
+			w->failed = 1;
+			return NULL;
+		}
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			int ino = blk * INODES_PER_BLOCK + j;
+			if (ino >= MAX_INUM)
+				break;
+			check_inode(w, t, ino);
+			if (t->live && t->inodes[ino].version != 0 && (t->inodes[ino].mode & S_IFMT) == S_IFDIR &&
+				collect_entries(w, &t->inodes[ino], ino) < 0)
+			{
+				w->failed = 1;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Phase 3: count the data block references of a range of table blocks
+ */
+static void *count_range(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+
+	for (int u = w->first; u < w->last; u++)
+	{
+		struct table *t = &tables[u / INODE_BLOCKS];
+		int blk = u % INODE_BLOCKS;
+
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			int ino = blk * INODES_PER_BLOCK + j;
+			if (ino >= MAX_INUM)
+				break;
+			struct dinode *d = &t->inodes[ino];
+			if (d->version == 0)
+				continue;
+			for (int k = 0; k < NUM_DIRECT; k++)
+			{
+				if (d->direct_ptr[k] != 0)
+					__atomic_fetch_add(&want_refs[d->direct_ptr[k]], 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Run fn over all table blocks, split into one contiguous range per thread
+static int run_workers(void *(*fn)(void *))
+{
+	int total = ntables * INODE_BLOCKS;
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		workers[i].first = (long)total * i / nworkers;
+		workers[i].last = (long)total * (i + 1) / nworkers;
+		if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0)
+		{
+			perror("Failed to start fsck thread");
+			for (int j = 0; j < i; j++)
+				pthread_join(workers[j].thread, NULL);
+			return -1;
+		}
+	}
+	int ret = 0;
+	for (int i = 0; i < nworkers; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].failed)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Superblock and snapshot table
+ */
+static int check_superblock()
+{
+	char block[BLOCK_SIZE];
+
+	if (bio_read(0, block) <= 0)
+	{
+		fprintf(stderr, "Failed to read superblock\n");
+		return -1;
+	}
+	memcpy(&sb, block, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM)
+	{
+		fprintf(stderr, "Bad magic number %#x, not a rufs image\n", sb.magic_num);
+		return -1;
+	}
+	if (sb.i_version != DINODE_VERSION)
+	{
+		fprintf(stderr, "Inode format %u, this fsck understands %u\n", sb.i_version, DINODE_VERSION);
+		return -1;
+	}
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	if (sb.s_ndevs > 1 && sb.s_ndevs != ndevs)
+	{
+		fprintf(stderr, "Image is striped over %u files, %d given\n", sb.s_ndevs, ndevs);
+		return -1;
+	}
+	dev_stripe_unit(sb.s_stripe_unit);
+
+	// everything else follows from the constants, as laid out by rufs_mkfs
+	struct superblock want = sb;
+	sb_layout(&want);
+	if (memcmp(&want, &sb, sizeof(sb)) != 0)
+	{
+		report(1, "superblock layout does not match the format");
+		sb = want;
+		if (!read_only)
+		{
+			memcpy(block, &sb, sizeof(sb));
+			bio_write(0, block);
+		}
+	}
+	// a grown or shrunk image spans anything from just past the metadata up to max_dnum
+	if (sb.s_nblocks != 0 && (sb.s_nblocks <= sb.d_start_blk || sb.s_nblocks > sb.max_dnum))
+	{
+		report(1, "superblock size %u blocks is outside %u-%u", sb.s_nblocks, sb.d_start_blk + 1, sb.max_dnum);
+		sb.s_nblocks = 0;
+		if (!read_only)
+		{
+			memcpy(block, &sb, sizeof(sb));
+			bio_write(0, block);
+		}
+	}
+	return 0;
+}
+
+static int load_tables()
+{
+	snaps = (struct snapshot *)malloc(BLOCK_SIZE);
+	if (!snaps || bio_read(sb.s_table_blk, snaps) < 0)
+	{
+		perror("Failed to read snapshot table");
+		return -1;
+	}
+
+	tables[0].i_start_blk = sb.i_start_blk;
+	tables[0].live = 1;
+	ntables = 1;
+	int dirty = 0;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snaps[i].id == 0)
+			continue;
+		if (snaps[i].i_start_blk < sb.d_start_blk || snaps[i].i_start_blk + INODE_BLOCKS > sb_nblocks(&sb))
+		{
+			report(1, "snapshot %u: inode table at %u is outside the data region, dropping the snapshot",
+				   snaps[i].id, snaps[i].i_start_blk);
+			memset(&snaps[i], 0, sizeof(struct snapshot));
+			dirty = 1;
+			continue;
+		}
+		tables[ntables].i_start_blk = snaps[i].i_start_blk;
+		ntables++;
+	}
+	if (dirty && !read_only)
+		bio_write(sb.s_table_blk, snaps);
+
+	for (int i = 0; i < ntables; i++)
+	{
+		tables[i].inodes = (struct dinode *)calloc(INODE_BLOCKS * INODES_PER_BLOCK, sizeof(struct dinode));
+		if (!tables[i].inodes)
+		{
+			perror("Failed to allocate inode table");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Phase 2: walk the live tree from ROOT_INO
+ */
+static int walk_tree()
+{
+	struct table *live = &tables[0];
+	uint16_t *queue = (uint16_t *)malloc(MAX_INUM * sizeof(uint16_t));
+	int head = 0, tail = 0;
+
+	if (!queue)
+	{
+		perror("Failed to allocate walk queue");
+		return -1;
+	}
+	if (live->inodes[ROOT_INO].version == 0 || (live->inodes[ROOT_INO].mode & S_IFMT) != S_IFDIR)
+	{
+		report(0, "root directory is missing");
+		free(queue);
+		return -1;
+	}
+
+	reachable[ROOT_INO] = 1;
+	queue[tail++] = ROOT_INO;
+	while (head < tail)
+	{
+		int ino = queue[head++];
+		if ((live->inodes[ino].mode & S_IFMT) != S_IFDIR)
+			continue;
+
+		for (int i = 0; i < dir_edges[ino].count; i++)
+		{
+			struct edge *e = &workers[dir_edges[ino].worker].edges[dir_edges[ino].start + i];
+			if (e->child >= MAX_INUM || live->inodes[e->child].version == 0)
+			{
+				e->child = MAX_INUM;	/* dangling, handled in reconcile_dirents */
+				continue;
+			}
+			if (reachable[e->child])
+				continue;
+			reachable[e->child] = 1;
+			queue[tail++] = e->child;
+		}
+	}
+	free(queue);
+
+	// valid inodes nothing points to, e.g. from an interrupted create
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		if (live->inodes[ino].version == 0 || reachable[ino])
+			continue;
+		report(1, "inode %d is not reachable from the root, clearing it", ino);
+		memset(&live->inodes[ino], 0, sizeof(struct dinode));
+		live->dirty[ino / INODES_PER_BLOCK] = 1;
+	}
+	return 0;
+}
+
+/*
+ * Phase 4: reconcile on-disk state with what the check found
+ */
+
+// Drop directory entries naming inodes that do not exist
+static void reconcile_dirents()
+{
+	struct dirent dirent_block[DIRENTS_PER_BLOCK + 1];	/* bio_read fills a whole block */
+
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		if (!reachable[ino] || (tables[0].inodes[ino].mode & S_IFMT) != S_IFDIR)
+			continue;
+		for (int i = 0; i < dir_edges[ino].count; i++)
+		{
+			struct edge *e = &workers[dir_edges[ino].worker].edges[dir_edges[ino].start + i];
+			if (e->child != MAX_INUM)
+				continue;
+			// a block shared with a snapshot is part of it and stays as it is
+			int shared = want_refs[e->blkno] > 1;
+			report(!shared, "directory %d: entry %d in block %d names a missing inode%s",
+				   ino, e->slot, e->blkno, shared ? " (block shared with a snapshot)" : "");
+			if (shared || read_only || bio_read(e->blkno, dirent_block) < 0)
+				continue;
+			memset(&dirent_block[e->slot], 0, sizeof(struct dirent));
+			dir_tail_build(dirent_block);
+			bio_write(e->blkno, dirent_block);
+		}
+	}
+}
+
+// Rebuild name fingerprints that disagree with the entries, lookups would miss those
+static void reconcile_dir_tails()
+{
+	char block[BLOCK_SIZE], want[BLOCK_SIZE];
+	static unsigned char seen[MAX_DNUM / 8];
+
+	for (int i = 0; i < ntables; i++)
+	{
+		for (int ino = 0; ino < MAX_INUM; ino++)
+		{
+			const struct dinode *d = &tables[i].inodes[ino];
+			if (d->version == 0 || (d->mode & S_IFMT) != S_IFDIR)
+				continue;
+			int nblocks = (d->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			for (int k = 0; k < nblocks && k < NUM_DIRECT; k++)
+			{
+				int blkno = d->direct_ptr[k];
+				if (blkno < (int)sb.d_start_blk || blkno >= MAX_DNUM || get_bitmap(seen, blkno))
+					continue;
+				set_bitmap(seen, blkno);
+				// blocks from before the tail existed are scanned in full
+				if (bio_read(blkno, block) < 0 || dir_tail(block)->magic != DIR_TAIL_MAGIC)
+					continue;
+				memcpy(want, block, BLOCK_SIZE);
+				dir_tail_build(want);
+				if (memcmp(want, block, BLOCK_SIZE) == 0)
+					continue;
+				// the tail only mirrors the entries, a shared block can be fixed in place
+				report(1, "directory %d: block %d has stale name fingerprints", ino, blkno);
+				if (!read_only)
+					bio_write(blkno, want);
+			}
+		}
+	}
+}
+
+static void reconcile_inode_bitmap()
+{
+	unsigned char bitmap[BLOCK_SIZE];
+
+	if (bio_read(sb.i_bitmap_blk, bitmap) < 0)
+		return;
+	int dirty = 0;
+	for (int ino = 0; ino < MAX_INUM; ino++)
+	{
+		int want = tables[0].inodes[ino].version != 0;
+		if (get_bitmap(bitmap, ino) == want)
+			continue;
+		report(1, "inode %d is %s but marked %s in the inode bitmap", ino,
+			   want ? "in use" : "free", want ? "free" : "in use");
+		if (want)
+			set_bitmap(bitmap, ino);
+		else
+			unset_bitmap(bitmap, ino);
+		dirty = 1;
+	}
+	if (dirty && !read_only)
+		bio_write(sb.i_bitmap_blk, bitmap);
+}
+
+static void reconcile_blocks()
+{
+	unsigned char bitmap[BLOCK_SIZE];
+	uint16_t *refs = (uint16_t *)malloc(REF_BLOCKS * BLOCK_SIZE);
+	char dirty[REF_BLOCKS];
+	int bitmap_dirty = 0;
+
+	memset(dirty, 0, sizeof(dirty));
+	if (!refs || bio_read(sb.d_bitmap_blk, bitmap) < 0)
+	{
+		free(refs);
+		return;
+	}
+	for (int i = 0; i < REF_BLOCKS; i++)
+		bio_read(sb.r_start_blk + i, (char *)refs + i * BLOCK_SIZE);
+
+	for (int b = 0; b < MAX_DNUM; b++)
+	{
+		uint32_t want = want_refs[b];
+		if (want > UINT16_MAX)
+		{
+			report(0, "block %d has %u references, more than a count can hold", b, want);
+			want = UINT16_MAX;
+		}
+		if (get_bitmap(bitmap, b) != (want > 0))
+		{
+			report(1, want ? "block %d is in use but marked free in the data bitmap"
+						   : "block %d is not referenced but marked in use in the data bitmap (leaked)", b);
+			if (want)
+				set_bitmap(bitmap, b);
+			else
+				unset_bitmap(bitmap, b);
+			bitmap_dirty = 1;
+		}
+		if (refs[b] != want)
+		{
+			report(1, "block %d has reference count %u, found %u references", b, refs[b], want);
+			refs[b] = want;
+			dirty[b / REFS_PER_BLOCK] = 1;
+		}
+	}
+
+	if (!read_only)
+	{
+		if (bitmap_dirty)
+			bio_write(sb.d_bitmap_blk, bitmap);
+		for (int i = 0; i < REF_BLOCKS; i++)
+		{
+			if (dirty[i])
+				bio_write(sb.r_start_blk + i, (char *)refs + i * BLOCK_SIZE);
+		}
+	}
+	free(refs);
+}
+
+static void write_tables()
+{
+	for (int i = 0; i < ntables; i++)
+	{
+		for (int b = 0; b < INODE_BLOCKS; b++)
+		{
+			if (tables[i].dirty[b] && !read_only)
+				bio_write(tables[i].i_start_blk + b, &tables[i].inodes[b * INODES_PER_BLOCK]);
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n] [-j threads] DISKFILE[:DISKFILE...]\n", prog);
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "nj:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			read_only = 1;
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	if (nworkers < 1)
+		nworkers = 1;
+
+	// Step 1: superblock and the list of inode tables
+	if (dev_open(argv[optind]) < 0)
+		return FSCK_ERROR;
+	if (check_superblock() < 0 || load_tables() < 0)
+		return FSCK_ERROR;
+	if (nworkers > ntables * INODE_BLOCKS)
+		nworkers = ntables * INODE_BLOCKS;
+	workers = (struct worker *)calloc(nworkers, sizeof(struct worker));
+	if (!workers)
+		return FSCK_ERROR;
+	for (int i = 0; i < nworkers; i++)
+		workers[i].id = i;
+
+	// Step 2: load and validate all inodes, collecting live directory entries
+	if (run_workers(load_range) < 0)
+	{
+		fprintf(stderr, "Failed to read the inode tables\n");
+		return FSCK_ERROR;
+	}
+	for (int i = 0; i < nworkers; i++)
+	{
+		fixed += read_only ? 0 : workers[i].problems;
+		unfixed += read_only ? workers[i].problems : 0;
+	}
+
+	// Step 3: walk the live tree, clearing what cannot be reached
+	if (walk_tree() < 0)
+		return FSCK_UNFIXED;
+
+	// Step 4: count references, metadata and snapshot inode tables hold one each
+	for (int b = 0; b < sb.d_start_blk; b++)
+		want_refs[b] = 1;
+	for (int i = 1; i < ntables; i++)
+	{
+		for (int b = 0; b < INODE_BLOCKS; b++)
+			want_refs[tables[i].i_start_blk + b]++;
+	}
+	if (run_workers(count_range) < 0)
+		return FSCK_ERROR;
+
+	// Step 5: bring the image in line
+	reconcile_dirents();
+	reconcile_dir_tails();
+	reconcile_inode_bitmap();
+	reconcile_blocks();
+	write_tables();
+	if (!read_only)
+		dev_sync();
+	dev_close();
+
+	printf("%s: %d inode tables, %d threads, %d problems fixed, %d not fixed\n",
+		   argv[optind], ntables, nworkers, fixed, unfixed);
+	if (unfixed)
+		return FSCK_UNFIXED;
+	return fixed ? FSCK_FIXED : FSCK_CLEAN;
+}
@@ -0,0 +1,709 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	rufs_ll.c
+ *
+ *	Inode based front end on the FUSE low-level API (mount with -o lowlevel).
+ *	The kernel resolves paths one component at a time through lookup() and
+ *	caches the result, every other operation gets an inode number, so steady
+ *	state requests do no path parsing at all.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "block.h"
+#include "rufs.h"
+#include "scratch.h"
+#include "trace.h"
+
+/*
+ * FUSE inode numbers
+ * Live inodes are ino + 1 (so ROOT_INO is FUSE_ROOT_ID). Inodes inside a
+ * snapshot carry the snapshot table slot + 1 above LL_SNAP_SHIFT, the control
+ * file and the snapshot directory get numbers past MAX_INUM.
+ */
+#define LL_SNAP_SHIFT 16
+#define LL_INO(slot, ino) ((((fuse_ino_t)(slot) + 1) << LL_SNAP_SHIFT) | ((ino) + 1))
+#define LL_CTL_INO (MAX_INUM + 1)
+#define LL_SNAPDIR_INO (MAX_INUM + 2)
+
+// how long the kernel may cache entries and attributes, in seconds
+#define LL_TIMEOUT 1.0
+
+/* setattr bits asking for the time now, FUSE 2.9 and later */
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+#define LL_SET_ATTR_NOW (FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)
+#else
+#define LL_SET_ATTR_NOW 0
+#endif
+
+// Map a FUSE inode number to a live inode (slot -1) or snapshot table slot
+static int ll_split(fuse_ino_t fino, int *slot, uint16_t *ino)
+{
+	fuse_ino_t low = fino & ((1 << LL_SNAP_SHIFT) - 1);
+	int s = (int)(fino >> LL_SNAP_SHIFT) - 1;
+
+	if (low == 0 || low > MAX_INUM || s >= (int)MAX_SNAPSHOTS)
+		return -ENOENT;
+	if (s >= 0 && snaps[s].id == 0)
+		return -ENOENT;
+	*slot = s;
+	*ino = low - 1;
+	return 0;
+}
+
+// Read the inode behind a FUSE inode number, returns 1 for snapshot (read-only) inodes
+static int ll_inode(fuse_ino_t fino, struct inode *inode, int *slot)
+{
+	uint16_t ino;
+
+	if (ll_split(fino, slot, &ino) < 0)
+		return -ENOENT;
+	if (readi_at(*slot < 0 ? sb.i_start_blk : snaps[*slot].i_start_blk, ino, inode) < 0 || inode->valid != 1)
+		return -ENOENT;
+	return *slot >= 0;
+}
+
+// Attributes of the control file and the snapshot directory
+static void ll_special_stat(fuse_ino_t fino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = fino;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_nlink = fino == LL_CTL_INO ? 1 : 2;
+	stbuf->st_mode = fino == LL_CTL_INO ? S_IFREG | 0644 : S_IFDIR | 0555;
+	stbuf->st_mtime = mount_time;
+}
+
+static int ll_stat(fuse_ino_t fino, struct stat *stbuf)
+{
+	struct inode inode;
+	int slot;
+
+	if (fino == LL_CTL_INO || fino == LL_SNAPDIR_INO)
+	{
+		ll_special_stat(fino, stbuf);
+		return 0;
+	}
+	int ret = ll_inode(fino, &inode, &slot);
+	if (ret < 0)
+		return ret;
+	fill_stat(&inode, stbuf, ret);
+	stbuf->st_ino = fino;
+	return 0;
+}
+
+// Reply to lookup/mkdir/create with an entry for fino
+static void ll_entry(fuse_ino_t fino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = fino;
+	e->attr_timeout = LL_TIMEOUT;
+	e->entry_timeout = LL_TIMEOUT;
+	ll_stat(fino, &e->attr);
+
+	// the snapshot id tells a reused snapshot slot apart from the deleted one
+	if (fino >> LL_SNAP_SHIFT)
+		e->generation = snaps[(fino >> LL_SNAP_SHIFT) - 1].id;
+}
+
+/*
+ * FUSE low-level operations
+ */
+static void rufs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	rufs_setup();
+
+#if FUSE_VERSION >= 29
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+}
+
+static void rufs_ll_destroy(void *userdata)
+{
+	rufs_teardown();
+}
+
+static void rufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct inode dir_inode;
+	struct dirent dirent;
+	int slot;
+
+	// hidden control file and snapshot directory at the root
+	if (parent == FUSE_ROOT_ID && strcmp(name, CTL_NAME) == 0)
+	{
+		ll_entry(LL_CTL_INO, &e);
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (parent == FUSE_ROOT_ID && strcmp(name, SNAP_NAME) == 0)
+	{
+		ll_entry(LL_SNAPDIR_INO, &e);
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	// a snapshot id names the root of that snapshot
+	if (parent == LL_SNAPDIR_INO)
+	{
+		char *end;
+		unsigned long id = strtoul(name, &end, 10);
+		for (int i = 0; i < MAX_SNAPSHOTS && *end == '\0'; i++)
+		{
+			if (snaps[i].id != 0 && snaps[i].id == id)
+			{
+				ll_entry(LL_INO(i, ROOT_INO), &e);
+				fuse_reply_entry(req, &e);
+				return;
+			}
+		}
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (ll_inode(parent, &dir_inode, &slot) < 0 || dir_inode.type != S_IFDIR)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	uint32_t i_start_blk = slot < 0 ? sb.i_start_blk : snaps[slot].i_start_blk;
+	if (dir_find_at(i_start_blk, dir_inode.ino, name, strlen(name), &dirent) < 0)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ll_entry(slot < 0 ? dirent.ino + 1 : LL_INO(slot, dirent.ino), &e);
+	fuse_reply_entry(req, &e);
+}
+
+/*
+ * rufs never frees an inode while it is linked and has no unlink, so there is
+ * nothing a lookup count would hold back and forget only has to be answered
+ */
+static void rufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long n)
+{
+	fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void rufs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	fuse_reply_none(req);
+}
+#endif
+
+static void rufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+
+	int ret = ll_stat(ino, &stbuf);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &stbuf, LL_TIMEOUT);
+}
+
+static void rufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	// truncate is not supported, like in the path based front end
+	if (ino >> LL_SNAP_SHIFT || ino == LL_SNAPDIR_INO)
+	{
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | LL_SET_ATTR_NOW)) && ino != LL_CTL_INO)
+	{
+		// times as utimens() gets them, one left alone unless it is set
+		struct timespec tv[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+		if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+#endif
+		int ret = ll_inode(ino, &inode, &slot);
+		if (ret == 0)
+			ret = inode_set_times(&inode, tv);
+		if (ret != 0)
+		{
+			fuse_reply_err(req, ret < 0 ? -ret : ENOENT);
+			return;
+		}
+	}
+	rufs_ll_getattr(req, ino, fi);
+}
+
+static void rufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	// the control file has no fixed size, bypass the page cache for it
+	if (ino == LL_CTL_INO)
+	{
+		fi->direct_io = 1;
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	int ret = ll_inode(ino, &inode, &slot);
+	if (ret < 0)
+		fuse_reply_err(req, ENOENT);
+	else if (ret == 1 && (fi->flags & O_ACCMODE) != O_RDONLY)
+		fuse_reply_err(req, EROFS);
+	else
+	{
+		// all writes come through us, cached pages stay valid across opens
+		fi->keep_cache = 1;
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void rufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	if (ino == LL_CTL_INO)
+	{
+		char status[4096];
+		int len = ctl_status(status, sizeof(status));
+		if (off >= len)
+			fuse_reply_buf(req, NULL, 0);
+		else
+			fuse_reply_buf(req, status + off, off + size > len ? len - off : size);
+		return;
+	}
+	if (ll_inode(ino, &inode, &slot) < 0)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+#if FUSE_VERSION >= 29
+	// hand the disk file ranges to libfuse, then free what file_read_buf() allocated
+	struct fuse_bufvec *bufv;
+	int ret = file_read_buf(&inode, &bufv, size, off);
+	if (ret < 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (slot < 0)
+		inode_accessed(&inode);
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	for (size_t i = 0; i < bufv->count; i++)
+	{
+		if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+			free(bufv->buf[i].mem);
+	}
+	free(bufv);
+#else
+	char *buffer = (char *)block_alloc(size);
+	if (!buffer)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int ret = file_read(&inode, buffer, size, off);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+	{
+		if (slot < 0)
+			inode_accessed(&inode);
+		fuse_reply_buf(req, buffer, ret);
+	}
+	free(buffer);
+#endif
+}
+
+static void rufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	if (ino == LL_CTL_INO)
+	{
+		int ret = ctl_command(buf, size);
+		if (ret < 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_write(req, size);
+		return;
+	}
+
+	int ret = ll_inode(ino, &inode, &slot);
+	if (ret != 0)
+	{
+		fuse_reply_err(req, ret < 0 ? ENOENT : EROFS);
+		return;
+	}
+	ret = file_write(&inode, buf, size, off);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+#if FUSE_VERSION >= 29
+static void rufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	// the control file takes the regular write path
+	if (ino == LL_CTL_INO)
+	{
+		size_t size = fuse_buf_size(buf);
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size ? size : 1);
+		if (!mem.buf[0].mem)
+		{
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		ssize_t copied = fuse_buf_copy(&mem, buf, 0);
+		if (copied < 0)
+			fuse_reply_err(req, -copied);
+		else
+			rufs_ll_write(req, ino, mem.buf[0].mem, copied, off, fi);
+		free(mem.buf[0].mem);
+		return;
+	}
+
+	int ret = ll_inode(ino, &inode, &slot);
+	if (ret != 0)
+	{
+		fuse_reply_err(req, ret < 0 ? ENOENT : EROFS);
+		return;
+	}
+	ret = file_write_buf(&inode, buf, off);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+#endif
+
+// Steps shared by mkdir and create, fills in the new entry
+static int ll_make_node(fuse_ino_t parent, const char *name, uint32_t type, struct fuse_entry_param *e)
+{
+	struct inode parent_inode, new_inode;
+	struct dirent dirent;
+	int slot;
+
+	if (parent == LL_SNAPDIR_INO || parent >> LL_SNAP_SHIFT)
+		return -EROFS;
+	if (parent == FUSE_ROOT_ID && (strcmp(name, CTL_NAME) == 0 || strcmp(name, SNAP_NAME) == 0))
+		return -EEXIST;
+	if (ll_inode(parent, &parent_inode, &slot) < 0 || parent_inode.type != S_IFDIR)
+		return -ENOENT;
+	if (dir_find_at(sb.i_start_blk, parent_inode.ino, name, strlen(name), &dirent) == 0)
+		return -EEXIST;
+
+	int ret = make_node(&parent_inode, name, type, &new_inode);
+	if (ret < 0)
+		return ret;
+	ll_entry(new_inode.ino + 1, e);
+	return 0;
+}
+
+static void rufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct fuse_entry_param e;
+
+	int ret = ll_make_node(parent, name, S_IFDIR, &e);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void rufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+
+	int ret = ll_make_node(parent, name, S_IFREG, &e);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_create(req, &e, fi);
+}
+
+static void rufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	if (ino != LL_SNAPDIR_INO && (ll_inode(ino, &inode, &slot) < 0 || inode.type != S_IFDIR))
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+// directory listing being packed into a reply buffer
+struct ll_dirbuf {
+	fuse_req_t req;
+	int slot;						/* snapshot slot of the directory, -1 if live */
+	char *buf;
+	size_t size;					/* capacity of buf */
+	size_t len;						/* bytes used so far */
+	struct inode_cache icache;		/* children's inodes, for their file type */
+};
+
+// Add one entry, returns 1 once the reply buffer is full
+static int ll_add_entry(struct ll_dirbuf *db, const char *name, fuse_ino_t fino, mode_t mode, off_t next)
+{
+	struct stat stbuf;
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = fino;
+	stbuf.st_mode = mode;
+	size_t len = fuse_add_direntry(db->req, db->buf + db->len, db->size - db->len, name, &stbuf, next);
+	if (len > db->size - db->len)
+		return 1;
+	db->len += len;
+	return 0;
+}
+
+static int ll_dirent_filler(void *ctx, const struct dirent *dirent, off_t next)
+{
+	struct ll_dirbuf *db = (struct ll_dirbuf *)ctx;
+	fuse_ino_t fino = db->slot < 0 ? dirent->ino + 1 : LL_INO(db->slot, dirent->ino);
+	struct inode child;
+	mode_t mode = readi_cached(&db->icache, dirent->ino, &child) < 0 ? 0 : child.type;
+	return ll_add_entry(db, dirent->name, fino, mode, next);
+}
+
+static void rufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct ll_dirbuf db;
+	struct inode inode;
+	int err = 0;
+
+	// replies fit a scratch block unless the kernel asks for more
+	db.req = req;
+	db.slot = -1;
+	db.buf = size <= BLOCK_SIZE ? (char *)scratch_get() : (char *)malloc(size);
+	db.size = size;
+	db.len = 0;
+	if (!db.buf)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (ino == LL_SNAPDIR_INO)
+	{
+		// one entry per snapshot, cookies are the table slot + 1
+		char name[16];
+		for (int i = off; i < MAX_SNAPSHOTS; i++)
+		{
+			if (snaps[i].id == 0)
+				continue;
+			snprintf(name, sizeof(name), "%u", snaps[i].id);
+			if (ll_add_entry(&db, name, LL_INO(i, ROOT_INO), S_IFDIR, i + 1))
+				break;
+		}
+	}
+	else if (ll_inode(ino, &inode, &db.slot) < 0 || inode.type != S_IFDIR)
+		err = ENOTDIR;
+	else if (inode_cache_init(&db.icache, db.slot < 0 ? sb.i_start_blk : snaps[db.slot].i_start_blk) < 0)
+		err = ENOMEM;
+	else
+	{
+		if (dir_iterate(&inode, off, ll_dirent_filler, &db) < 0)
+			err = EIO;
+		inode_cache_release(&db.icache);
+	}
+
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, db.buf, db.len);
+	scratch_put(db.buf);
+}
+
+// Nothing is kept per open directory
+static void rufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void rufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int slot;
+	uint16_t rino;
+
+	// blocks reserved past the end of a live file go back when it is closed, times it owes get written
+	if (ll_split(ino, &slot, &rino) == 0 && slot < 0)
+	{
+		prealloc_trim(rino);
+		if (lazy_flush(rino) < 0)
+		{
+			fuse_reply_err(req, EIO);
+			return;
+		}
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void rufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	int slot;
+	uint16_t rino;
+
+	// fdatasync() may leave the times behind, they are not needed to read the data back
+	if (ll_split(ino, &slot, &rino) == 0 && slot < 0 && !datasync && lazy_flush(rino) < 0)
+	{
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	fuse_reply_err(req, dev_sync() < 0 ? EIO : 0);
+}
+
+#if FUSE_VERSION >= 29
+static void rufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	struct inode inode;
+	int slot;
+
+	int ret = ino == LL_CTL_INO ? -EOPNOTSUPP : ll_inode(ino, &inode, &slot);
+	if (ret == 0)
+		ret = file_fallocate(&inode, mode, offset, length);
+	else if (ret > 0)
+		ret = -EROFS;
+	fuse_reply_err(req, -ret);
+}
+#endif
+
+/*
+ * Handlers are entered through wrappers firing ll_start and ll_done (trace.h)
+ * with the FUSE inode number, the reply has gone out by ll_done. RAM mode
+ * checkpoints wait for the handler to finish, expired lazy times are
+ * written before it.
+ */
+#define TRACED(op, params, args, ino)				\
+	static void traced_##op params				\
+	{											\
+		TRACE2(ll_start, #op, (uint64_t)(ino));	\
+		dev_op_begin();							\
+		lazy_expire();							\
+		rufs_ll_##op args;						\
+		dev_op_end();							\
+		TRACE2(ll_done, #op, (uint64_t)(ino));	\
+	}
+
+TRACED(lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), parent)
+TRACED(forget, (fuse_req_t req, fuse_ino_t ino, unsigned long n), (req, ino, n), ino)
+#if FUSE_VERSION >= 29
+TRACED(forget_multi, (fuse_req_t req, size_t count, struct fuse_forget_data *forgets), (req, count, forgets), 0)
+#endif
+TRACED(getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino)
+TRACED(setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi),
+	   (req, ino, attr, to_set, fi), ino)
+TRACED(opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino)
+TRACED(readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, size, off, fi), ino)
+TRACED(releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino)
+TRACED(mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode), parent)
+TRACED(create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+	   (req, parent, name, mode, fi), parent)
+TRACED(open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino)
+TRACED(read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, size, off, fi), ino)
+TRACED(write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi),
+	   (req, ino, buf, size, off, fi), ino)
+#if FUSE_VERSION >= 29
+TRACED(write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi),
+	   (req, ino, buf, off, fi), ino)
+TRACED(fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+	   (req, ino, mode, offset, length, fi), ino)
+#endif
+TRACED(release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), ino)
+TRACED(fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi), ino)
+
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+	.init = rufs_ll_init,
+	.destroy = rufs_ll_destroy,
+
+	.lookup = traced_lookup,
+	.forget = traced_forget,
+#if FUSE_VERSION >= 29
+	.forget_multi = traced_forget_multi,
+#endif
+	.getattr = traced_getattr,
+	.setattr = traced_setattr,
+
+	.opendir = traced_opendir,
+	.readdir = traced_readdir,
+	.releasedir = traced_releasedir,
+	.mkdir = traced_mkdir,
+
+	.create = traced_create,
+	.open = traced_open,
+	.read = traced_read,
+	.write = traced_write,
+#if FUSE_VERSION >= 29
+	.write_buf = traced_write_buf,
+	.fallocate = traced_fallocate,
+#endif
+	.release = traced_release,
+	.fsync = traced_fsync};
+
+// Mount and serve the low-level API, args are what is left after rufs's own options
+int rufs_ll_main(struct fuse_args *args)
+{
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+	if ((ch = fuse_mount(mountpoint, args)) == NULL)
+	{
+		free(mountpoint);
+		return 1;
+	}
+
+	struct fuse_session *se = fuse_lowlevel_new(args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+	if (se != NULL)
+	{
+		if (fuse_set_signal_handlers(se) != -1)
+		{
+			fuse_session_add_chan(se, ch);
+			fuse_daemonize(foreground);
+			err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+	free(mountpoint);
+
+	return err ? 1 : 0;
+}
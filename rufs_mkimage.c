@@ -0,0 +1,376 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_mkimage.c
+ *
+ *	Offline bulk loader, builds a fresh DISKFILE from a host directory tree.
+ *	usage: rufs_mkimage [-u stripe_unit] HOSTDIR DISKFILE[:DISKFILE...]
+ *
+ *	The tree is scanned first so that every inode number and data block is
+ *	known before anything is written. Inodes are numbered breadth first from
+ *	ROOT_INO and each one gets a contiguous run of data blocks in the same
+ *	order, so the data region is written front to back in large batches and
+ *	every metadata region with a single write.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define BATCH_BLOCKS 256				/* data blocks per write */
+
+// a file or directory of the host tree
+struct node {
+	char *path;						/* host path */
+	char name[208];					/* name in its parent */
+	struct stat st;
+	int parent;						/* parent, in scan order */
+	int first_child;				/* children are consecutive inode numbers */
+	int nchildren;
+	int nblocks;					/* data blocks needed */
+	int blk;						/* first of them */
+};
+
+// the tree in nftw (depth first) order, then renumbered breadth first
+static struct node scanned[MAX_INUM], nodes[MAX_INUM];
+static int nscanned, nnodes;
+static int dir_at_level[PATH_MAX / 2];
+
+struct superblock sb;
+
+// data blocks being collected for the next sequential write
+static char *batch;
+static int batch_start, batch_count;
+
+static int scan_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	struct node *n = &scanned[nscanned];
+	const char *name = ftw->level ? path + ftw->base : "";
+
+	if (!S_ISDIR(st->st_mode) && !S_ISREG(st->st_mode))
+	{
+		fprintf(stderr, "%s: not a regular file or directory, skipped\n", path);
+		return 0;
+	}
+	if (flag == FTW_DNR)
+	{
+		fprintf(stderr, "%s: cannot read directory\n", path);
+		return -1;
+	}
+	if (nscanned == MAX_INUM)
+	{
+		fprintf(stderr, "%s: more than %d files and directories\n", path, MAX_INUM);
+		return -1;
+	}
+	if (strlen(name) >= sizeof(n->name))
+	{
+		fprintf(stderr, "%s: name longer than %zu bytes\n", path, sizeof(n->name) - 1);
+		return -1;
+	}
+	if (S_ISREG(st->st_mode) && st->st_size > (off_t)NUM_DIRECT * BLOCK_SIZE)
+	{
+		fprintf(stderr, "%s: larger than %d bytes\n", path, NUM_DIRECT * BLOCK_SIZE);
+		return -1;
+	}
+	if (ftw->level >= (int)(sizeof(dir_at_level) / sizeof(int)))
+		return -1;
+
+	n->path = strdup(path);
+	strcpy(n->name, name);
+	n->st = *st;
+	n->parent = ftw->level ? dir_at_level[ftw->level - 1] : -1;
+	if (S_ISDIR(st->st_mode))
+		dir_at_level[ftw->level] = nscanned;
+	nscanned++;
+	return 0;
+}
+
+/*
+ * Scan the host tree, then number it breadth first so that the children of
+ * a directory get consecutive inode numbers
+ */
+static int scan_tree(const char *root)
+{
+	if (nftw(root, scan_one, 64, FTW_PHYS) != 0 || nscanned == 0 || !S_ISDIR(scanned[0].st.st_mode))
+	{
+		fprintf(stderr, "%s: failed to scan the tree\n", root);
+		return -1;
+	}
+
+	int *order = (int *)malloc(nscanned * sizeof(int));	/* scan index of each inode */
+	if (!order)
+		return -1;
+	order[0] = 0;
+	nnodes = 1;
+	for (int ino = 0; ino < nnodes; ino++)
+	{
+		nodes[ino] = scanned[order[ino]];
+		struct node *n = &nodes[ino];
+		if (!S_ISDIR(n->st.st_mode))
+		{
+			n->nblocks = (n->st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			continue;
+		}
+
+		// children come after their parent in scan order
+		n->first_child = nnodes;
+		for (int i = order[ino] + 1; i < nscanned; i++)
+		{
+			if (scanned[i].parent == order[ino])
+				order[nnodes++] = i;
+		}
+		n->nchildren = nnodes - n->first_child;
+		n->nblocks = (n->nchildren + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+		if (n->nblocks > NUM_DIRECT)
+		{
+			fprintf(stderr, "%s: more than %d entries\n", n->path, NUM_DIRECT * (int)DIRENTS_PER_BLOCK);
+			free(order);
+			return -1;
+		}
+	}
+	free(order);
+	return 0;
+}
+
+/*
+ * Data region, written in order in batches of BATCH_BLOCKS
+ */
+static int batch_flush()
+{
+	struct iovec iov = {batch, (size_t)batch_count * BLOCK_SIZE};
+
+	if (batch_count == 0)
+		return 0;
+	if (bio_writev(batch_start, &iov, 1) != (int)iov.iov_len)
+		return -1;
+	batch_start += batch_count;
+	batch_count = 0;
+	return 0;
+}
+
+// Next block of the batch, zeroed
+static char *batch_block()
+{
+	if (batch_count == BATCH_BLOCKS && batch_flush() < 0)
+		return NULL;
+	char *block = batch + (size_t)batch_count++ * BLOCK_SIZE;
+	memset(block, 0, BLOCK_SIZE);
+	return block;
+}
+
+static int write_dir(struct node *n)
+{
+	struct dirent *dirent_block = NULL;
+
+	for (int i = 0; i < n->nchildren; i++)
+	{
+		if (i % DIRENTS_PER_BLOCK == 0 && !(dirent_block = (struct dirent *)batch_block()))
+			return -1;
+		struct dirent *d = &dirent_block[i % DIRENTS_PER_BLOCK];
+		struct node *child = &nodes[n->first_child + i];
+		d->ino = n->first_child + i;
+		d->valid = 1;
+		d->len = strlen(child->name);
+		memcpy(d->name, child->name, d->len);
+		dir_tail(dirent_block)->fp[i % DIRENTS_PER_BLOCK] = name_fp(d->name, d->len);
+		dir_tail(dirent_block)->magic = DIR_TAIL_MAGIC;
+	}
+	return 0;
+}
+
+static int write_file(struct node *n)
+{
+	int fd = open(n->path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(n->path);
+		return -1;
+	}
+	// a file that shrank since the scan reads back zeros past its end
+	for (int i = 0; i < n->nblocks; i++)
+	{
+		char *block = batch_block();
+		if (!block || read(fd, block, BLOCK_SIZE) < 0)
+		{
+			perror(n->path);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Metadata regions, each built in memory and written at once
+ */
+static int write_region(int start, const void *buf, int nblocks)
+{
+	struct iovec iov = {(void *)buf, (size_t)nblocks * BLOCK_SIZE};
+	return bio_writev(start, &iov, 1) == (int)iov.iov_len ? 0 : -1;
+}
+
+static int write_metadata(int data_blocks)
+{
+	char block[BLOCK_SIZE];
+	int used = sb.d_start_blk + data_blocks;
+
+	// inode bitmap, then data block bitmap
+	memset(block, 0, BLOCK_SIZE);
+	for (int i = 0; i < nnodes; i++)
+		set_bitmap((bitmap_t)block, i);
+	if (write_region(sb.i_bitmap_blk, block, 1) < 0)
+		return -1;
+	memset(block, 0, BLOCK_SIZE);
+	for (int i = 0; i < used; i++)
+		set_bitmap((bitmap_t)block, i);
+	if (write_region(sb.d_bitmap_blk, block, 1) < 0)
+		return -1;
+
+	// inode table
+	struct dinode *table = (struct dinode *)calloc(INODE_BLOCKS * INODES_PER_BLOCK, sizeof(struct dinode));
+	if (!table)
+		return -1;
+	for (int ino = 0; ino < nnodes; ino++)
+	{
+		struct node *n = &nodes[ino];
+		struct dinode *d = &table[ino];
+		d->version = DINODE_VERSION;
+		d->ino = ino;
+		d->mode = n->st.st_mode;
+		d->size = S_ISDIR(n->st.st_mode) ? (uint64_t)n->nblocks * BLOCK_SIZE : (uint64_t)n->st.st_size;
+		d->nlink = S_ISDIR(n->st.st_mode) ? 2 : 1;
+		d->mtime = (int64_t)n->st.st_mtim.tv_sec * 1000000000 + n->st.st_mtim.tv_nsec;
+		d->ctime = (int64_t)n->st.st_ctim.tv_sec * 1000000000 + n->st.st_ctim.tv_nsec;
+		d->atime = (int64_t)n->st.st_atim.tv_sec * 1000000000 + n->st.st_atim.tv_nsec;
+		for (int k = 0; k < n->nblocks; k++)
+			d->direct_ptr[k] = n->blk + k;
+	}
+	int ret = write_region(sb.i_start_blk, table, INODE_BLOCKS);
+	free(table);
+	if (ret < 0)
+		return -1;
+
+	// reference counts, one per used block
+	uint16_t *refs = (uint16_t *)calloc(REF_BLOCKS, BLOCK_SIZE);
+	if (!refs)
+		return -1;
+	for (int i = 0; i < used; i++)
+		refs[i] = 1;
+	ret = write_region(sb.r_start_blk, refs, REF_BLOCKS);
+	free(refs);
+	if (ret < 0)
+		return -1;
+
+	// empty fingerprint index and snapshot table, they are adjacent
+	char *zero = (char *)calloc(FP_BUCKETS + 1, BLOCK_SIZE);
+	if (!zero)
+		return -1;
+	ret = write_region(sb.f_start_blk, zero, FP_BUCKETS + 1);
+	free(zero);
+	if (ret < 0)
+		return -1;
+
+	// superblock
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &sb, sizeof(sb));
+	return write_region(0, block, 1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "u:")) != -1)
+	{
+		if (opt != 'u')
+			break;
+		dev_stripe_unit(atoi(optarg));
+	}
+	if (opt == '?' || optind != argc - 2)
+	{
+		fprintf(stderr, "usage: %s [-u stripe_unit] HOSTDIR DISKFILE[:DISKFILE...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *host = argv[optind], *image = argv[optind + 1];
+
+	// Step 1: scan the host tree and size everything up front
+	if (scan_tree(host) < 0)
+		return EXIT_FAILURE;
+	sb_layout(&sb);
+	int next = sb.d_start_blk;
+	for (int ino = 0; ino < nnodes; ino++)
+	{
+		nodes[ino].blk = next;
+		next += nodes[ino].nblocks;
+	}
+	if (next > MAX_DNUM)
+	{
+		fprintf(stderr, "%s: needs %d data blocks, the image holds %d\n", host, next - sb.d_start_blk,
+				MAX_DNUM - sb.d_start_blk);
+		return EXIT_FAILURE;
+	}
+
+	// Step 2: create the image, starting from empty files
+	char paths[PATH_MAX], *save = NULL;
+	snprintf(paths, sizeof(paths), "%s", image);
+	for (char *p = strtok_r(paths, ":", &save); p; p = strtok_r(NULL, ":", &save))
+	{
+		if (unlink(p) < 0 && errno != ENOENT)
+		{
+			perror(p);
+			return EXIT_FAILURE;
+		}
+	}
+	dev_init(image);
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	sb.s_ndevs = ndevs;
+	sb.s_stripe_unit = stripe_unit;
+
+	// Step 3: data blocks, front to back
+	if (posix_memalign((void **)&batch, BLOCK_SIZE, BATCH_BLOCKS * BLOCK_SIZE) != 0)
+	{
+		perror("Failed to allocate write batch");
+		return EXIT_FAILURE;
+	}
+	batch_start = sb.d_start_blk;
+	for (int ino = 0; ino < nnodes; ino++)
+	{
+		struct node *n = &nodes[ino];
+		if ((S_ISDIR(n->st.st_mode) ? write_dir(n) : write_file(n)) < 0)
+		{
+			fprintf(stderr, "%s: failed to write its data\n", n->path);
+			return EXIT_FAILURE;
+		}
+	}
+	if (batch_flush() < 0)
+	{
+		perror("Failed to write data blocks");
+		return EXIT_FAILURE;
+	}
+
+	// Step 4: metadata last, the image is only valid once the superblock is in
+	if (write_metadata(next - sb.d_start_blk) < 0)
+	{
+		perror("Failed to write metadata");
+		return EXIT_FAILURE;
+	}
+	dev_sync();
+	dev_close();
+
+	printf("%s: %d inodes, %d data blocks\n", image, nnodes, next - sb.d_start_blk);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,330 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_resize.c
+ *
+ *	Offline resize, grows an image or shrinks it to SIZE bytes (K, M or G
+ *	suffixes allowed).
+ *	usage: rufs_resize [-n] DISKFILE[:DISKFILE...] SIZE
+ *
+ *	Growing extends the backing files and records the new size, as the
+ *	"resize" control command does on a mounted image. Shrinking first moves
+ *	every block in use past the new end into free blocks below it, snapshot
+ *	inode tables as whole runs and everything else block by block, then
+ *	points the inode tables, reference counts, bitmap and fingerprint index
+ *	at the copies before the files are cut. -n only reports what would move.
+ *	The image must not be mounted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+struct superblock sb;
+
+static char bitmap_block[BLOCK_SIZE] BLOCK_ALIGNED;
+static bitmap_t d_bitmap = (bitmap_t)bitmap_block;
+static uint16_t refs[REF_BLOCKS * REFS_PER_BLOCK] BLOCK_ALIGNED;
+static struct snapshot snap_table[MAX_SNAPSHOTS] BLOCK_ALIGNED;
+static int remap[MAX_DNUM];				/* new home of a block that moves, 0 if it stays */
+static int nblocks;						/* size being resized to */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n] DISKFILE[:DISKFILE...] SIZE\n", prog);
+	exit(2);
+}
+
+// Superblock, bitmap, reference counts and snapshot table
+static int load(const char *diskfile_path)
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	if (dev_open(diskfile_path) < 0)
+		return -1;
+	if (bio_read(0, block) <= 0)
+	{
+		fprintf(stderr, "Failed to read superblock\n");
+		return -1;
+	}
+	memcpy(&sb, block, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM)
+	{
+		fprintf(stderr, "Bad magic number %#x, not a rufs image\n", sb.magic_num);
+		return -1;
+	}
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	if (sb.s_ndevs > 1 && sb.s_ndevs != ndevs)
+	{
+		fprintf(stderr, "Image is striped over %u files, %d given\n", sb.s_ndevs, ndevs);
+		return -1;
+	}
+	dev_stripe_unit(sb.s_stripe_unit);
+
+	if (bio_read(sb.d_bitmap_blk, d_bitmap) <= 0 || bio_read(sb.s_table_blk, snap_table) <= 0)
+	{
+		fprintf(stderr, "Failed to read bitmap and snapshot table\n");
+		return -1;
+	}
+	for (int i = 0; i < REF_BLOCKS; i++)
+	{
+		if (bio_read(sb.r_start_blk + i, (char *)refs + i * BLOCK_SIZE) <= 0)
+		{
+			fprintf(stderr, "Failed to read reference counts\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_superblock()
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &sb, sizeof(sb));
+	return bio_write(0, block) <= 0 ? -1 : 0;
+}
+
+// First run of count free blocks below the new end, marked in use, -1 if none
+static int take_run(int count)
+{
+	for (int b = sb.d_start_blk; b + count <= nblocks; b++)
+	{
+		int len = 0;
+		while (len < count && !get_bitmap(d_bitmap, b + len))
+			len++;
+		if (len == count)
+		{
+			for (int i = 0; i < count; i++)
+				set_bitmap(d_bitmap, b + i);
+			return b;
+		}
+		b += len;
+	}
+	return -1;
+}
+
+/*
+ * Pick a new home for every block in use past the new end, returns how many
+ * move or -1 if they do not fit below it
+ */
+static int plan(int old_nblocks)
+{
+	int moves = 0;
+
+	// Step 1: snapshot inode tables must stay contiguous
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snap_table[i].id == 0 || snap_table[i].i_start_blk + INODE_BLOCKS <= nblocks)
+			continue;
+		int start = take_run(INODE_BLOCKS);
+		if (start < 0)
+		{
+			fprintf(stderr, "No run of %d free blocks below %d for the table of snapshot %u\n",
+					(int)INODE_BLOCKS, nblocks, snap_table[i].id);
+			return -1;
+		}
+		for (int b = 0; b < INODE_BLOCKS; b++)
+			remap[snap_table[i].i_start_blk + b] = start + b;
+		moves += INODE_BLOCKS;
+	}
+
+	// Step 2: data blocks one at a time, in order so runs tend to stay runs
+	for (int b = nblocks; b < old_nblocks; b++)
+	{
+		if (!get_bitmap(d_bitmap, b) || remap[b] != 0)
+			continue;
+		if ((remap[b] = take_run(1)) < 0)
+		{
+			fprintf(stderr, "Blocks in use past %d do not fit in the free space below it\n", nblocks);
+			return -1;
+		}
+		moves++;
+	}
+	return moves;
+}
+
+// Point every block pointer of an inode table at the moved copies
+static int remap_table(uint32_t i_start_blk)
+{
+	struct dinode inodes[INODES_PER_BLOCK] BLOCK_ALIGNED;
+
+	for (int b = 0; b < INODE_BLOCKS; b++)
+	{
+		int changed = 0;
+		if (bio_read(i_start_blk + b, inodes) <= 0)
+			return -1;
+		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		{
+			if (inodes[j].version == 0)
+				continue;
+			for (int k = 0; k < NUM_DIRECT; k++)
+			{
+				int blkno = inodes[j].direct_ptr[k];
+				if (blkno > 0 && blkno < MAX_DNUM && remap[blkno] != 0)
+				{
+					inodes[j].direct_ptr[k] = remap[blkno];
+					changed = 1;
+				}
+			}
+		}
+		if (changed && bio_write(i_start_blk + b, inodes) <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Fingerprints follow their blocks, ones for blocks cut off are dropped
+static int remap_fingerprints()
+{
+	struct fp_entry bucket[FP_PER_BUCKET] BLOCK_ALIGNED;
+
+	for (int i = 0; i < FP_BUCKETS; i++)
+	{
+		int changed = 0;
+		if (bio_read(sb.f_start_blk + i, bucket) <= 0)
+			return -1;
+		for (int j = 0; j < FP_PER_BUCKET; j++)
+		{
+			if (bucket[j].blkno == 0 || bucket[j].blkno >= MAX_DNUM)
+				continue;
+			if (remap[bucket[j].blkno] != 0)
+				bucket[j].blkno = remap[bucket[j].blkno];
+			else if (bucket[j].blkno >= nblocks)
+				memset(&bucket[j], 0, sizeof(struct fp_entry));
+			else
+				continue;
+			changed = 1;
+		}
+		if (changed && bio_write(sb.f_start_blk + i, bucket) <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int shrink(int old_nblocks)
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+
+	// Step 1: copy the blocks, the originals stay valid until the tables change
+	for (int b = sb.d_start_blk; b < old_nblocks; b++)
+	{
+		if (remap[b] == 0)
+			continue;
+		if (bio_read(b, block) <= 0 || bio_write(remap[b], block) <= 0)
+			return -1;
+	}
+	if (dev_sync() < 0)
+		return -1;
+
+	// Step 2: snapshot tables move, then every table points at the copies
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snap_table[i].id != 0 && remap[snap_table[i].i_start_blk] != 0)
+			snap_table[i].i_start_blk = remap[snap_table[i].i_start_blk];
+	}
+	if (remap_table(sb.i_start_blk) < 0)
+		return -1;
+	for (int i = 0; i < MAX_SNAPSHOTS; i++)
+	{
+		if (snap_table[i].id != 0 && remap_table(snap_table[i].i_start_blk) < 0)
+			return -1;
+	}
+	if (bio_write(sb.s_table_blk, snap_table) <= 0 || remap_fingerprints() < 0)
+		return -1;
+
+	// Step 3: counts and bitmap, moved blocks and the tail end up free
+	for (int b = sb.d_start_blk; b < old_nblocks; b++)
+	{
+		if (remap[b] == 0 && b < nblocks)
+			continue;
+		if (remap[b] != 0)
+			refs[remap[b]] = refs[b];
+		refs[b] = 0;
+		unset_bitmap(d_bitmap, b);
+	}
+	for (int i = 0; i < REF_BLOCKS; i++)
+	{
+		if (bio_write(sb.r_start_blk + i, (char *)refs + i * BLOCK_SIZE) <= 0)
+			return -1;
+	}
+	if (bio_write(sb.d_bitmap_blk, d_bitmap) <= 0)
+		return -1;
+	return dev_sync();
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, dry_run = 0;
+
+	while ((opt = getopt(argc, argv, "n")) != -1)
+	{
+		if (opt == 'n')
+			dry_run = 1;
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	// Step 1: the image and the size it goes to
+	if (load(argv[optind]) < 0)
+		return 1;
+	long long size = parse_size(argv[optind + 1]);
+	if (size <= sb.d_start_blk || size > sb.max_dnum)
+	{
+		fprintf(stderr, "%s: an image holds %d to %d blocks of %d bytes\n", argv[optind + 1],
+				sb.d_start_blk + 1, sb.max_dnum, BLOCK_SIZE);
+		return 1;
+	}
+	nblocks = size;
+	int old_nblocks = sb_nblocks(&sb);
+
+	// Step 2: shrinking moves the tail down first
+	int moves = 0;
+	if (nblocks < old_nblocks)
+	{
+		if ((moves = plan(old_nblocks)) < 0)
+			return 1;
+		if (dry_run)
+		{
+			for (int b = sb.d_start_blk; b < old_nblocks; b++)
+			{
+				if (remap[b] != 0)
+					printf("move: block %d -> %d\n", b, remap[b]);
+			}
+		}
+		else if (shrink(old_nblocks) < 0)
+		{
+			fprintf(stderr, "Failed to move blocks, run rufs_fsck before mounting\n");
+			return 1;
+		}
+	}
+
+	// Step 3: record the size, the files are cut only once nothing points past it
+	if (!dry_run)
+	{
+		sb.s_nblocks = nblocks;
+		if (nblocks > old_nblocks && dev_resize(nblocks) < 0)
+			return 1;
+		if (write_superblock() < 0 || dev_sync() < 0)
+		{
+			fprintf(stderr, "Failed to write superblock\n");
+			return 1;
+		}
+		if (nblocks < old_nblocks && dev_resize(nblocks) < 0)
+			return 1;
+	}
+	dev_close();
+
+	printf("%s: %d -> %d blocks, %d blocks moved%s\n", argv[optind], old_nblocks, nblocks, moves,
+		   dry_run ? " (not written)" : "");
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_trim.c
+ *
+ *	Offline trim, punches every data block that is free in the bitmap out
+ *	of the backing files so the host image is as sparse as it can be.
+ *	usage: rufs_trim [-n] DISKFILE[:DISKFILE...]
+ *
+ *	A mounted file system discards blocks as it frees them; this catches
+ *	images written before that, or by tools that do not. -n only reports
+ *	the free runs. The image must not be mounted.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+struct superblock sb;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n] DISKFILE[:DISKFILE...]\n", prog);
+	exit(2);
+}
+
+// Bytes the backing files take on the host
+static long long host_usage(const char *diskfile_path)
+{
+	char paths[PATH_MAX];
+	char *save = NULL;
+	long long bytes = 0;
+	struct stat st;
+
+	strncpy(paths, diskfile_path, sizeof(paths) - 1);
+	paths[sizeof(paths) - 1] = '\0';
+	for (char *p = strtok_r(paths, ":", &save); p; p = strtok_r(NULL, ":", &save))
+	{
+		if (stat(p, &st) == 0)
+			bytes += (long long)st.st_blocks * 512;
+	}
+	return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+	char block[BLOCK_SIZE] BLOCK_ALIGNED;
+	bitmap_t d_bitmap = (bitmap_t)block;
+	int opt, dry_run = 0;
+
+	while ((opt = getopt(argc, argv, "n")) != -1)
+	{
+		if (opt == 'n')
+			dry_run = 1;
+		else
+			usage(argv[0]);
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	// Step 1: superblock, and the stripe geometry it records
+	if (dev_open(argv[optind]) < 0)
+		return 1;
+	if (bio_read(0, block) <= 0)
+	{
+		fprintf(stderr, "Failed to read superblock\n");
+		return 1;
+	}
+	memcpy(&sb, block, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM)
+	{
+		fprintf(stderr, "Bad magic number %#x, not a rufs image\n", sb.magic_num);
+		return 1;
+	}
+	int ndevs, stripe_unit;
+	dev_geometry(&ndevs, &stripe_unit);
+	if (sb.s_ndevs > 1 && sb.s_ndevs != ndevs)
+	{
+		fprintf(stderr, "Image is striped over %u files, %d given\n", sb.s_ndevs, ndevs);
+		return 1;
+	}
+	dev_stripe_unit(sb.s_stripe_unit);
+
+	// Step 2: every free run of the data region up to the image size, one discard each
+	if (bio_read(sb.d_bitmap_blk, block) <= 0)
+	{
+		fprintf(stderr, "Failed to read data block bitmap\n");
+		return 1;
+	}
+	long long before = host_usage(argv[optind]);
+	int nblocks = sb_nblocks(&sb);
+	int blocks = 0, runs = 0, failed = 0;
+	for (int b = sb.d_start_blk; b < nblocks; )
+	{
+		if (get_bitmap(d_bitmap, b))
+		{
+			b++;
+			continue;
+		}
+		int start = b;
+		while (b < nblocks && !get_bitmap(d_bitmap, b))
+			b++;
+		blocks += b - start;
+		runs++;
+		if (dry_run)
+			printf("free: blocks %d-%d\n", start, b - 1);
+		else if (bio_discard(start, b - start) < 0)
+			failed++;
+	}
+	if (!dry_run)
+		dev_sync();
+	dev_close();
+
+	printf("%s: %d free blocks in %d runs%s, host usage %lld -> %lld kB\n", argv[optind], blocks, runs,
+		   dry_run ? " (not discarded)" : "", before / 1024, host_usage(argv[optind]) / 1024);
+	if (failed)
+	{
+		fprintf(stderr, "%d runs could not be discarded\n", failed);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	scratch.c
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "block.h"
+#include "scratch.h"
+
+struct scratch_pool {
+	char slots[SCRATCH_SLOTS][BLOCK_SIZE];
+	uint32_t used;					/* bit i is set while slot i is handed out */
+};
+
+static __thread struct scratch_pool pool __attribute__((aligned(BLOCK_SIZE)));
+
+void *scratch_get()
+{
+	uint32_t avail = ~pool.used & ((1u << SCRATCH_SLOTS) - 1);
+	if (avail != 0)
+	{
+		int i = __builtin_ctz(avail);
+		pool.used |= 1u << i;
+		return pool.slots[i];
+	}
+
+	// nested deeper than the pool, fall back to the heap
+	return block_alloc(BLOCK_SIZE);
+}
+
+void scratch_put(void *buf)
+{
+	char *p = (char *)buf;
+	if (p >= pool.slots[0] && p < pool.slots[SCRATCH_SLOTS])
+		pool.used &= ~(1u << ((p - pool.slots[0]) / BLOCK_SIZE));
+	else
+		free(buf);
+}
+
+void *block_alloc(size_t size)
+{
+	void *buf;
+	if (posix_memalign(&buf, BLOCK_SIZE, size ? size : 1) != 0)
+		return NULL;
+	return buf;
+}
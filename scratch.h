@@ -0,0 +1,29 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	scratch.h
+ *
+ */
+
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+#include <stddef.h>
+
+/*
+ * Per-thread pool of block sized, block aligned scratch buffers, so block
+ * accesses do not go through malloc/free. Buffers may be returned in any
+ * order. If a thread nests deeper than the pool, buffers come from the heap.
+ */
+#define SCRATCH_SLOTS 16
+
+/* Returns a BLOCK_SIZE buffer aligned to BLOCK_SIZE, or NULL if out of memory */
+void *scratch_get();
+
+/* Returns a buffer from scratch_get(), or frees one that came from malloc */
+void scratch_put(void *buf);
+
+/* Heap buffer of size bytes aligned to BLOCK_SIZE, released with free() */
+void *block_alloc(size_t size);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Static tracepoints of the "rufs" provider. Where <sys/sdt.h> is installed
+ * (systemtap-sdt-dev) each one is a USDT probe: a single nop in the running
+ * process until bpftrace or perf attaches to it, e.g.
+ *
+ *	bpftrace -e 'usdt:./rufs:rufs:bio_done { @[arg0] = hist(arg3); }' -p PID
+ *
+ * Without the header, or built with -DRUFS_NO_TRACE, they compile to nothing
+ * and their arguments are not evaluated. rufs_lat.bt has the probe list.
+ */
+#if !defined(RUFS_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RUFS_TRACE 1
+#endif
+#endif
+
+#ifdef RUFS_TRACE
+#define TRACE1(name, a) DTRACE_PROBE1(rufs, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(rufs, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(rufs, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(rufs, name, a, b, c, d)
+#else
+#define TRACE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define TRACE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define TRACE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define TRACE4(name, a, b, c, d) do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif
+
+#endif